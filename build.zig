@@ -4,6 +4,10 @@ pub fn build(b: *std.Build) void {
     const target = b.standardTargetOptions(.{});
     const optimize = b.standardOptimizeOption(.{});
 
+    // asio's io_uring backend for sockets as well as files (Linux 5.10+, links liburing). asio is compiled separately,
+    // so every module that includes it must see the same macros.
+    const io_uring = b.option(bool, "io_uring", "Use asio's io_uring backend instead of epoll") orelse false;
+
     const gtest_dep = b.dependency("googletest", .{});
 
     const gtest_main = b.addLibrary(.{
@@ -43,6 +47,12 @@ pub fn build(b: *std.Build) void {
     asio.root_module.addCMacro("ASIO_SEPARATE_COMPILATION", "1");
     asio.root_module.addCMacro("ASIO_ENABLE_CANCELIO", "1");
     asio.root_module.addCMacro("_REENTRANT", "1");
+    asio.root_module.addCMacro("ASIO_RECYCLING_ALLOCATOR_CACHE_SIZE", "16");
+    if (io_uring) {
+        asio.root_module.addCMacro("ASIO_HAS_IO_URING", "1");
+        asio.root_module.addCMacro("ASIO_DISABLE_EPOLL", "1");
+        asio.root_module.linkSystemLibrary("uring", .{});
+    }
 
     // Add include directory
     asio.root_module.addIncludePath(asio_dep.path("asio/include"));
@@ -87,12 +97,24 @@ pub fn build(b: *std.Build) void {
     });
     lib.root_module.addIncludePath(b.path("include"));
     lib.root_module.linkLibrary(asio);
+    if (io_uring) useIoUring(lib.root_module);
     lib.root_module.addCSourceFiles(.{
         .root = b.path("src"),
         .files = &.{
+            "buffer_pool.cpp",
             "client.cpp",
+            "fast_open.cpp",
+            "frame_allocator.cpp",
+            "happy_eyeballs.cpp",
+            "metrics.cpp",
             "server.cpp",
             "protocol.cpp",
+            "resolver_cache.cpp",
+            "splice.cpp",
+            "timing_wheel.cpp",
+            "udp_batch.cpp",
+            "udp_nat.cpp",
+            "udp_shared_relay.cpp",
         },
         .flags = &.{
             "-std=gnu++23",
@@ -116,6 +138,7 @@ pub fn build(b: *std.Build) void {
     });
     server.root_module.addIncludePath(b.path("include"));
     server.root_module.linkLibrary(lib);
+    if (io_uring) useIoUring(server.root_module);
     server.root_module.addCSourceFile(.{
         .file = b.path("src/main_server.cpp"),
         .flags = &.{
@@ -142,6 +165,7 @@ pub fn build(b: *std.Build) void {
     });
     benchmark.root_module.addIncludePath(b.path("include"));
     benchmark.root_module.linkLibrary(lib);
+    if (io_uring) useIoUring(benchmark.root_module);
     benchmark.root_module.addCSourceFile(.{
         .file = b.path("src/bench_throughput.cpp"),
         .flags = &.{"-std=gnu++23"},
@@ -156,6 +180,31 @@ pub fn build(b: *std.Build) void {
         benchmark_cmd.addArgs(args);
     }
 
+    const bench_protocol = b.addExecutable(.{
+        .name = "bench_protocol",
+        .root_module = b.createModule(.{
+            .target = target,
+            .optimize = optimize,
+            .link_libcpp = true,
+        }),
+    });
+    bench_protocol.root_module.addIncludePath(b.path("include"));
+    bench_protocol.root_module.linkLibrary(lib);
+    if (io_uring) useIoUring(bench_protocol.root_module);
+    bench_protocol.root_module.addCSourceFile(.{
+        .file = b.path("src/bench_protocol.cpp"),
+        .flags = &.{"-std=gnu++23"},
+        .language = .cpp,
+    });
+
+    const bench_protocol_step = b.step("bench_protocol", "Run protocol encode/decode microbenchmarks");
+    const bench_protocol_cmd = b.addRunArtifact(bench_protocol);
+    bench_protocol_step.dependOn(&bench_protocol_cmd.step);
+    bench_protocol_cmd.step.dependOn(b.getInstallStep());
+    if (b.args) |args| {
+        bench_protocol_cmd.addArgs(args);
+    }
+
     const exe = b.addExecutable(.{
         .name = "tests",
         .root_module = b.createModule(.{
@@ -167,8 +216,16 @@ pub fn build(b: *std.Build) void {
     exe.root_module.addCSourceFiles(.{
         .root = b.path("tests"),
         .files = &.{
+            "test_allocations.cpp",
+            "test_buffer_pool.cpp",
             "test_compliance.cpp",
+            "test_frame_allocator.cpp",
+            "test_happy_eyeballs.cpp",
             "test_integration.cpp",
+            "test_metrics.cpp",
+            "test_protocol.cpp",
+            "test_resolver_cache.cpp",
+            "test_timing_wheel.cpp",
             "test_udp.cpp",
         },
         .flags = &.{"-std=gnu++23"},
@@ -176,6 +233,7 @@ pub fn build(b: *std.Build) void {
     });
     exe.root_module.linkLibrary(lib);
     exe.root_module.linkLibrary(gtest_main);
+    if (io_uring) useIoUring(exe.root_module);
 
     const test_step = b.step("test", "Run tests");
     const test_cmd = b.addRunArtifact(exe);
@@ -185,3 +243,8 @@ pub fn build(b: *std.Build) void {
         test_cmd.addArgs(args);
     }
 }
+
+fn useIoUring(module: *std.Build.Module) void {
+    module.addCMacro("ASIO_HAS_IO_URING", "1");
+    module.addCMacro("ASIO_DISABLE_EPOLL", "1");
+}
@@ -5,6 +5,11 @@
 #define ASIO_SEPARATE_COMPILATION
 #define ASIO_ENABLE_CANCELIO
 #define _REENTRANT
+// Blocks asio's per-thread recycling allocator keeps for each purpose (operation state, coroutine frames, ...), up
+// from 2. A CONNECT session has more than two of each in flight, and every one past the cache went back to the heap.
+// Must match build.zig, which compiles asio with the same value. Only blocks of up to 1020 bytes are cached, so
+// Server's coroutines keep large objects (buffers, Address) out of their frames.
+#define ASIO_RECYCLING_ALLOCATOR_CACHE_SIZE 16
 
 #include <asio.hpp>
 
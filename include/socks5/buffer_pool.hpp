@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace socks5 {
+
+// Relay buffers come in power-of-two size classes: 4 KiB, 8 KiB, ... 256 KiB
+constexpr size_t MIN_BUFFER_SIZE = 4 * 1024;
+constexpr size_t MAX_BUFFER_SIZE = 256 * 1024;
+constexpr size_t BUFFER_SIZE_CLASSES = 7;
+
+// Upper bound on idle memory each thread keeps per size class
+constexpr size_t MAX_IDLE_BYTES_PER_CLASS = 4 * 1024 * 1024;
+
+class PooledBuffer;
+
+// Per-thread free lists of relay buffers, one per size class. A buffer may be released on another thread than the
+// one that acquired it; it then joins that thread's free list.
+class BufferPool {
+  public:
+    static BufferPool& local();
+
+    // Returns a buffer of at least `size` bytes (clamped to MAX_BUFFER_SIZE)
+    PooledBuffer acquire(size_t size);
+
+    static size_t class_size(size_t size_class) { return MIN_BUFFER_SIZE << size_class; }
+    static size_t size_class_for(size_t size);
+
+    // Buffers of a size class waiting in this pool to be reused
+    size_t idle(size_t size_class) const { return free_[size_class].size(); }
+
+    ~BufferPool();
+
+  private:
+    friend class PooledBuffer;
+    void release(uint8_t* data, size_t size_class);
+
+    std::array<std::vector<uint8_t*>, BUFFER_SIZE_CLASSES> free_;
+};
+
+// Move-only handle that returns its memory to the calling thread's pool on destruction
+class PooledBuffer {
+  public:
+    PooledBuffer() = default;
+    PooledBuffer(PooledBuffer&& other) noexcept : data_(other.data_), size_class_(other.size_class_) {
+        other.data_ = nullptr;
+    }
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer() { reset(); }
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return data_ ? BufferPool::class_size(size_class_) : 0; }
+    size_t size_class() const { return size_class_; }
+    std::span<uint8_t> span() const { return {data_, size()}; }
+    explicit operator bool() const { return data_ != nullptr; }
+
+    void reset();
+
+  private:
+    friend class BufferPool;
+    PooledBuffer(uint8_t* data, size_t size_class) : data_(data), size_class_(size_class) {}
+
+    uint8_t* data_ = nullptr;
+    size_t size_class_ = 0;
+};
+
+// Starts a T's lifetime at the front of a buffer from the calling thread's pool, which `block` then holds. T must need
+// no destructor, so that releasing the buffer is all it takes to free it.
+template <typename T>
+T* place_pooled(PooledBuffer& block) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    static_assert(sizeof(T) <= MAX_BUFFER_SIZE && alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    block = BufferPool::local().acquire(sizeof(T));
+    return new (block.data()) T;
+}
+
+// Sizes the buffer of one relay direction. Starts at the smallest class, doubles after reads keep filling the
+// buffer, steps down after a run of short reads and drops back to the smallest class when the flow goes quiet.
+class AdaptiveBuffer {
+  public:
+    static constexpr unsigned GROW_AFTER_FULL_READS = 2;
+    static constexpr unsigned SHRINK_AFTER_SHORT_READS = 8;
+    static constexpr auto QUIET_PERIOD = std::chrono::seconds(1);
+
+    // Buffer of the current size class, (re)acquired from the pool when the class changed
+    std::span<uint8_t> get() {
+        if (!buffer_ || buffer_.size_class() != size_class_)
+            buffer_ = BufferPool::local().acquire(BufferPool::class_size(size_class_));
+        return buffer_.span();
+    }
+
+    // Feeds back how many bytes the last read returned and how long it waited for them
+    void record_read(size_t n, std::chrono::steady_clock::duration waited) {
+        if (waited >= QUIET_PERIOD) {
+            size_class_ = 0;
+            full_reads_ = short_reads_ = 0;
+            return;
+        }
+
+        size_t capacity = BufferPool::class_size(size_class_);
+        if (n == capacity) {
+            short_reads_ = 0;
+            if (++full_reads_ >= GROW_AFTER_FULL_READS && size_class_ + 1 < BUFFER_SIZE_CLASSES) {
+                ++size_class_;
+                full_reads_ = 0;
+            }
+        } else if (n < capacity / 4) {
+            full_reads_ = 0;
+            if (++short_reads_ >= SHRINK_AFTER_SHORT_READS && size_class_ > 0) {
+                --size_class_;
+                short_reads_ = 0;
+            }
+        } else {
+            full_reads_ = short_reads_ = 0;
+        }
+    }
+
+    // Returns the buffer to the pool; the next get() acquires a fresh one
+    void release() { buffer_.reset(); }
+
+    // Hands the buffer over to the caller, e.g. to queue it for a later write; the next get() acquires a fresh one
+    PooledBuffer take() { return std::move(buffer_); }
+
+    size_t size_class() const { return size_class_; }
+
+  private:
+    PooledBuffer buffer_;
+    size_t size_class_ = 0;
+    unsigned full_reads_ = 0;
+    unsigned short_reads_ = 0;
+};
+
+} // namespace socks5
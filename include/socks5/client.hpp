@@ -7,12 +7,18 @@
 
 namespace socks5 {
 
+struct ClientOptions {
+    // Carry the greeting in the SYN with TCP Fast Open, where the platform supports it (see fast_open_supported())
+    bool fast_open = false;
+};
+
 class Client {
   public:
     // Connects to the proxy, performs handshake, and requests connection to target.
     // Returns the connected socket ready for data transfer.
     static asio::awaitable<void> connect(asio::ip::tcp::socket& socket, const asio::ip::tcp::endpoint& proxy_endpoint,
-                                         const std::string& target_host, uint16_t target_port);
+                                         const std::string& target_host, uint16_t target_port,
+                                         ClientOptions options = {});
 
     // Assumes socket is already connected to proxy. Performs SOCKS5 handshake.
     static asio::awaitable<void> handshake(asio::ip::tcp::socket& socket, const std::string& target_host,
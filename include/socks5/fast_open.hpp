@@ -0,0 +1,21 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <system_error>
+
+namespace socks5 {
+
+// True when this build can use TCP Fast Open (Linux only). The kernel must also allow it: net.ipv4.tcp_fastopen bit 1
+// enables the client side, bit 2 the server side.
+bool fast_open_supported();
+
+// Lets `acceptor` take data carried in SYNs, keeping at most `queue_length` such connections pending. Call before
+// listen().
+std::error_code enable_fast_open_listener(asio::ip::tcp::acceptor& acceptor, int queue_length);
+
+// Makes the next connect on the open `socket` return at once and send the first write inside the SYN, falling back to
+// a regular handshake when the peer has not handed out a cookie yet.
+std::error_code enable_fast_open_connect(asio::ip::tcp::socket& socket);
+
+} // namespace socks5
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <cstddef>
+#include <new>
+
+namespace socks5 {
+
+// Per-thread segregated free lists for asynchronous operation state and other short-lived per-session blocks. Sizes are rounded up to
+// GRANULARITY; blocks larger than MAX_RECYCLED_SIZE go straight to the global heap. A block may be freed on another
+// thread than the one that allocated it; it then joins that thread's free list.
+class FrameAllocator {
+  public:
+    static constexpr size_t GRANULARITY = 64;
+    static constexpr size_t MAX_RECYCLED_SIZE = 8 * 1024;
+    static constexpr size_t SIZE_CLASSES = MAX_RECYCLED_SIZE / GRANULARITY;
+    // Upper bounds on the idle blocks each thread keeps: per size class, and in bytes across all classes. The block
+    // cap alone would let a thread hold SIZE_CLASSES * MAX_FREE_PER_CLASS blocks of up to 8 KiB, about 0.5 GiB.
+    static constexpr size_t MAX_FREE_PER_CLASS = 1024;
+    static constexpr size_t MAX_FREE_BYTES = 16 * 1024 * 1024;
+
+    static void* allocate(size_t size);
+    static void deallocate(void* pointer, size_t size) noexcept;
+
+    // Bytes of the blocks waiting in this thread's free lists to be reused
+    static size_t idle_bytes();
+};
+
+// Standard allocator over FrameAllocator, used as the associated allocator of completion handlers
+template <typename T>
+class RecyclingAllocator {
+  public:
+    using value_type = T;
+
+    RecyclingAllocator() noexcept = default;
+    template <typename U>
+    RecyclingAllocator(const RecyclingAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+        else
+            return static_cast<T*>(FrameAllocator::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t n) noexcept {
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            ::operator delete(pointer, n * sizeof(T), std::align_val_t{alignof(T)});
+        else
+            FrameAllocator::deallocate(pointer, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const RecyclingAllocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+// as_tuple(use_awaitable) whose per-operation state is recycled through the calling thread's FrameAllocator
+inline const auto use_recycled_awaitable =
+    asio::bind_allocator(RecyclingAllocator<void>(), asio::as_tuple(asio::use_awaitable));
+
+} // namespace socks5
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <chrono>
+#include <expected>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+namespace socks5 {
+
+// Most addresses one connect races; any beyond are ignored. At the default delay and timeout no race gets past the
+// 40th attempt, and resolvers rarely return more than a handful.
+constexpr size_t MAX_CONNECT_ENDPOINTS = 16;
+
+struct HappyEyeballsOptions {
+    // RFC 8305 "Connection Attempt Delay": how long an attempt gets before the next address is tried in parallel
+    std::chrono::milliseconds attempt_delay{250};
+
+    // Limit for the whole race
+    std::chrono::milliseconds timeout{10000};
+
+    // Connect with TCP_FASTOPEN_CONNECT so the first write rides in the SYN. Once the target has handed out a cookie
+    // the connect completes without waiting for the handshake, so the first address wins the race outright and an
+    // unreachable one only shows up as a failed write.
+    bool fast_open = false;
+};
+
+// Per-destination connect timings, shared by every shard. Steers the next connection to the family that connected
+// faster last time.
+class ConnectHistory {
+  public:
+    explicit ConnectHistory(size_t max_entries = 4096) : max_entries_(max_entries) {}
+
+    // Smoothed like TCP's SRTT (7/8 old, 1/8 new)
+    void record_success(std::string_view destination, const asio::ip::address& address,
+                        std::chrono::nanoseconds elapsed);
+
+    // A failed family is ranked as if it had taken `penalty` to connect
+    void record_failure(std::string_view destination, const asio::ip::address& address,
+                        std::chrono::nanoseconds penalty);
+
+    // Family to try first, or nullopt when nothing is known about `destination`
+    std::optional<bool> prefers_v6(std::string_view destination) const;
+
+  private:
+    // Lets a destination be looked up without building a std::string; only a new one is copied in
+    struct DestinationHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view destination) const { return std::hash<std::string_view>{}(destination); }
+    };
+
+    struct FamilyTiming {
+        std::chrono::nanoseconds smoothed{0}; // Zero: never tried
+        bool last_failed = false;
+    };
+
+    struct Timings {
+        FamilyTiming v4;
+        FamilyTiming v6;
+    };
+
+    void update(std::string_view destination, bool v6, std::chrono::nanoseconds sample, bool failed);
+
+    size_t max_entries_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Timings, DestinationHash, std::equal_to<>> timings_;
+};
+
+// Reorders endpoints in place so that families alternate, starting with the preferred one. The relative order within
+// a family (RFC 6724, as returned by the resolver) is kept.
+void interleave_families(std::span<asio::ip::tcp::endpoint> endpoints, bool v6_first);
+
+// Connects to the first endpoint that answers, racing at most MAX_CONNECT_ENDPOINTS of them. Attempts start
+// attempt_delay apart, or as soon as the previous one fails; the first success wins and the others are cancelled. When
+// `history` is given with a non-empty `destination`, the family order comes from it and the outcome is fed back under
+// `destination`; the race keeps copies of both views, so they need only outlive the co_await. The attempts share state
+// unguarded, so the calling executor must not run handlers concurrently (one thread per io_context, as every shard
+// does).
+asio::awaitable<std::expected<asio::ip::tcp::socket, std::error_code>>
+happy_eyeballs_connect(std::span<const asio::ip::tcp::endpoint> endpoints, HappyEyeballsOptions options,
+                       ConnectHistory* history = nullptr, std::string_view destination = {});
+
+} // namespace socks5
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace socks5 {
+
+enum class Direction : size_t {
+    UPSTREAM,  // Client to target
+    DOWNSTREAM // Target to client
+};
+
+enum class TimeoutPhase : size_t {
+    HANDSHAKE, // Greeting and request not complete in time
+    IDLE       // Established tunnel without traffic
+};
+
+// Why the UDP relay dropped a datagram
+enum class UdpDrop : size_t {
+    TRUNCATED,    // Larger than a receive slot
+    MALFORMED,    // Short, bad RSV or unknown ATYP
+    FRAGMENTED,   // FRAG != 0; fragments are not reassembled
+    UNRESOLVED,   // The destination name did not resolve
+    PENDING_FULL, // Too much held back while destinations resolve
+    UNSOLICITED,  // From a sender no association can be matched to
+    SEND_FAILED,  // Rejected by the kernel, or no room left in the send queue
+    NO_PORT,      // Shared relay: no outbound port free to tell the flow's replies apart, and none may be opened
+};
+
+// Consecutive stretches of a CONNECT session's setup, timed from the accept
+enum class HandshakePhase : size_t {
+    GREETING, // Accept to greeting parsed
+    REQUEST,  // Greeting parsed to request parsed, including our method reply
+    RESOLVE,  // Looking up the target's name; not recorded for IP literals
+    CONNECT,  // Connecting to the target
+    REPLY,    // Writing the success reply
+    TOTAL,    // Accept to success reply written
+};
+
+constexpr size_t DIRECTIONS = 2;
+constexpr size_t TIMEOUT_PHASES = 2;
+constexpr size_t UDP_DROP_REASONS = 8;
+constexpr size_t REPLY_CODES = 9; // Reply::SUCCEEDED .. Reply::ADDRESS_TYPE_NOT_SUPPORTED
+constexpr size_t HANDSHAKE_PHASES = 6;
+
+std::string_view handshake_phase_name(HandshakePhase phase);
+
+// A counter written by one thread only. Increments are a relaxed load and store rather than a read-modify-write, so
+// they cost what a plain increment does and never bounce a cache line between cores; scrapes read it from elsewhere.
+class Counter {
+  public:
+    void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear histogram of durations in microseconds, in the manner of HDR histograms: every power of two is split into
+// SUB_BUCKETS linear buckets, so a value lands in a bucket at most an eighth as wide as itself. Fixed size, so
+// recording never allocates, and histograms merge by adding bucket counts. Plain uint64_t histograms serve snapshots
+// and single-threaded recorders such as the benchmarks.
+template <typename T>
+struct BasicHistogram {
+    static constexpr size_t SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+    static constexpr size_t MAX_EXPONENT = 35; // About 9.5 hours; longer durations share the last bucket
+    static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    std::array<T, BUCKETS> counts{};
+    T sum{}; // Microseconds
+
+    static size_t bucket(uint64_t value) {
+        if (value < SUB_BUCKETS)
+            return static_cast<size_t>(value);
+        size_t exponent = static_cast<size_t>(std::bit_width(value)) - 1;
+        if (exponent > MAX_EXPONENT)
+            return BUCKETS - 1;
+        size_t sub = static_cast<size_t>(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    // Largest value that lands in bucket `index`
+    static uint64_t highest(size_t index) {
+        if (index < SUB_BUCKETS)
+            return index;
+        size_t shift = index / SUB_BUCKETS - 1;
+        uint64_t sub = index % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    void record(std::chrono::steady_clock::duration elapsed) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        auto value = static_cast<uint64_t>(std::max<int64_t>(us, 0));
+        if constexpr (std::is_same_v<T, Counter>) {
+            counts[bucket(value)].add();
+            sum.add(value);
+        } else {
+            ++counts[bucket(value)];
+            sum += value;
+        }
+    }
+
+    // Adds the counts of another histogram, e.g. a thread's Counters into a snapshot
+    template <typename U>
+    void merge(const BasicHistogram<U>& other) {
+        auto load = [](const U& count) -> uint64_t {
+            if constexpr (std::is_same_v<U, Counter>)
+                return count.value();
+            else
+                return count;
+        };
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts[i] += load(other.counts[i]);
+        sum += load(other.sum);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const auto& c : counts)
+            total += c;
+        return total;
+    }
+
+    // Nearest-rank `quantile` (0..1] of the recorded values, as the upper edge of its bucket in microseconds; 0 when
+    // nothing was recorded
+    uint64_t percentile(double quantile) const {
+        uint64_t total = count();
+        if (total == 0)
+            return 0;
+        auto rank = static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(total)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank)
+                return highest(i);
+        }
+        return highest(BUCKETS - 1);
+    }
+};
+
+// Server metrics, as per-thread Counters or as the plain totals a scrape merges them into
+template <typename T>
+struct BasicMetrics {
+    T sessions_accepted{};
+    T sessions_closed{};
+    std::array<T, REPLY_CODES> sessions_failed{}; // By the Reply code sent
+    std::array<T, TIMEOUT_PHASES> timeouts{};
+    std::array<T, DIRECTIONS> relay_bytes{}; // TCP tunnels
+    std::array<T, DIRECTIONS> udp_forwarded{};
+    std::array<T, UDP_DROP_REASONS> udp_dropped{};
+    std::array<BasicHistogram<T>, HANDSHAKE_PHASES> handshake{};
+
+    T& failed(uint8_t reply) { return sessions_failed[reply < REPLY_CODES ? reply : 1]; }
+    T& bytes(Direction direction) { return relay_bytes[static_cast<size_t>(direction)]; }
+    T& timeout(TimeoutPhase phase) { return timeouts[static_cast<size_t>(phase)]; }
+    T& forwarded(Direction direction) { return udp_forwarded[static_cast<size_t>(direction)]; }
+    T& dropped(UdpDrop reason) { return udp_dropped[static_cast<size_t>(reason)]; }
+    BasicHistogram<T>& phase(HandshakePhase phase) { return handshake[static_cast<size_t>(phase)]; }
+    const BasicHistogram<T>& phase(HandshakePhase phase) const { return handshake[static_cast<size_t>(phase)]; }
+};
+
+using ThreadMetrics = BasicMetrics<Counter>;
+using Histogram = BasicHistogram<uint64_t>;
+
+// Percentiles of one handshake phase
+struct LatencySummary {
+    uint64_t count;
+    std::chrono::microseconds p50;
+    std::chrono::microseconds p99;
+    std::chrono::microseconds p999;
+
+    static LatencySummary of(const Histogram& histogram);
+};
+
+struct MetricsSnapshot : BasicMetrics<uint64_t> {
+    // Filled in by the server from its ResolverCache, which keeps its own counts
+    uint64_t resolver_hits = 0;
+    uint64_t resolver_negative_hits = 0;
+    uint64_t resolver_misses = 0;
+    uint64_t resolver_coalesced = 0;
+};
+
+class Metrics {
+  public:
+    // The calling thread's counters. Registered on first use; when the thread exits they are folded into a total
+    // kept for later scrapes.
+    static ThreadMetrics& local();
+
+    // Sums the counters of every thread, live or exited
+    static MetricsSnapshot collect();
+};
+
+// Renders a snapshot in the Prometheus text exposition format (version 0.0.4)
+std::string render_prometheus(const MetricsSnapshot& metrics);
+
+} // namespace socks5
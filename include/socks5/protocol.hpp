@@ -2,11 +2,15 @@
 
 #include "asio_config.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <expected>
+#include <span>
 #include <string>
+#include <string_view>
 #include <system_error>
-#include <vector>
 
 namespace socks5 {
 
@@ -58,11 +62,61 @@ enum class Error {
 
 std::error_code make_error_code(Error e);
 
-// Helpers to read/write specific SOCKS5 structures asynchronously
+// Longest ATYP ADDR PORT: a 255-byte domain name with its length byte
+constexpr size_t MAX_ADDRESS_SIZE = 1 + 1 + 255 + 2;
+// Longest ATYP ADDR PORT with an IP address
+constexpr size_t MAX_IP_ADDRESS_SIZE = 1 + 16 + 2;
+// Longest request or reply, so a buffer of this size always fits what encode() writes
+constexpr size_t MAX_MESSAGE_SIZE = 3 + MAX_ADDRESS_SIZE;
+
+// Bytes ATYP ADDR PORT occupies, given ATYP and the byte after it (a domain name's length), or 0 for an unknown ATYP
+constexpr size_t address_size(AddressType type, uint8_t first) {
+    switch (type) {
+        case AddressType::IPV4:
+            return 1 + 4 + 2;
+        case AddressType::IPV6:
+            return 1 + 16 + 2;
+        case AddressType::DOMAIN_NAME:
+            return 1 + 1 + static_cast<size_t>(first) + 2;
+    }
+    return 0;
+}
+
+// A domain name held inline, up to the 255 bytes an address can carry, so messages with one never allocate
+class Domain {
+  public:
+    static constexpr size_t CAPACITY = 255;
+
+    constexpr Domain() = default;
+
+    // Fails, keeping the current name, if `name` is longer than CAPACITY
+    constexpr bool assign(std::string_view name) {
+        if (name.size() > CAPACITY)
+            return false;
+        std::copy(name.begin(), name.end(), data_.begin());
+        size_ = static_cast<uint8_t>(name.size());
+        return true;
+    }
+
+    constexpr std::string_view view() const { return {data_.data(), size_}; }
+    constexpr size_t size() const { return size_; }
+    constexpr bool empty() const { return size_ == 0; }
+
+  private:
+    std::array<char, CAPACITY> data_{};
+    uint8_t size_ = 0;
+};
+
+// ATYP ADDR PORT, as requests, replies and UDP headers carry it
+struct Address {
+    AddressType type = AddressType::IPV4;
+    asio::ip::address ip; // IPV4 or IPV6
+    Domain domain;        // DOMAIN_NAME
+    uint16_t port = 0;
 
-// Handshake: Client sends supported methods
-struct HandshakeRequest {
-    std::vector<AuthMethod> methods;
+    static Address of(const asio::ip::address& ip, uint16_t port);
+    // `host` as an IP address if it parses as one and as a domain name otherwise
+    static std::expected<Address, Error> of(const std::string& host, uint16_t port);
 };
 
 // Handshake: Server selects method
@@ -73,21 +127,92 @@ struct HandshakeResponse {
 // Request: Client asks to connect/bind
 struct Request {
     Command command;
-    AddressType address_type;
-    std::string domain;   // Used if address_type == DOMAIN
-    asio::ip::address ip; // Used if address_type == IPV4 or IPV6
-    uint16_t port;
+    Address address;
 };
 
 // Reply: Server responds to Request
 struct Response {
     Reply reply;
-    AddressType address_type;
-    std::string domain;
-    asio::ip::address ip;
-    uint16_t port;
+    Address address;
 };
 
+// Each writes the message to the front of `out` and returns its size, or 0 if `out` is too small for it
+
+// VER CMD RSV ATYP DST.ADDR DST.PORT
+size_t encode(const Request& request, std::span<uint8_t> out);
+// VER REP RSV ATYP BND.ADDR BND.PORT
+size_t encode(const Response& response, std::span<uint8_t> out);
+// ATYP ADDR PORT of an IP address; MAX_IP_ADDRESS_SIZE bytes always suffice
+size_t encode_address(const asio::ip::address& ip, uint16_t port, std::span<uint8_t> out);
+// VER REP RSV ATYP BND.ADDR BND.PORT of a successful request bound to an IP address; 3 + MAX_IP_ADDRESS_SIZE bytes
+// suffice. Unlike encode(Response), it builds no Address, so a coroutine calling it keeps none in its frame.
+size_t encode_success_reply(const asio::ip::address& ip, uint16_t port, std::span<uint8_t> out);
+// RSV FRAG ATYP ADDR PORT in front of a datagram `sender` sent to the client; 3 + MAX_IP_ADDRESS_SIZE bytes suffice
+size_t encode_udp_header(const asio::ip::udp::endpoint& sender, std::span<uint8_t> out);
+
+// Replies with nothing to fill in, built at compile time where the arguments are constants
+
+// VER METHOD
+constexpr std::array<uint8_t, 2> method_selection(AuthMethod method) {
+    return {VERSION, static_cast<uint8_t>(method)};
+}
+
+// VER REP RSV with an all-zero IPv4 BND.ADDR and BND.PORT, as a failed request gets
+constexpr std::array<uint8_t, 10> failure_reply(Reply reply) {
+    return {VERSION, static_cast<uint8_t>(reply), RSV, static_cast<uint8_t>(AddressType::IPV4), 0, 0, 0, 0, 0, 0};
+}
+
+// Decoded messages point into the bytes they were decoded from, which must outlive them
+
+// ATYP ADDR PORT in a received message
+struct AddressView {
+    std::span<const uint8_t> bytes; // As received, e.g. to key flows by
+
+    AddressType type() const { return static_cast<AddressType>(bytes[0]); }
+    uint16_t port() const { return static_cast<uint16_t>((bytes[bytes.size() - 2] << 8) | bytes[bytes.size() - 1]); }
+    asio::ip::address ip() const;     // IPV4 or IPV6
+    std::string_view domain() const; // DOMAIN_NAME
+};
+
+// VER NMETHODS METHODS
+struct GreetingView {
+    std::span<const uint8_t> methods;
+    size_t size = 0;
+
+    bool offers(AuthMethod method) const;
+};
+
+// VER CMD RSV ATYP DST.ADDR DST.PORT
+struct RequestView {
+    Command command;
+    AddressView address;
+    size_t size = 0;
+};
+
+// VER REP RSV ATYP BND.ADDR BND.PORT
+struct ReplyView {
+    Reply reply;
+    AddressView address;
+    size_t size = 0;
+};
+
+// RSV FRAG ATYP DST.ADDR DST.PORT in front of a relayed datagram. FRAG is left to the caller.
+struct UdpHeaderView {
+    uint8_t fragment;
+    AddressView address;
+    size_t size = 0; // Where the payload starts
+};
+
+// Incremental decoders for the handshake. Each looks at the front of `data` and returns a view whose size is the
+// number of bytes the message occupies, or 0 while it is still incomplete, so callers can decode straight out of
+// whatever a read returned and keep any bytes that follow.
+std::expected<GreetingView, Error> decode_greeting(std::span<const uint8_t> data);
+std::expected<RequestView, Error> decode_request(std::span<const uint8_t> data);
+std::expected<ReplyView, Error> decode_reply(std::span<const uint8_t> data);
+
+// A datagram arrives whole, so one too short for its header is malformed rather than incomplete
+std::expected<UdpHeaderView, Error> decode_udp_header(std::span<const uint8_t> datagram);
+
 } // namespace socks5
 
 namespace std {
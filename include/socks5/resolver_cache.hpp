@@ -0,0 +1,136 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace socks5 {
+
+// Outcome of one backend lookup. A ttl of zero means the backend does not know it.
+struct ResolveAnswer {
+    std::error_code error;
+    std::vector<asio::ip::address> addresses;
+    std::chrono::seconds ttl{0};
+};
+
+// Performs the lookups behind a ResolverCache. Tests plug in stubs.
+class ResolverBackend {
+  public:
+    using Callback = std::function<void(ResolveAnswer)>;
+
+    virtual ~ResolverBackend() = default;
+
+    // Resolves `host` and invokes `done` exactly once, from any thread (possibly before returning)
+    virtual void lookup(const std::string& host, Callback done) = 0;
+};
+
+// getaddrinfo on a private pool of threads, so that one slow name does not hold up lookups of the others.
+// getaddrinfo does not report TTLs.
+class SystemResolver : public ResolverBackend {
+  public:
+    static constexpr size_t DEFAULT_THREADS = 8;
+
+    explicit SystemResolver(size_t threads = DEFAULT_THREADS);
+    ~SystemResolver() override;
+
+    void lookup(const std::string& host, Callback done) override;
+
+  private:
+    asio::thread_pool pool_;
+};
+
+struct ResolverCacheOptions {
+    // When the backend reports none, which with SystemResolver is always: getaddrinfo hands back addresses only, so
+    // every answer lives this long whatever its record's TTL. Kept short so that a moved name is picked up quickly.
+    std::chrono::seconds default_ttl{30};
+    std::chrono::seconds min_ttl{1};
+    std::chrono::seconds max_ttl{3600};
+    std::chrono::seconds negative_ttl{5}; // How long NXDOMAIN answers are remembered
+    size_t max_entries = 4096;
+};
+
+// Server-wide, thread-safe name cache. Honors answer TTLs, remembers NXDOMAIN briefly and lets concurrent lookups of
+// the same name share one in-flight backend query. Once full it evicts the answer closest to expiry, expired ones
+// first. Completions run on each caller's associated executor.
+class ResolverCache : public std::enable_shared_from_this<ResolverCache> {
+  public:
+    using Addresses = std::shared_ptr<const std::vector<asio::ip::address>>;
+    using Handler = asio::any_completion_handler<void(std::error_code, Addresses)>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t negative_hits;
+        uint64_t misses;
+        uint64_t coalesced;
+    };
+
+    explicit ResolverCache(std::shared_ptr<ResolverBackend> backend = std::make_shared<SystemResolver>(),
+                           ResolverCacheOptions options = {});
+
+    // Fresh cached answer, if any, without suspending. A cached NXDOMAIN yields an error.
+    std::optional<std::expected<Addresses, std::error_code>> try_get(std::string_view host);
+
+    // Resolves through the cache. Supports per-operation cancellation.
+    template <typename CompletionToken>
+    auto async_resolve(std::string_view host, CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(std::error_code, Addresses)>(
+            [self = shared_from_this()](auto handler, std::string host) {
+                self->start(std::move(host), Handler(std::move(handler)));
+            },
+            token, std::string(host));
+    }
+
+    Stats stats() const;
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct Waiter {
+        uint64_t id;
+        Handler handler;
+    };
+
+    // Lets try_get look up a string_view without building a std::string
+    struct HostHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view host) const { return std::hash<std::string_view>{}(host); }
+    };
+
+    struct Entry {
+        Addresses addresses;
+        std::error_code error;
+        clock::time_point expires;
+        bool pending = false;
+        std::vector<Waiter> waiters;
+    };
+
+    void start(std::string host, Handler handler);
+    void complete(const std::string& host, ResolveAnswer answer);
+    void cancel(const std::string& host, uint64_t waiter_id);
+    void evict();
+    static void post_completion(Handler handler, std::error_code ec, Addresses addresses);
+
+    std::shared_ptr<ResolverBackend> backend_;
+    ResolverCacheOptions options_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry, HostHash, std::equal_to<>> entries_;
+    // Settled entries by expiry; the views point at the keys of entries_, whose nodes never move
+    std::set<std::pair<clock::time_point, std::string_view>> by_expiry_;
+    uint64_t next_waiter_id_ = 0;
+    Stats stats_{};
+};
+
+} // namespace socks5
@@ -1,29 +1,164 @@
 #pragma once
 
 #include "asio_config.hpp"
+#include "socks5/happy_eyeballs.hpp"
+#include "socks5/metrics.hpp"
+#include "socks5/resolver_cache.hpp"
+#include "socks5/timing_wheel.hpp"
+#include "socks5/udp_shared_relay.hpp"
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <expected>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 namespace socks5 {
 
+enum class RelayEngine {
+    COPY,     // Read into a user-space buffer and write it back out
+    SPLICE,   // Move bytes socket -> pipe -> socket with splice(2); falls back to COPY where unavailable
+    PIPELINED // Keep reading into fresh buffers while earlier chunks are still being written, and write what queued
+              // up with one gathered write
+};
+
+enum class UdpRelayMode {
+    PER_ASSOCIATION, // Each UDP ASSOCIATE binds its own socket and runs its own relay coroutine
+    SHARED           // Each shard relays for all its associations through a few sockets (SharedUdpRelay)
+};
+
+struct ServerOptions {
+    // Number of shards. Each shard owns an io_context, an SO_REUSEPORT acceptor and the sessions it accepts, and is
+    // driven by its own thread, so sessions never cross threads. Only honoured by the owning constructor.
+    size_t shards = 1;
+
+    // How CONNECT tunnels move bytes once established
+    RelayEngine relay_engine = RelayEngine::COPY;
+
+    // Name cache shared by every shard, for CONNECT targets and UDP destinations. Defaults to a cache over the system
+    // resolver; tests pass one over a stub backend.
+    std::shared_ptr<ResolverCache> resolver;
+
+    // Parallel connect to the addresses of CONNECT targets (RFC 8305). happy_eyeballs.fast_open enables TCP Fast Open
+    // towards targets.
+    HappyEyeballsOptions happy_eyeballs;
+
+    // Accept TCP Fast Open SYNs from clients, so a greeting carried in the SYN is answered one round trip earlier
+    bool fast_open_listen = false;
+
+    // Let the UDP relay use UDP_GRO on receive and UDP_SEGMENT on send where the kernel supports them
+    bool udp_offload = true;
+
+    // How UDP ASSOCIATE relays datagrams. SHARED trades a socket and a coroutine per association, plus a 256 KiB
+    // batch buffer while its datagrams flow, for a few hundred bytes of table entries, at the cost of dropping
+    // datagrams from senders the client has not sent to.
+    UdpRelayMode udp_relay = UdpRelayMode::PER_ASSOCIATION;
+
+    // Ports of each shard's relay in SHARED mode. A nonzero first_port gives shard i the range starting at
+    // first_port + i * ports.
+    SharedUdpRelayOptions shared_udp;
+
+    // Serve Prometheus metrics over HTTP at 127.0.0.1:<metrics_port>/metrics, from the first shard's io_context. 0
+    // picks an ephemeral port (see Server::metrics_port()); unset serves none.
+    std::optional<uint16_t> metrics_port;
+};
+
+// The reactor asio was built with, for logs and benchmark reports. `zig build -Dio_uring=true` selects io_uring.
+constexpr std::string_view io_backend() {
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(ASIO_HAS_IOCP)
+    return "iocp";
+#elif defined(ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+    return "kqueue";
+#else
+    return "select";
+#endif
+}
+
+// Point-in-time session counters of one shard
+struct ShardStats {
+    size_t active_sessions;
+    uint64_t total_sessions;
+};
+
 class Server {
   public:
-    // Bind to specific IP (default 0.0.0.0)
-    Server(asio::io_context& io_context, uint16_t port, const std::string& ip_address = "0.0.0.0");
+    // Bind to specific IP (default 0.0.0.0). Runs a single shard on the caller's io_context, which must be run by
+    // one thread at a time.
+    Server(asio::io_context& io_context, uint16_t port, const std::string& ip_address = "0.0.0.0",
+           ServerOptions options = {});
+
+    // Owns options.shards io_contexts. start() launches one thread per shard, stop() joins them.
+    Server(uint16_t port, const std::string& ip_address, ServerOptions options);
+
+    ~Server();
 
     void start();
+    void stop();
+
+    uint16_t port() const;
+    std::vector<ShardStats> shard_stats() const;
+
+    // Counters of every thread in the process, with this server's resolver cache counts
+    MetricsSnapshot metrics() const;
+    // p50/p99/p999 of each handshake phase over every session so far, indexed by HandshakePhase
+    std::array<LatencySummary, HANDSHAKE_PHASES> handshake_latency() const;
+    // Port of the metrics listener, or 0 when metrics are not served
+    uint16_t metrics_port() const;
 
   private:
-    asio::awaitable<void> listen();
-    asio::awaitable<void> handle_session(asio::ip::tcp::socket client_socket);
-    asio::awaitable<void> relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to);
+    struct Shard {
+        explicit Shard(asio::io_context& io_context)
+            : io_context(io_context), acceptor(io_context), metrics(io_context), wheel(io_context.get_executor()) {}
+
+        asio::io_context& io_context;
+        asio::ip::tcp::acceptor acceptor; // Left closed on shards fed by another shard's acceptor
+        asio::ip::tcp::acceptor metrics;  // HTTP metrics listener; first shard only, when enabled
+        TimingWheel wheel;                // Handshake and idle deadlines of this shard's sessions
+        std::atomic<size_t> active_sessions{0};
+        std::atomic<uint64_t> total_sessions{0};
+        std::shared_ptr<SharedUdpRelay> udp_relay; // UdpRelayMode::SHARED only
+    };
+
+    void open_acceptors(uint16_t port);
+    void open_udp_relays();
+    void open_metrics();
+
+    asio::awaitable<void> listen(std::shared_ptr<Shard> shard);
+    asio::awaitable<void> serve_metrics(std::shared_ptr<Shard> shard);
+    asio::awaitable<void> serve_scrape(std::shared_ptr<Shard> shard, asio::ip::tcp::socket socket);
+    asio::awaitable<void> handle_session(std::shared_ptr<Shard> shard, asio::ip::tcp::socket client_socket);
+    asio::awaitable<std::expected<ResolverCache::Addresses, std::error_code>> resolve(std::string_view host);
+    asio::awaitable<void> relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to, Deadline& deadline,
+                                Counter& relayed);
+
+    // RelayEngine::PIPELINED: a reader and a writer per direction, sharing a queue of filled buffers
+    struct RelayPipeline;
+    asio::awaitable<void> relay_pipelined(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to, Deadline& deadline,
+                                          Counter& relayed);
+    asio::awaitable<void> pipeline_read(asio::ip::tcp::socket& from, RelayPipeline& pipeline, Deadline& deadline);
+    asio::awaitable<void> pipeline_write(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to,
+                                         RelayPipeline& pipeline, Deadline& deadline, Counter& relayed);
     asio::awaitable<void> relay_udp(asio::ip::tcp::socket& control_socket, asio::ip::udp::socket udp_socket,
                                     asio::ip::address client_ip);
 
-    asio::io_context& io_context_;
-    asio::ip::tcp::acceptor acceptor_;
+    // Declared before shards_ so that idle shards release their acceptors while the contexts are still alive;
+    // shards referenced by live session frames are released when those frames are destroyed.
+    std::vector<std::unique_ptr<asio::io_context>> owned_contexts_;
+    std::vector<std::shared_ptr<Shard>> shards_;
+    std::vector<std::thread> threads_;
     std::string listen_ip_;
+    ServerOptions options_;
+    std::shared_ptr<ResolverCache> resolver_;
+    ConnectHistory connect_history_;
 };
 
 } // namespace socks5
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "asio_config.hpp"
+#include "socks5/metrics.hpp"
+#include "socks5/timing_wheel.hpp"
+
+#include <system_error>
+
+namespace socks5 {
+
+// True when this build can relay with splice(2) (Linux only)
+bool splice_supported();
+
+// Moves bytes from -> pipe -> to inside the kernel until EOF or error, waiting for readiness through asio and
+// touching `deadline` on progress; its expiry closes the sockets and ends the relay. Returns std::errc::not_supported
+// before any byte has moved when the pipe cannot be created or the kernel refuses to splice these sockets, so the
+// caller can fall back to a user-space copy loop. Bytes written to `to` are added to `relayed` when given.
+asio::awaitable<std::error_code> splice_relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to,
+                                              Deadline& deadline, Counter* relayed = nullptr);
+
+} // namespace socks5
@@ -5,6 +5,7 @@
 #include <asio/experimental/awaitable_operators.hpp>
 #include <expected>
 #include <system_error>
+#include <tuple>
 #include <variant>
 
 namespace socks5 {
@@ -38,7 +39,7 @@ auto with_timeout_nothrow(Op&& op, std::chrono::steady_clock::duration duration)
         if constexpr (!std::is_void_v<T>) {
             co_return std::get<1>(op_result);
         } else {
-            co_return T{};
+            co_return std::expected<T, std::error_code>{};
         }
     }
 
@@ -46,4 +47,19 @@ auto with_timeout_nothrow(Op&& op, std::chrono::steady_clock::duration duration)
     co_return std::unexpected(std::make_error_code(std::errc::timed_out));
 }
 
+// Converts the (error_code, T) tuple produced by asio::as_tuple into expected<T, error_code>, for operations whose
+// time limit is enforced elsewhere (e.g. by a session Deadline) and that need no timer of their own.
+template <typename T>
+std::expected<T, std::error_code> as_expected(std::tuple<std::error_code, T>&& result) {
+    if (std::get<0>(result))
+        return std::unexpected(std::get<0>(result));
+    return std::move(std::get<1>(result));
+}
+
+inline std::expected<void, std::error_code> as_expected(std::tuple<std::error_code>&& result) {
+    if (std::get<0>(result))
+        return std::unexpected(std::get<0>(result));
+    return {};
+}
+
 } // namespace socks5
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace socks5 {
+
+class TimingWheel;
+
+// An inactivity deadline tracked by a TimingWheel, typically one per session. Activity only bumps a timestamp; the
+// wheel re-checks that timestamp when the slot comes due and fires the callback once the deadline really passed.
+// Owned by the session and unlinked on destruction.
+class Deadline {
+  public:
+    using clock = std::chrono::steady_clock;
+    using Callback = void (*)(void* context);
+
+    Deadline() = default;
+    ~Deadline() { cancel(); }
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+
+    // (Re)arms the deadline to fire `timeout` after the last activity
+    void arm(TimingWheel& wheel, clock::duration timeout, Callback on_expire, void* context);
+    void cancel();
+
+    // Records activity. Costs a store; the wheel is not touched.
+    void touch();
+
+    bool armed() const { return wheel_ != nullptr; }
+    bool expired() const { return expired_; }
+
+  private:
+    friend class TimingWheel;
+
+    TimingWheel* wheel_ = nullptr;
+    Deadline* next_ = nullptr;
+    Deadline** pprev_ = nullptr;
+    uint64_t expiry_tick_ = 0;
+    clock::duration timeout_{};
+    clock::time_point last_activity_{};
+    Callback on_expire_ = nullptr;
+    void* context_ = nullptr;
+    bool expired_ = false;
+};
+
+// Hierarchical timing wheel driven by a single steady_timer. Not thread-safe: one wheel per shard, used only from
+// that shard's thread. The timer only ticks while deadlines are armed.
+class TimingWheel {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr clock::duration TICK = std::chrono::milliseconds(100);
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = uint64_t{1} << SLOT_BITS;
+    static constexpr size_t LEVELS = 3; // 64^3 ticks, a little over 7 hours
+
+    explicit TimingWheel(asio::any_io_executor executor);
+    ~TimingWheel();
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    // Time of the last tick; what Deadline::touch records
+    clock::time_point now() const { return now_; }
+    size_t size() const { return size_; }
+
+  private:
+    friend class Deadline;
+
+    void insert(Deadline& deadline, uint64_t expiry_tick);
+    void remove(Deadline& deadline);
+    void schedule();
+    void advance(clock::time_point now);
+    void cascade(size_t level);
+    void expire_slot(uint64_t tick);
+    uint64_t due_tick(const Deadline& deadline) const;
+
+    asio::steady_timer timer_;
+    // Lets a completion that was already queued when the wheel died notice it
+    std::shared_ptr<TimingWheel*> self_;
+    std::array<std::array<Deadline*, SLOTS>, LEVELS> slots_{};
+    clock::time_point epoch_;
+    clock::time_point now_;
+    uint64_t current_tick_ = 0;
+    size_t size_ = 0;
+    bool waiting_ = false;
+};
+
+inline void Deadline::touch() {
+    if (wheel_)
+        last_activity_ = wheel_->now();
+}
+
+} // namespace socks5
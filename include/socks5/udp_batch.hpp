@@ -0,0 +1,152 @@
+#pragma once
+
+#include "asio_config.hpp"
+#include "socks5/buffer_pool.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <system_error>
+
+namespace socks5 {
+
+// Receive slots share one buffer of the pool's largest class. Without GRO it is cut into one slot that takes any
+// datagram followed by 24 slots of 8 KiB, so one recvmmsg takes up to 25 datagrams. With GRO, and once datagrams larger
+// than a small slot have been seen, every slot takes 64 KiB: a coalesced super-packet or the largest datagram.
+constexpr size_t UDP_BATCH_SLOTS = 32; // Most messages one recvmmsg or sendmmsg handles
+constexpr size_t UDP_SLOT_SIZE = 8 * 1024;
+constexpr size_t UDP_LARGE_SLOT_SIZE = 64 * 1024;
+constexpr size_t UDP_SMALL_SLOTS = 1 + (MAX_BUFFER_SIZE - UDP_LARGE_SLOT_SIZE) / UDP_SLOT_SIZE;
+constexpr size_t UDP_LARGE_SLOTS = MAX_BUFFER_SIZE / UDP_LARGE_SLOT_SIZE;
+static_assert(UDP_SMALL_SLOTS <= UDP_BATCH_SLOTS);
+
+// Most segments the kernel coalesces into, or splits out of, one super-packet (UDP_MAX_SEGMENTS)
+constexpr size_t UDP_MAX_SEGMENTS = 64;
+
+// Most datagrams one receive can yield: every GRO slot full of segments
+constexpr size_t UDP_BATCH_DATAGRAMS = UDP_LARGE_SLOTS * UDP_MAX_SEGMENTS;
+
+// Receives and sends UDP datagrams in batches: recvmmsg/sendmmsg on Linux, a loop of non-blocking receive_from and
+// send_to elsewhere. Both calls are non-blocking; callers wait for readiness with async_wait. Payloads queued for
+// sending may point into the receive slots, so the outgoing queue must be flushed before the next receive().
+//
+// Buffers come from the pool only while there is traffic: receive() takes the slots and release() returns them, and
+// the queue's storage is taken by the first queue() and returned once everything queued has been sent. An idle batch
+// holds none.
+//
+// With offload on (Linux), UDP_GRO lets one receive slot take a run of same-flow datagrams as a single super-packet,
+// which data() hands out again as separate datagrams, and UDP_SEGMENT lets consecutive queued datagrams to the same
+// destination leave in one send. Each is used only where the kernel accepts it.
+class UdpBatch {
+  public:
+    // Largest SOCKS UDP header (IPv6 destination) that queue() copies in front of a payload
+    static constexpr size_t MAX_HEADER = 22;
+    // Most datagrams the outgoing queue holds: all that one receive() can yield
+    static constexpr size_t MAX_QUEUED = UDP_BATCH_DATAGRAMS;
+
+    explicit UdpBatch(asio::ip::udp::socket& socket, bool offload = true);
+
+    // Fills the receive slots with whatever is queued on the socket. Returns the number of datagrams; zero when
+    // nothing was waiting.
+    std::expected<size_t, std::error_code> receive(asio::ip::udp::socket& socket);
+
+    // Returns the receive slots to the pool. Call once done with the last receive's datagrams and with nothing queued
+    // still pointing into them, before waiting for readability.
+    void release();
+
+    // Whether the last receive() used every slot, so more datagrams are probably waiting
+    bool filled() const { return filled_; }
+
+    // Datagram `i` of the last receive(). Datagrams larger than a slot are cut short and flagged truncated; the
+    // first receive() to see one switches to large slots for good.
+    std::span<uint8_t> data(size_t i) const { return rx_->received[i].data; }
+    const asio::ip::udp::endpoint& sender(size_t i) const { return rx_->senders[rx_->received[i].slot]; }
+    bool truncated(size_t i) const { return rx_->received[i].truncated; }
+
+    // Adds a datagram of `header` followed by `payload` to the outgoing queue. Refuses it, returning false, once
+    // MAX_QUEUED datagrams are queued; send() makes room.
+    bool queue(std::span<const uint8_t> header, std::span<const uint8_t> payload, const asio::ip::udp::endpoint& to);
+    bool has_queued() const { return sent_ < outgoing_; }
+    bool full() const { return queued_ == MAX_QUEUED; }
+
+    // Sends as much of the queue as the socket takes. Returns the number of sends, or would_block when the socket
+    // takes none. A datagram the kernel rejects outright is dropped and its error returned.
+    std::expected<size_t, std::error_code> send(asio::ip::udp::socket& socket);
+
+    // Forgets everything queued, sent or not, and returns the queue's storage
+    void clear_queue();
+
+    bool gro() const { return gro_; }
+    bool gso() const { return gso_; }
+
+  private:
+    struct Received {
+        std::span<uint8_t> data;
+        uint8_t slot;
+        bool truncated;
+    };
+
+    // One send: `datagrams` datagrams of pieces_per_datagram pieces each, all segment_size bytes long except possibly
+    // the last. More than one datagram means a UDP_SEGMENT send.
+    struct Outgoing {
+        asio::ip::udp::endpoint to;
+        size_t first_piece;
+        size_t pieces_per_datagram;
+        size_t datagrams;
+        size_t segment_size;
+        size_t bytes;
+    };
+
+    // Senders and datagrams of the last receive()
+    struct ReceiveState {
+        std::array<asio::ip::udp::endpoint, UDP_BATCH_SLOTS> senders;
+        std::array<Received, UDP_BATCH_DATAGRAMS> received;
+    };
+
+    // The outgoing queue. Pieces point into headers, which never move while anything is queued.
+    struct QueueState {
+        std::array<std::array<uint8_t, MAX_HEADER>, MAX_QUEUED> headers;
+        std::array<std::span<const uint8_t>, 2 * MAX_QUEUED> pieces;
+        std::array<Outgoing, MAX_QUEUED> outgoing;
+    };
+
+    void acquire_slots();
+
+    // Slot 0 is always large; the rest are small until large_slots_
+    uint8_t* slot(size_t i) const {
+        if (large_slots_ || i == 0)
+            return slots_.data() + i * UDP_LARGE_SLOT_SIZE;
+        return slots_.data() + UDP_LARGE_SLOT_SIZE + (i - 1) * UDP_SLOT_SIZE;
+    }
+    size_t slot_size(size_t i) const { return large_slots_ || i == 0 ? UDP_LARGE_SLOT_SIZE : UDP_SLOT_SIZE; }
+
+    // Once a datagram larger than a small slot arrives, since more like it probably follow
+    void use_large_slots();
+
+    // Rewrites the unsent queue as one send per datagram, after the kernel refused a UDP_SEGMENT send
+    void split_segments();
+
+    size_t slot_count_ = UDP_SMALL_SLOTS;
+    bool large_slots_ = false;
+    bool gro_ = false;
+    bool gso_ = false;
+    bool filled_ = false;
+
+    // Pooled while receiving, from receive() to release()
+    PooledBuffer slots_;
+    PooledBuffer receive_block_; // Holds *rx_
+    ReceiveState* rx_ = nullptr;
+    size_t received_ = 0; // Datagrams of the last receive()
+
+    // Pooled while anything is queued
+    PooledBuffer queue_block_; // Holds *tx_
+    QueueState* tx_ = nullptr;
+    size_t pieces_ = 0;
+    size_t outgoing_ = 0; // Sends in the queue, sent or not
+    size_t queued_ = 0;   // Datagrams in the queue, sent or not; also the number of headers in use at most
+    size_t sent_ = 0;     // Sends at the front of the queue that already left
+};
+
+} // namespace socks5
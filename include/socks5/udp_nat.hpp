@@ -0,0 +1,71 @@
+#pragma once
+
+#include "asio_config.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace socks5 {
+
+// Destinations of one UDP association, keyed on the raw ATYP | DST.ADDR | DST.PORT bytes of the SOCKS UDP header so a
+// lookup hashes and compares bytes instead of building strings. Each entry keeps the resolved target and the header
+// that prefixes datagrams coming back from it. Small, fixed-size open addressing table: entries idle for longer than
+// IDLE_TIMEOUT are dropped, and when it is full the least recently used one makes room.
+class UdpNatTable {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t CAPACITY = 64;    // Slots; a power of two
+    static constexpr size_t MAX_ENTRIES = 48; // Keeps probe chains short
+    static constexpr auto IDLE_TIMEOUT = std::chrono::seconds(120);
+
+    // Longest key with an IP address: ATYP + 16 address bytes + port
+    static constexpr size_t MAX_IP_KEY = 19;
+    // SOCKS UDP header for a reply: RSV (2) + FRAG + the IP key
+    static constexpr size_t MAX_REPLY_HEADER = 3 + MAX_IP_KEY;
+
+    struct Entry {
+        asio::ip::udp::endpoint target;
+        std::array<uint8_t, MAX_REPLY_HEADER> reply_header;
+        size_t reply_header_size;
+        clock::time_point last_used;
+
+        std::span<const uint8_t> reply() const { return {reply_header.data(), reply_header_size}; }
+    };
+
+    // Live entry for `key`, refreshed as used at `now`. The pointer is valid until the next insert().
+    Entry* find(std::span<const uint8_t> key, clock::time_point now);
+
+    // Adds or replaces the entry for `key`, evicting idle or least recently used entries when full
+    Entry& insert(std::span<const uint8_t> key, const asio::ip::udp::endpoint& target, clock::time_point now);
+
+    size_t size() const { return size_; }
+
+    // Writes the ATYP | ADDR | PORT key of an IP endpoint into `out` and returns its length
+    static size_t encode(const asio::ip::udp::endpoint& endpoint, std::span<uint8_t, MAX_IP_KEY> out);
+
+  private:
+    struct Slot {
+        bool used = false;
+        uint64_t hash = 0;
+        std::string key;
+        Entry entry;
+    };
+
+    static uint64_t hash(std::span<const uint8_t> key);
+    size_t home(uint64_t hash) const { return hash & (CAPACITY - 1); }
+    bool matches(const Slot& slot, uint64_t hash, std::span<const uint8_t> key) const;
+    bool expired(const Entry& entry, clock::time_point now) const { return now - entry.last_used > IDLE_TIMEOUT; }
+
+    void erase(size_t index);
+    void make_room(clock::time_point now);
+
+    std::array<Slot, CAPACITY> slots_;
+    size_t size_ = 0;
+};
+
+} // namespace socks5
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "socks5/metrics.hpp"
+#include "socks5/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace socks5 {
+
+// ATYP | DST.ADDR | DST.PORT of a SOCKS UDP header, copied inline so that keying a table by it never allocates
+class DestinationKey {
+  public:
+    DestinationKey() = default;
+    // At most MAX_ADDRESS_SIZE bytes, as decode_udp_header hands out
+    explicit DestinationKey(std::span<const uint8_t> bytes)
+        : size_(static_cast<uint16_t>(std::min(bytes.size(), MAX_ADDRESS_SIZE))) {
+        std::copy_n(bytes.begin(), size_, bytes_.begin());
+    }
+
+    std::span<const uint8_t> bytes() const { return {bytes_.data(), size_}; }
+
+    bool operator==(const DestinationKey& other) const { return std::ranges::equal(bytes(), other.bytes()); }
+
+  private:
+    std::array<uint8_t, MAX_ADDRESS_SIZE> bytes_;
+    uint16_t size_ = 0;
+};
+
+struct DestinationKeyHash {
+    size_t operator()(const DestinationKey& key) const {
+        auto bytes = key.bytes();
+        return std::hash<std::string_view>{}({reinterpret_cast<const char*>(bytes.data()), bytes.size()});
+    }
+};
+
+// Datagrams held back while their destinations resolve, for both UDP relays. Bounded in destinations, and per
+// destination in datagrams and bytes; what does not fit is dropped as UdpDrop::PENDING_FULL.
+template <typename Key, typename Hash>
+class PendingDatagrams {
+  public:
+    using Datagrams = std::vector<std::vector<uint8_t>>; // Payloads, SOCKS header stripped
+
+    PendingDatagrams(size_t max_destinations, size_t max_datagrams, size_t max_bytes)
+        : max_destinations_(max_destinations), max_datagrams_(max_datagrams), max_bytes_(max_bytes) {}
+
+    // Holds `payload` for `key`. True when `key` was not pending yet, so the caller starts its resolution.
+    bool hold(const Key& key, std::span<const uint8_t> payload) {
+        auto it = pending_.find(key);
+        bool started = it == pending_.end();
+        if (started) {
+            if (pending_.size() >= max_destinations_) {
+                Metrics::local().dropped(UdpDrop::PENDING_FULL).add();
+                return false; // Too many lookups in flight: drop, and do not start another
+            }
+            it = pending_.try_emplace(key).first;
+        }
+        auto& queue = it->second;
+        if (queue.datagrams.size() < max_datagrams_ && queue.bytes + payload.size() <= max_bytes_) {
+            queue.datagrams.emplace_back(payload.begin(), payload.end());
+            queue.bytes += payload.size();
+        } else {
+            Metrics::local().dropped(UdpDrop::PENDING_FULL).add();
+        }
+        return started;
+    }
+
+    // What was held for `key`, which is no longer pending; nullopt when it was not
+    std::optional<Datagrams> take(const Key& key) {
+        auto node = pending_.extract(key);
+        if (node.empty())
+            return std::nullopt;
+        return std::move(node.mapped().datagrams);
+    }
+
+    // Drops what was held for a destination that did not resolve
+    void fail(const Key& key) {
+        if (auto datagrams = take(key))
+            Metrics::local().dropped(UdpDrop::UNRESOLVED).add(datagrams->size());
+    }
+
+    // Forgets every destination whose key matches, without counting drops
+    template <typename Predicate>
+    void forget_if(Predicate matches) {
+        std::erase_if(pending_, [&](const auto& entry) { return matches(entry.first); });
+    }
+
+    size_t size() const { return pending_.size(); }
+
+  private:
+    struct Queue {
+        Datagrams datagrams;
+        size_t bytes = 0;
+    };
+
+    size_t max_destinations_;
+    size_t max_datagrams_;
+    size_t max_bytes_;
+    std::unordered_map<Key, Queue, Hash> pending_;
+};
+
+} // namespace socks5
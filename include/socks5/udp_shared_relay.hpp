@@ -0,0 +1,156 @@
+#pragma once
+
+#include "asio_config.hpp"
+#include "socks5/resolver_cache.hpp"
+#include "socks5/udp_batch.hpp"
+#include "socks5/udp_pending.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace socks5 {
+
+struct SharedUdpRelayOptions {
+    // UDP sockets per shard that stay open. Socket 0 faces clients and is also the first outbound port; the others
+    // only talk to targets.
+    size_t ports = 4;
+
+    // First port of the shard's range, or 0 for ephemeral ports
+    uint16_t first_port = 0;
+
+    // Most sockets a shard grows to. Replies are told apart by the port they arrive on, so when more associations
+    // than `ports` talk to one target, the extra ones get ephemeral ports of their own, closed again once idle. Past
+    // this many, flows to a target no port is free for are dropped (UdpDrop::NO_PORT).
+    size_t max_ports = 1024;
+};
+
+// One shard's UDP relay, shared by all of the shard's UDP associations instead of a socket and coroutine each.
+// Datagrams from clients are matched to their association by source endpoint. Each (association, destination) flow is
+// mapped NAT-style onto an outbound port where no other association talks to the same target, so the port a reply
+// arrives on and its sender name exactly one flow; a port is opened for the flow when none is free. An association
+// costs a few hundred bytes of table entries.
+//
+// Runs on the shard's executor only; nothing here is synchronised.
+class SharedUdpRelay : public std::enable_shared_from_this<SharedUdpRelay> {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr auto FLOW_IDLE_TIMEOUT = std::chrono::seconds(120);
+
+    SharedUdpRelay(const asio::any_io_executor& executor, const asio::ip::address& bind_address,
+                   std::shared_ptr<ResolverCache> resolver, SharedUdpRelayOptions options, bool offload);
+
+    // Starts one receive loop per socket and the idle flow sweep
+    void start();
+
+    // Client-facing port, for BND.PORT
+    uint16_t port() const;
+
+    // Registers an association for a client. A client_port of 0 is learned from the client's first datagram.
+    uint64_t open(const asio::ip::address& client_ip, uint16_t client_port);
+    void close(uint64_t association);
+
+    size_t associations() const { return associations_.size(); }
+    size_t flows() const { return flows_.size(); }
+    // Sockets open, the `ports` that stay open included
+    size_t open_ports() const;
+
+  private:
+    struct Port {
+        Port(asio::ip::udp::socket socket, bool offload) : socket(std::move(socket)), batch(this->socket, offload) {}
+
+        asio::ip::udp::socket socket;
+        UdpBatch batch;   // Receives for this socket, and queues everything that leaves through it
+        size_t flows = 0; // Mapped onto this port; a port opened on demand is closed once idle with none
+    };
+
+    struct Flow;
+
+    struct Association {
+        asio::ip::udp::endpoint client; // Port 0 until learned
+        size_t home_port = 0;           // Tried first for new flows, so a client keeps one mapping where it can
+        std::vector<Flow*> flows;       // Nodes of flows_, which never move
+    };
+
+    // An association's flow to a destination, named as in the client's SOCKS header
+    struct FlowKey {
+        uint64_t association;
+        DestinationKey destination;
+
+        bool operator==(const FlowKey&) const = default;
+    };
+
+    struct FlowKeyHash {
+        size_t operator()(const FlowKey& key) const {
+            return DestinationKeyHash{}(key.destination) * 31 + key.association;
+        }
+    };
+
+    struct Flow {
+        const FlowKey* key; // Its key in flows_
+        uint64_t association;
+        asio::ip::udp::endpoint target;
+        size_t port;
+        std::array<uint8_t, UdpBatch::MAX_HEADER> reply_header;
+        size_t reply_header_size;
+        clock::time_point last_used;
+
+        std::span<const uint8_t> reply() const { return {reply_header.data(), reply_header_size}; }
+    };
+
+    struct ReplyKey {
+        size_t port;
+        asio::ip::udp::endpoint sender;
+
+        bool operator==(const ReplyKey&) const = default;
+    };
+
+    struct ReplyKeyHash {
+        size_t operator()(const ReplyKey& key) const {
+            return std::hash<asio::ip::udp::endpoint>{}(key.sender) * 31 + key.port;
+        }
+    };
+
+    // Opens a port beyond the fixed ones for a flow no open port can take, or returns nullopt at max_ports
+    std::optional<size_t> open_port();
+    void close_idle_ports();
+
+    asio::awaitable<void> receive_loop(std::shared_ptr<Port> port, size_t index);
+    asio::awaitable<void> sweep_idle_flows();
+    asio::awaitable<void> flush();
+    bool queued() const; // Whether any port has datagrams waiting to leave
+
+    std::optional<uint64_t> learn_client(const asio::ip::udp::endpoint& sender);
+    void from_client(uint64_t association, std::span<uint8_t> datagram, clock::time_point now);
+    void to_client(Flow& flow, std::span<const uint8_t> datagram, clock::time_point now);
+    Flow* create_flow(const FlowKey& key, const asio::ip::udp::endpoint& target, clock::time_point now);
+    void erase_flow(const FlowKey& key);
+    void hold(const FlowKey& key, std::string_view host, uint16_t port, std::span<const uint8_t> payload);
+    void resolved(const FlowKey& key, const asio::ip::udp::endpoint& target);
+
+    asio::any_io_executor executor_;
+    std::shared_ptr<ResolverCache> resolver_;
+    asio::ip::address bind_address_;
+    bool offload_;
+    size_t fixed_ports_;
+    size_t max_ports_;
+    std::vector<std::shared_ptr<Port>> ports_; // Null where a port opened on demand was closed again
+    asio::steady_timer sweep_timer_;
+
+    uint64_t next_association_ = 1;
+    std::unordered_map<uint64_t, Association> associations_;
+    std::unordered_map<asio::ip::udp::endpoint, uint64_t> by_client_;
+    std::unordered_multimap<asio::ip::address, uint64_t> unbound_; // Client port not known yet
+    std::unordered_map<FlowKey, Flow, FlowKeyHash> flows_;
+    std::unordered_map<ReplyKey, Flow*, ReplyKeyHash> replies_; // Flow nodes never move
+    PendingDatagrams<FlowKey, FlowKeyHash> pending_;            // Flows whose destination is still resolving
+};
+
+} // namespace socks5
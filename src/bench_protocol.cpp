@@ -0,0 +1,188 @@
+#include "socks5/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <print>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Microbenchmarks of the SOCKS5 wire format: what one handshake or one relayed datagram costs in encoding and
+// decoding, in ns and heap allocations per operation. Run with --release=fast; an argument filters by name.
+
+namespace {
+
+// Every allocation made through the global operator new, so each benchmark can report allocations per operation
+std::atomic<uint64_t> allocations{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace socks5;
+
+constexpr auto CALIBRATION_RUN = std::chrono::milliseconds(10);
+constexpr auto MEASURED_RUN = std::chrono::milliseconds(200);
+constexpr int RUNS = 5;
+
+// Keeps the compiler from optimizing away a result that is otherwise unused
+template <typename T>
+void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Runner {
+  public:
+    explicit Runner(std::string_view filter) : filter_(filter) {
+        std::println("{:<32} {:>10} {:>10}", "benchmark", "ns/op", "allocs/op");
+    }
+
+    // Sizes a run to MEASURED_RUN, then reports the fastest of RUNS runs and the allocations across all of them
+    template <typename Op>
+    void operator()(std::string_view name, Op&& op) {
+        if (!name.contains(filter_))
+            return;
+
+        uint64_t iterations = 1;
+        while (time(op, iterations) < CALIBRATION_RUN)
+            iterations *= 2;
+        iterations = std::max<uint64_t>(1, iterations * (MEASURED_RUN / CALIBRATION_RUN));
+
+        auto allocated = allocations.load(std::memory_order_relaxed);
+        auto best = Clock::duration::max();
+        for (int run = 0; run < RUNS; ++run)
+            best = std::min(best, time(op, iterations));
+        allocated = allocations.load(std::memory_order_relaxed) - allocated;
+
+        double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(best).count());
+        double per_op = static_cast<double>(allocated) / static_cast<double>(iterations * RUNS);
+        std::println("{:<32} {:>10.1f} {:>10.2f}", name, ns / static_cast<double>(iterations), per_op);
+    }
+
+  private:
+    template <typename Op>
+    static Clock::duration time(Op& op, uint64_t iterations) {
+        auto started = Clock::now();
+        for (uint64_t i = 0; i < iterations; ++i)
+            op();
+        return Clock::now() - started;
+    }
+
+    std::string_view filter_;
+};
+
+std::vector<uint8_t> with_port(std::vector<uint8_t> message, uint16_t port) {
+    message.push_back(static_cast<uint8_t>(port >> 8));
+    message.push_back(static_cast<uint8_t>(port & 0xFF));
+    return message;
+}
+
+std::vector<uint8_t> with_payload(std::vector<uint8_t> datagram, size_t payload) {
+    datagram.resize(datagram.size() + payload, 0xAB);
+    return datagram;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Runner run(argc > 1 ? argv[1] : "");
+
+    const auto v4 = asio::ip::make_address("93.184.216.34");
+    const auto v6 = asio::ip::make_address("2001:db8::1");
+    const std::string domain = "www.example-cdn.com";
+    const auto v4_bytes = v4.to_v4().to_bytes();
+    const auto v6_bytes = v6.to_v6().to_bytes();
+
+    std::vector<uint8_t> domain_address = {static_cast<uint8_t>(AddressType::DOMAIN_NAME),
+                                           static_cast<uint8_t>(domain.size())};
+    domain_address.insert(domain_address.end(), domain.begin(), domain.end());
+    std::vector<uint8_t> v4_address = {static_cast<uint8_t>(AddressType::IPV4)};
+    v4_address.insert(v4_address.end(), v4_bytes.begin(), v4_bytes.end());
+    std::vector<uint8_t> v6_address = {static_cast<uint8_t>(AddressType::IPV6)};
+    v6_address.insert(v6_address.end(), v6_bytes.begin(), v6_bytes.end());
+
+    auto request = [](const std::vector<uint8_t>& address) {
+        std::vector<uint8_t> message = {VERSION, static_cast<uint8_t>(Command::CONNECT), RSV};
+        message.insert(message.end(), address.begin(), address.end());
+        return with_port(std::move(message), 443);
+    };
+    auto datagram = [](const std::vector<uint8_t>& address) {
+        std::vector<uint8_t> message = {0x00, 0x00, 0x00};
+        message.insert(message.end(), address.begin(), address.end());
+        return with_payload(with_port(std::move(message), 53), 64);
+    };
+
+    // Handshake, server side: decoded in place, replies encoded into a buffer the session owns
+    std::array<uint8_t, MAX_MESSAGE_SIZE> out;
+    const std::vector<uint8_t> greeting = {VERSION, 0x01, static_cast<uint8_t>(AuthMethod::NO_AUTH)};
+    run("decode_greeting", [&] { keep(decode_greeting(greeting)); });
+    for (auto [name, message] : {std::pair{"decode_request/ipv4", request(v4_address)},
+                                 std::pair{"decode_request/ipv6", request(v6_address)},
+                                 std::pair{"decode_request/domain", request(domain_address)}}) {
+        run(name, [&] { keep(decode_request(message)); });
+    }
+    for (auto [name, address] : {std::pair{"encode_reply/ipv4", v4}, std::pair{"encode_reply/ipv6", v6}}) {
+        run(name, [&] {
+            keep(encode(Response{Reply::SUCCEEDED, Address::of(address, 443)}, out));
+            keep(out);
+        });
+    }
+
+    // Handshake, client side: the host arrives as a string
+    const std::string v4_host = v4.to_string();
+    for (auto [name, host] : {std::pair{"encode_request/ipv4", v4_host}, std::pair{"encode_request/domain", domain}}) {
+        run(name, [&] {
+            keep(encode(Request{Command::CONNECT, *Address::of(host, 443)}, out));
+            keep(out);
+        });
+    }
+
+    // UDP relay: the header in front of each datagram from the client, and the one put in front of each reply
+    for (auto [name, message] : {std::pair{"udp_decapsulate/ipv4", datagram(v4_address)},
+                                 std::pair{"udp_decapsulate/ipv6", datagram(v6_address)},
+                                 std::pair{"udp_decapsulate/domain", datagram(domain_address)}}) {
+        run(name, [&] { keep(decode_udp_header(message)); });
+    }
+    for (auto [name, address] : {std::pair{"udp_encapsulate/ipv4", v4}, std::pair{"udp_encapsulate/ipv6", v6}}) {
+        asio::ip::udp::endpoint sender(address, 53);
+        run(name, [&] {
+            keep(encode_udp_header(sender, out));
+            keep(out);
+        });
+    }
+    return 0;
+}
@@ -3,86 +3,418 @@
 #include "socks5/server.hpp"
 
 #include <asio/experimental/awaitable_operators.hpp>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <cstring>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
 using namespace asio::experimental::awaitable_operators;
 
-// Configuration
-constexpr uint16_t PROXY_PORT = 10801;
-constexpr uint16_t DISCARD_PORT_TCP = 10802;
-constexpr uint16_t DISCARD_PORT_UDP = 10803;
-constexpr size_t NUM_CLIENTS = 100;
-constexpr size_t DATA_PER_CLIENT = 10 * 1024 * 1024; // 10 MB
-constexpr size_t BUFFER_SIZE = 32 * 1024;            // 32KB
-
-// TCP Discard
-asio::awaitable<void> discard_tcp_session(asio::ip::tcp::socket socket) {
-    char data[BUFFER_SIZE];
-    try {
-        while (true) {
-            co_await socket.async_read_some(asio::buffer(data), asio::use_awaitable);
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t TCP_CHUNK_SIZE = 32 * 1024;
+constexpr size_t UDP_CHUNK_SIZE = 1400; // Datagram payload, MTU-safe
+constexpr size_t PROBE_SIZE = 20;       // Client, sequence and send time at the front of each datagram (see Probe)
+constexpr auto DRAIN_TIMEOUT = std::chrono::seconds(5);
+constexpr size_t CPS_MESSAGE_SIZE = 256;
+constexpr size_t PING_MESSAGE_SIZE = 64;
+constexpr auto CPS_STEP_DURATION = std::chrono::seconds(3);
+constexpr auto PING_PHASE_DURATION = std::chrono::seconds(5);
+constexpr double CPS_SATURATION_GAIN = 0.05; // Stop scaling once doubling the load adds less than this
+
+size_t hardware_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+struct BenchOptions {
+    std::string mode = "tcp";                   // tcp, udp, cps or latency
+    std::string engine = "copy";                // The proxy's TCP relay engine
+    std::optional<size_t> clients;              // Concurrent tunnels or associations; defaults per mode
+    std::optional<size_t> max_clients;          // cps: highest load to scale up to
+    std::optional<size_t> message;              // cps, latency: bytes echoed per connection or per ping
+    size_t bulk = 0;                            // latency: background bulk flows loading the proxy
+    size_t payload = 10 * 1024 * 1024;          // Bytes each client sends, unless duration is set
+    std::optional<size_t> chunk;                // Bytes per write or datagram; defaults per mode
+    // Send until this elapses instead of a fixed payload
+    std::optional<std::chrono::duration<double>> duration;
+    bool bidirectional = false;                 // TCP only: the target echoes and clients read it all back
+    size_t proxy_threads = hardware_threads();  // Proxy shards
+    size_t client_threads = hardware_threads(); // Threads running the clients and the targets
+    std::string json;                           // Write the results here
+    std::string baseline;                       // Compare against an earlier --json file
+    double tolerance = 5.0;                     // Percent a metric may worsen before it is flagged
+
+    size_t chunk_size() const { return chunk.value_or(mode == "udp" ? UDP_CHUNK_SIZE : TCP_CHUNK_SIZE); }
+    size_t client_count() const { return clients.value_or(mode == "cps" ? 8 : mode == "latency" ? 16 : 100); }
+    size_t message_size() const { return message.value_or(mode == "latency" ? PING_MESSAGE_SIZE : CPS_MESSAGE_SIZE); }
+    size_t max_client_count() const {
+        return std::max(client_count(), max_clients.value_or(mode == "cps" ? 1024 : 0));
+    }
+};
+
+void print_usage() {
+    std::println(stderr, "Usage: benchmark [tcp|udp|cps|latency] [--engine copy|splice|pipelined] [--clients N]"
+                         " [--payload SIZE] [--chunk SIZE] [--duration SECONDS] [--bidirectional] [--max-clients N]"
+                         " [--message SIZE] [--bulk N] [--proxy-threads N] [--client-threads N] [--json FILE]"
+                         " [--compare FILE] [--tolerance PERCENT]");
+    std::println(stderr, "  tcp, udp              Bulk transfer through long-lived tunnels or UDP associations");
+    std::println(stderr, "  cps                   Short connections: connect, handshake, echo a message, close");
+    std::println(stderr, "  latency               Ping-pong round trips through the proxy and, as a baseline, direct");
+    std::println(stderr, "  --clients N           Concurrent clients (default 100; cps: the load to start from, 8;"
+                         " latency: 16)");
+    std::println(stderr, "  --payload SIZE        Bytes each client sends (K, M and G suffixes; default 10M)");
+    std::println(stderr, "  --chunk SIZE          Bytes per write, or per datagram in udp mode (default 32K / 1400)");
+    std::println(stderr, "  --duration SECONDS    Send for a fixed time instead of a fixed payload; cps: per load step"
+                         " (default 3); latency: per phase (default 5)");
+    std::println(stderr, "  --bidirectional       Echo at the target and read everything back (tcp only)");
+    std::println(stderr, "  --max-clients N       cps: double the load up to N until connections/s stop growing"
+                         " (default 1024)");
+    std::println(stderr, "  --message SIZE        cps: bytes echoed over each connection (default 256); latency: bytes"
+                         " per ping (default 64)");
+    std::println(stderr, "  --bulk N              latency: bulk flows loading the proxy while pings are timed");
+    std::println(stderr, "  --proxy-threads N     Proxy shards (default: one per core)");
+    std::println(stderr, "  --client-threads N    Threads driving clients and targets (default: one per core)");
+    std::println(stderr, "  --json FILE           Write the configuration and results as JSON");
+    std::println(stderr, "  --compare FILE        Flag results worse than an earlier --json run; exits 1 if any are");
+    std::println(stderr, "  --tolerance PERCENT   How much worse a result may be before it is flagged (default 5)");
+}
+
+template <typename T>
+std::optional<T> parse_number(std::string_view text) {
+    T value{};
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size())
+        return std::nullopt;
+    return value;
+}
+
+// "64K", "10M", "1G" or plain bytes
+std::optional<size_t> parse_size(std::string_view text) {
+    size_t shift = 0;
+    if (text.ends_with('K') || text.ends_with('k'))
+        shift = 10;
+    else if (text.ends_with('M') || text.ends_with('m'))
+        shift = 20;
+    else if (text.ends_with('G') || text.ends_with('g'))
+        shift = 30;
+    if (shift != 0)
+        text.remove_suffix(1);
+    auto value = parse_number<size_t>(text);
+    if (!value)
+        return std::nullopt;
+    return *value << shift;
+}
+
+std::optional<BenchOptions> parse_options(int argc, char* argv[]) {
+    BenchOptions options;
+    std::vector<std::string_view> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--engine" && has_value) {
+            options.engine = argv[++i];
+        } else if (arg == "--clients" && has_value) {
+            options.clients = parse_number<size_t>(argv[++i]);
+            if (!options.clients || *options.clients == 0)
+                return std::nullopt;
+        } else if (arg == "--max-clients" && has_value) {
+            options.max_clients = parse_number<size_t>(argv[++i]);
+            if (!options.max_clients)
+                return std::nullopt;
+        } else if (arg == "--message" && has_value) {
+            options.message = parse_size(argv[++i]);
+            if (!options.message)
+                return std::nullopt;
+        } else if (arg == "--bulk" && has_value) {
+            auto bulk = parse_number<size_t>(argv[++i]);
+            if (!bulk)
+                return std::nullopt;
+            options.bulk = *bulk;
+        } else if (arg == "--payload" && has_value) {
+            auto payload = parse_size(argv[++i]);
+            if (!payload)
+                return std::nullopt;
+            options.payload = *payload;
+        } else if (arg == "--chunk" && has_value) {
+            options.chunk = parse_size(argv[++i]);
+            if (!options.chunk || *options.chunk == 0)
+                return std::nullopt;
+        } else if (arg == "--duration" && has_value) {
+            auto seconds = parse_number<double>(argv[++i]);
+            if (!seconds || *seconds <= 0)
+                return std::nullopt;
+            options.duration = std::chrono::duration<double>(*seconds);
+        } else if (arg == "--bidirectional") {
+            options.bidirectional = true;
+        } else if (arg == "--proxy-threads" && has_value) {
+            auto threads = parse_number<size_t>(argv[++i]);
+            if (!threads)
+                return std::nullopt;
+            options.proxy_threads = *threads == 0 ? hardware_threads() : *threads;
+        } else if (arg == "--client-threads" && has_value) {
+            auto threads = parse_number<size_t>(argv[++i]);
+            if (!threads)
+                return std::nullopt;
+            options.client_threads = *threads == 0 ? hardware_threads() : *threads;
+        } else if (arg == "--json" && has_value) {
+            options.json = argv[++i];
+        } else if (arg == "--compare" && has_value) {
+            options.baseline = argv[++i];
+        } else if (arg == "--tolerance" && has_value) {
+            auto tolerance = parse_number<double>(argv[++i]);
+            if (!tolerance || *tolerance < 0)
+                return std::nullopt;
+            options.tolerance = *tolerance;
+        } else if (arg.starts_with("--")) {
+            return std::nullopt;
+        } else {
+            positional.push_back(arg);
         }
-    } catch (...) {
     }
+
+    // `benchmark tcp splice` still selects the engine positionally
+    if (positional.size() > 2)
+        return std::nullopt;
+    if (!positional.empty())
+        options.mode = positional[0];
+    if (positional.size() == 2)
+        options.engine = positional[1];
+
+    if (options.mode != "tcp" && options.mode != "udp" && options.mode != "cps" && options.mode != "latency")
+        return std::nullopt;
+    if (options.mode == "latency" && options.message_size() == 0)
+        return std::nullopt;
+    if (options.engine != "copy" && options.engine != "splice" && options.engine != "pipelined")
+        return std::nullopt;
+    if (options.mode == "udp" && options.chunk_size() < PROBE_SIZE) {
+        std::println(stderr, "--chunk must be at least {} bytes in udp mode", PROBE_SIZE);
+        return std::nullopt;
+    }
+    if (options.bidirectional && options.mode != "tcp") {
+        std::println(stderr, "--bidirectional is only supported in tcp mode");
+        return std::nullopt;
+    }
+    return options;
 }
 
-asio::awaitable<void> run_discard_tcp(asio::io_context& ctx) {
-    asio::ip::tcp::acceptor acceptor(ctx, {asio::ip::tcp::v4(), DISCARD_PORT_TCP});
-    try {
-        while (true) {
-            auto socket = co_await acceptor.async_accept(asio::use_awaitable);
-            asio::co_spawn(ctx, discard_tcp_session(std::move(socket)), asio::detached);
+// Which way a reported number should move; comparisons skip NEITHER
+enum class Better { HIGHER, LOWER, NEITHER };
+
+struct Metric {
+    std::string name;
+    double value;
+    Better better;
+};
+
+// Counters shared by the clients and targets of one run
+struct Traffic {
+    std::atomic<uint64_t> sent{0};     // Payload bytes written by clients
+    std::atomic<uint64_t> received{0}; // Payload bytes read by targets, plus echoes read back by clients
+    std::atomic<uint64_t> datagrams{0};
+    std::atomic<uint64_t> completed{0}; // Clients that got through their whole run
+    std::atomic<uint64_t> errors{0};    // Clients that failed
+    std::atomic<uint64_t> sinks_closed{0};
+    std::atomic<bool> stop{false};     // Set when a --duration run is over
+    std::atomic<int64_t> last_done{0}; // When the last client or target finished, relative to `started`
+    Clock::time_point started;
+
+    // Marks that something finished now; the run lasts until the last of these
+    void done() {
+        auto now = (Clock::now() - started).count();
+        auto last = last_done.load(std::memory_order_relaxed);
+        while (last < now && !last_done.compare_exchange_weak(last, now, std::memory_order_relaxed)) {
         }
-    } catch (...) {
     }
+};
+
+// Target of TCP tunnels: reads everything and, when bidirectional, writes it straight back
+asio::awaitable<void> sink_tcp_session(asio::ip::tcp::socket socket, Traffic& traffic, size_t chunk, bool echo) {
+    std::vector<char> data(chunk);
+    uint64_t received = 0;
+    while (true) {
+        auto [ec, n] = co_await socket.async_read_some(asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+        if (ec)
+            break;
+        received += n;
+        if (echo) {
+            auto [write_ec, written] =
+                co_await asio::async_write(socket, asio::buffer(data.data(), n), asio::as_tuple(asio::use_awaitable));
+            if (write_ec)
+                break;
+        }
+    }
+    traffic.received.fetch_add(received, std::memory_order_relaxed);
+    traffic.sinks_closed.fetch_add(1, std::memory_order_relaxed);
+    traffic.done();
 }
 
-// UDP Discard (Receiver)
-asio::awaitable<void> run_discard_udp(asio::io_context& ctx) {
-    asio::ip::udp::socket socket(ctx, {asio::ip::udp::v4(), DISCARD_PORT_UDP});
-    char data[65536];
+asio::awaitable<void> run_sink_tcp(asio::ip::tcp::acceptor& acceptor, Traffic& traffic, size_t chunk, bool echo) {
+    while (true) {
+        auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec)
+            co_return;
+        asio::co_spawn(asio::make_strand(acceptor.get_executor()),
+                       sink_tcp_session(std::move(socket), traffic, chunk, echo), asio::detached);
+    }
+}
+
+// Leads the payload of every UDP benchmark datagram, so the receiver can tell loss from reordering per client and
+// take the one-way latency. Sender and receiver share the host, and so steady_clock and byte order.
+struct Probe {
+    uint32_t client;
+    uint64_t sequence;
+    int64_t sent; // steady_clock ticks
+};
+
+void write_probe(uint8_t* out, const Probe& probe) {
+    std::memcpy(out, &probe.client, sizeof(probe.client));
+    std::memcpy(out + 4, &probe.sequence, sizeof(probe.sequence));
+    std::memcpy(out + 12, &probe.sent, sizeof(probe.sent));
+}
+
+Probe read_probe(const uint8_t* in) {
+    Probe probe;
+    std::memcpy(&probe.client, in, sizeof(probe.client));
+    std::memcpy(&probe.sequence, in + 4, sizeof(probe.sequence));
+    std::memcpy(&probe.sent, in + 12, sizeof(probe.sent));
+    return probe;
+}
+
+// One UDP target socket and what arrived on it. Only its receive loop writes the counts; they are read once the
+// run's threads have been joined.
+struct UdpReceiver {
+    UdpReceiver(asio::io_context& ctx, size_t clients)
+        : socket(ctx, {asio::ip::make_address("127.0.0.1"), 0}), next_sequence(clients, 0) {
+        socket.set_option(asio::socket_base::receive_buffer_size(8 * 1024 * 1024));
+    }
+
+    asio::ip::udp::socket socket;
+    std::vector<uint64_t> next_sequence; // Per client, one past the highest sequence seen
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t reordered = 0; // Arrived after a datagram the client sent later
+    uint64_t malformed = 0;
+    Clock::time_point last_arrival;
+    socks5::Histogram one_way;
+};
+
+// Target of UDP datagrams: counts what actually arrived through the relay
+asio::awaitable<void> run_sink_udp(UdpReceiver& receiver, Traffic& traffic) {
+    std::vector<uint8_t> data(65536);
     asio::ip::udp::endpoint sender;
-    try {
-        while (true) {
-            co_await socket.async_receive_from(asio::buffer(data), sender, asio::use_awaitable);
+    while (true) {
+        auto [ec, n] = co_await receiver.socket.async_receive_from(asio::buffer(data), sender,
+                                                                   asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted)
+            co_return;
+        if (ec)
+            continue;
+
+        auto now = Clock::now();
+        traffic.received.fetch_add(n, std::memory_order_relaxed);
+        auto probe = read_probe(data.data());
+        if (n < PROBE_SIZE || probe.client >= receiver.next_sequence.size()) {
+            ++receiver.malformed;
+            continue;
         }
-    } catch (...) {
+        ++receiver.datagrams;
+        receiver.bytes += n;
+        receiver.last_arrival = now;
+        receiver.one_way.record(now - Clock::time_point(Clock::duration(probe.sent)));
+        auto& next = receiver.next_sequence[probe.client];
+        if (probe.sequence < next)
+            ++receiver.reordered;
+        else
+            next = probe.sequence + 1;
     }
 }
 
-// TCP Client
-asio::awaitable<void> client_tcp(asio::io_context& ctx, const std::vector<char>& shared_payload) {
-    asio::ip::tcp::socket socket(ctx);
-    try {
-        co_await socks5::Client::connect(socket, {asio::ip::make_address("127.0.0.1"), PROXY_PORT}, "127.0.0.1",
-                                         DISCARD_PORT_TCP);
-
-        size_t remaining = DATA_PER_CLIENT;
-        while (remaining > 0) {
-            size_t chunk = std::min(remaining, shared_payload.size());
-            co_await asio::async_write(socket, asio::buffer(shared_payload.data(), chunk), asio::use_awaitable);
-            remaining -= chunk;
+// Sends the run's payload, or keeps sending until the duration is over
+bool keep_sending(const BenchOptions& options, const Traffic& traffic, uint64_t sent) {
+    return options.duration ? !traffic.stop.load(std::memory_order_relaxed) : sent < options.payload;
+}
+
+size_t next_chunk(const BenchOptions& options, size_t chunk, uint64_t sent) {
+    return options.duration ? chunk : static_cast<size_t>(std::min<uint64_t>(options.payload - sent, chunk));
+}
+
+asio::awaitable<void> client_tcp(const BenchOptions& options, Traffic& traffic, const std::vector<char>& payload,
+                                 asio::ip::tcp::endpoint proxy, uint16_t target_port) {
+    asio::ip::tcp::socket socket(co_await asio::this_coro::executor);
+    uint64_t sent = 0;
+    uint64_t echoed = 0;
+    bool writer_done = false;
+
+    auto writer = [&]() -> asio::awaitable<void> {
+        while (keep_sending(options, traffic, sent)) {
+            size_t chunk = next_chunk(options, payload.size(), sent);
+            co_await asio::async_write(socket, asio::buffer(payload.data(), chunk), asio::use_awaitable);
+            sent += chunk;
         }
+        writer_done = true;
+        // The reader may be parked on a read that nothing will answer
+        if (echoed == sent)
+            socket.cancel();
+    };
+
+    // Reads the echo until it has caught up with everything written. Runs on the client's strand with the writer.
+    auto reader = [&]() -> asio::awaitable<void> {
+        std::vector<char> data(payload.size());
+        while (!writer_done || echoed < sent) {
+            auto [ec, n] = co_await socket.async_read_some(asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+            if (ec == asio::error::operation_aborted && writer_done && echoed == sent)
+                break;
+            if (ec)
+                throw asio::system_error(ec);
+            echoed += n;
+        }
+    };
+
+    try {
+        co_await socks5::Client::connect(socket, proxy, "127.0.0.1", target_port);
+        if (options.bidirectional)
+            co_await (writer() && reader());
+        else
+            co_await writer();
         socket.close();
+        traffic.completed.fetch_add(1, std::memory_order_relaxed);
     } catch (...) {
+        traffic.errors.fetch_add(1, std::memory_order_relaxed);
     }
+    traffic.sent.fetch_add(sent, std::memory_order_relaxed);
+    traffic.received.fetch_add(echoed, std::memory_order_relaxed);
+    traffic.done();
 }
 
-// UDP Client
-asio::awaitable<void> client_udp(asio::io_context& ctx, const std::vector<char>& shared_payload) {
-    asio::ip::tcp::socket ctrl_socket(ctx);
-    asio::ip::udp::socket udp_socket(ctx, {asio::ip::udp::v4(), 0});
+asio::awaitable<void> client_udp(const BenchOptions& options, Traffic& traffic, const std::vector<char>& payload,
+                                 asio::ip::tcp::endpoint proxy, uint16_t target_port, uint32_t client) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket ctrl_socket(executor);
+    asio::ip::udp::socket udp_socket(executor, {asio::ip::udp::v4(), 0});
+    uint64_t sent = 0;
+    uint64_t datagrams = 0;
+    std::vector<uint8_t> data(payload.begin(), payload.end()); // Own copy, for the probe at its front
 
     try {
         // 1. Handshake TCP
-        co_await ctrl_socket.async_connect({asio::ip::make_address("127.0.0.1"), PROXY_PORT}, asio::use_awaitable);
+        co_await ctrl_socket.async_connect(proxy, asio::use_awaitable);
 
-        // Handshake
         uint8_t handshake[] = {0x05, 0x01, 0x00};
         co_await asio::async_write(ctrl_socket, asio::buffer(handshake), asio::use_awaitable);
         uint8_t h_resp[2];
@@ -99,107 +431,637 @@ asio::awaitable<void> client_udp(asio::io_context& ctx, const std::vector<char>&
 
         // 2. Blast UDP
         // Header: RSV(2) FRAG(1) ATYP(1) DST.ADDR(4) DST.PORT(2) DATA
-        // Pre-build header for performance
-        std::vector<uint8_t> packet;
-        packet.reserve(10 + shared_payload.size());
-        packet.push_back(0);
-        packet.push_back(0);
-        packet.push_back(0);    // RSV+FRAG
-        packet.push_back(0x01); // IPv4
-        packet.push_back(127);
-        packet.push_back(0);
-        packet.push_back(0);
-        packet.push_back(1); // 127.0.0.1
-        packet.push_back((DISCARD_PORT_UDP >> 8) & 0xFF);
-        packet.push_back(DISCARD_PORT_UDP & 0xFF);
-
-        size_t remaining = DATA_PER_CLIENT;
-        // Limit UDP packet size to MTU-safe or reasonable (e.g. 1400)
-        // Note: DATA_PER_CLIENT is 10MB. We need loop.
-        size_t chunk_size = 1400; // Typical MTU
-
-        while (remaining > 0) {
-            size_t current_chunk = std::min(remaining, chunk_size);
-
-            // Scatter/Gather: Header + Payload Slice
-            std::vector<asio::const_buffer> buffers;
-            buffers.push_back(asio::buffer(packet));
-            buffers.push_back(asio::buffer(shared_payload.data(), current_chunk));
+        uint8_t header[] = {0,   0, 0, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(target_port >> 8),
+                            static_cast<uint8_t>(target_port & 0xFF)};
 
+        while (keep_sending(options, traffic, sent)) {
+            // The last datagram of a fixed payload still carries a whole probe
+            size_t chunk = std::max(next_chunk(options, data.size(), sent), PROBE_SIZE);
+            write_probe(data.data(), {client, datagrams, Clock::now().time_since_epoch().count()});
+            std::array<asio::const_buffer, 2> buffers = {asio::buffer(header), asio::buffer(data.data(), chunk)};
             co_await udp_socket.async_send_to(buffers, relay_ep, asio::use_awaitable);
-
-            remaining -= current_chunk;
+            sent += chunk;
+            ++datagrams;
         }
-
+        traffic.completed.fetch_add(1, std::memory_order_relaxed);
     } catch (...) {
+        traffic.errors.fetch_add(1, std::memory_order_relaxed);
     }
+    traffic.sent.fetch_add(sent, std::memory_order_relaxed);
+    traffic.datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+    traffic.done();
 }
 
-int main(int argc, char* argv[]) {
-    std::string mode = "tcp";
-    if (argc > 1)
-        mode = argv[1];
-
-    asio::io_context ctx(std::thread::hardware_concurrency());
+socks5::ServerOptions proxy_options(const BenchOptions& options) {
+    socks5::ServerOptions proxy{.shards = options.proxy_threads};
+    if (options.engine == "splice")
+        proxy.relay_engine = socks5::RelayEngine::SPLICE;
+    else if (options.engine == "pipelined")
+        proxy.relay_engine = socks5::RelayEngine::PIPELINED;
+    return proxy;
+}
 
-    // Start Servers
-    socks5::Server proxy(ctx, PROXY_PORT, "127.0.0.1");
+// Bulk transfer through `clients` tunnels or associations. Throughput counts what the targets (and, when
+// bidirectional, the clients) received, over the time until the last of them finished.
+std::vector<Metric> run_throughput(const BenchOptions& options) {
+    socks5::Server proxy(0, "127.0.0.1", proxy_options(options));
     proxy.start();
-    asio::co_spawn(ctx, run_discard_tcp(ctx), asio::detached);
-    asio::co_spawn(ctx, run_discard_udp(ctx), asio::detached);
+    asio::ip::tcp::endpoint proxy_endpoint(asio::ip::make_address("127.0.0.1"), proxy.port());
+
+    asio::io_context ctx(static_cast<int>(options.client_threads));
+    Traffic traffic;
+    asio::ip::tcp::acceptor tcp_sink(ctx, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(ctx, run_sink_tcp(tcp_sink, traffic, options.chunk_size(), options.bidirectional), asio::detached);
 
-    // Payload
-    std::vector<char> payload(BUFFER_SIZE);
-    for (size_t i = 0; i < BUFFER_SIZE; ++i)
+    // One UDP target socket per client thread, so counting at the receiver does not become the bottleneck
+    bool udp = options.mode == "udp";
+    std::vector<std::unique_ptr<UdpReceiver>> receivers;
+    for (size_t i = 0; udp && i < options.client_threads; ++i) {
+        receivers.push_back(std::make_unique<UdpReceiver>(ctx, options.client_count()));
+        asio::co_spawn(ctx, run_sink_udp(*receivers.back(), traffic), asio::detached);
+    }
+
+    std::vector<char> payload(options.chunk_size());
+    for (size_t i = 0; i < payload.size(); ++i)
         payload[i] = static_cast<char>(i % 255);
 
-    std::println("Benchmark Configuration:");
-    std::println("  Mode: {}", mode);
-    std::println("  Clients: {}", NUM_CLIENTS);
-    std::println("  Data/Client: {} MB", DATA_PER_CLIENT / 1024 / 1024);
-    std::println("Starting benchmark...");
+    asio::steady_timer stop_timer(ctx);
+    traffic.started = Clock::now();
+    if (options.duration) {
+        stop_timer.expires_after(std::chrono::duration_cast<Clock::duration>(*options.duration));
+        stop_timer.async_wait([&](const asio::error_code&) { traffic.stop = true; });
+    }
 
-    std::atomic<size_t> active_clients = NUM_CLIENTS;
-    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < options.client_count(); ++i) {
+        // Each client on its own strand, so a bidirectional client's reader and writer never run at once
+        auto strand = asio::make_strand(ctx);
+        if (udp) {
+            uint16_t target_port = receivers[i % receivers.size()]->socket.local_endpoint().port();
+            asio::co_spawn(strand,
+                           client_udp(options, traffic, payload, proxy_endpoint, target_port, static_cast<uint32_t>(i)),
+                           asio::detached);
+        } else {
+            uint16_t target_port = tcp_sink.local_endpoint().port();
+            asio::co_spawn(strand, client_tcp(options, traffic, payload, proxy_endpoint, target_port), asio::detached);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.client_threads; ++i)
+        threads.emplace_back([&ctx] { ctx.run(); });
+
+    auto finished = [&] { return traffic.completed + traffic.errors == options.client_count(); };
+    while (!finished())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    // Let the targets read what is still in flight: every tunnel that completed closes its target, while datagrams
+    // are waited for until they stop arriving
+    auto drain_deadline = Clock::now() + DRAIN_TIMEOUT;
+    if (udp) {
+        uint64_t received = 0;
+        do {
+            received = traffic.received;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        } while (traffic.received != received && Clock::now() < drain_deadline);
+    } else {
+        while (traffic.sinks_closed < traffic.completed && Clock::now() < drain_deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ctx.stop();
+    for (auto& t : threads)
+        t.join();
+    proxy.stop();
 
-    for (size_t i = 0; i < NUM_CLIENTS; ++i) {
-        asio::co_spawn(
-            ctx,
-            [&, i]() -> asio::awaitable<void> {
-                if (mode == "udp")
-                    co_await client_udp(ctx, payload);
-                else
-                    co_await client_tcp(ctx, payload);
-                active_clients--;
-            },
-            asio::detached);
+    // Until the last datagram arrived, if that was after the last client finished sending
+    std::chrono::duration<double> elapsed = Clock::duration(traffic.last_done.load());
+    for (const auto& receiver : receivers) {
+        if (receiver->datagrams > 0)
+            elapsed = std::max<std::chrono::duration<double>>(elapsed, receiver->last_arrival - traffic.started);
+    }
+
+    double seconds = elapsed.count();
+    auto per_second = [&](double value) { return seconds > 0 ? value / seconds : 0; };
+    double sent = static_cast<double>(traffic.sent);
+    double received = static_cast<double>(traffic.received);
+    std::vector<Metric> metrics = {
+        {"seconds", seconds, Better::NEITHER},
+        {"sent_bytes", sent, Better::NEITHER},
+        {"received_bytes", received, Better::NEITHER},
+        {"throughput_mib_s", per_second(received / (1024 * 1024)), Better::HIGHER},
+        {"bandwidth_gbps", per_second(received * 8 / 1e9), Better::HIGHER},
+        {"errors", static_cast<double>(traffic.errors), Better::LOWER},
+    };
+    if (udp) {
+        socks5::Histogram one_way;
+        uint64_t arrived = 0;
+        uint64_t reordered = 0;
+        uint64_t malformed = 0;
+        for (const auto& receiver : receivers) {
+            one_way.merge(receiver->one_way);
+            arrived += receiver->datagrams;
+            reordered += receiver->reordered;
+            malformed += receiver->malformed;
+        }
+        double datagrams = static_cast<double>(traffic.datagrams);
+        double lost = static_cast<double>(traffic.datagrams - std::min<uint64_t>(arrived, traffic.datagrams));
+        auto latency = socks5::LatencySummary::of(one_way);
+        auto us = [](std::chrono::microseconds value) { return static_cast<double>(value.count()); };
+        metrics.push_back({"sent_datagrams", datagrams, Better::NEITHER});
+        metrics.push_back({"received_datagrams", static_cast<double>(arrived), Better::NEITHER});
+        metrics.push_back({"send_rate_pps", per_second(datagrams), Better::HIGHER});
+        metrics.push_back({"receive_rate_pps", per_second(static_cast<double>(arrived)), Better::HIGHER});
+        metrics.push_back({"loss_percent", datagrams > 0 ? 100 * lost / datagrams : 0, Better::LOWER});
+        double share = arrived > 0 ? static_cast<double>(reordered) / static_cast<double>(arrived) : 0;
+        metrics.push_back({"reordered_percent", 100 * share, Better::LOWER});
+        metrics.push_back({"malformed_datagrams", static_cast<double>(malformed), Better::LOWER});
+        metrics.push_back({"one_way_p50_us", us(latency.p50), Better::LOWER});
+        metrics.push_back({"one_way_p99_us", us(latency.p99), Better::LOWER});
+        metrics.push_back({"one_way_p999_us", us(latency.p999), Better::LOWER});
     }
+    return metrics;
+}
+
+// Shared by the clients of one cps load step
+struct CpsLoad {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> handshake_errors{0}; // TCP connect or SOCKS handshake failed
+    std::atomic<uint64_t> transfer_errors{0};  // The echo over an established tunnel failed
+    std::atomic<size_t> running{0};
+
+    std::mutex mutex; // Guards the histograms, which each client merges into once at the end
+    socks5::Histogram handshake;
+    socks5::Histogram connection;
+};
+
+// Target of cps connections: echoes one message and closes first, so TIME_WAIT piles up on the target's side of the
+// connection instead of using up the ephemeral ports of the client and the proxy
+asio::awaitable<void> cps_target_session(asio::ip::tcp::socket socket, size_t message) {
+    std::vector<char> data(message);
+    auto [read_ec, n] = co_await asio::async_read(socket, asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+    if (!read_ec)
+        co_await asio::async_write(socket, asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+}
+
+asio::awaitable<void> run_cps_target(asio::ip::tcp::acceptor& acceptor, size_t message) {
+    while (true) {
+        auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted)
+            co_return;
+        if (!ec)
+            asio::co_spawn(acceptor.get_executor(), cps_target_session(std::move(socket), message), asio::detached);
+    }
+}
+
+// Opens tunnels back to back until the step is over: handshake, echo a message, wait for the target to close
+asio::awaitable<void> cps_client(const BenchOptions& options, CpsLoad& load, asio::ip::tcp::endpoint proxy,
+                                 uint16_t target_port) {
+    auto executor = co_await asio::this_coro::executor;
+    std::vector<char> message(options.message_size(), 'x');
+    std::vector<char> echo(options.message_size());
+    socks5::Histogram handshake;
+    socks5::Histogram connection;
+    uint64_t connections = 0;
+
+    while (!load.stop.load(std::memory_order_relaxed)) {
+        auto started = Clock::now();
+        asio::ip::tcp::socket socket(executor);
+        try {
+            co_await socks5::Client::connect(socket, proxy, "127.0.0.1", target_port);
+        } catch (...) {
+            load.handshake_errors.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        handshake.record(Clock::now() - started);
+
+        auto [write_ec, written] =
+            co_await asio::async_write(socket, asio::buffer(message), asio::as_tuple(asio::use_awaitable));
+        auto [read_ec, read] =
+            co_await asio::async_read(socket, asio::buffer(echo), asio::as_tuple(asio::use_awaitable));
+        char eof;
+        auto [close_ec, extra] =
+            co_await socket.async_read_some(asio::buffer(&eof, 1), asio::as_tuple(asio::use_awaitable));
+        if (write_ec || read_ec || close_ec != asio::error::eof) {
+            load.transfer_errors.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        connection.record(Clock::now() - started);
+        ++connections;
+    }
+
+    load.connections.fetch_add(connections, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(load.mutex);
+        load.handshake.merge(handshake);
+        load.connection.merge(connection);
+    }
+    load.running.fetch_sub(1, std::memory_order_relaxed);
+}
+
+struct CpsStep {
+    size_t clients;
+    double cps;
+    uint64_t errors;
+    socks5::LatencySummary handshake;
+    socks5::LatencySummary connection;
+};
+
+// Connection rate at increasing load: starts at `clients` and doubles while that still buys at least
+// CPS_SATURATION_GAIN more connections per second, up to max_clients. Reports the step with the highest rate.
+std::vector<Metric> run_cps(const BenchOptions& options) {
+    socks5::Server proxy(0, "127.0.0.1", proxy_options(options));
+    proxy.start();
+    asio::ip::tcp::endpoint proxy_endpoint(asio::ip::make_address("127.0.0.1"), proxy.port());
+
+    asio::io_context ctx(static_cast<int>(options.client_threads));
+    auto work_guard = asio::make_work_guard(ctx);
+    asio::ip::tcp::acceptor target(ctx, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(ctx, run_cps_target(target, options.message_size()), asio::detached);
+    uint16_t target_port = target.local_endpoint().port();
 
     std::vector<std::thread> threads;
-    for (size_t i = 0; i < std::thread::hardware_concurrency(); ++i) {
+    for (size_t i = 0; i < options.client_threads; ++i)
         threads.emplace_back([&ctx] { ctx.run(); });
+
+    auto step_duration = options.duration.value_or(CPS_STEP_DURATION);
+    std::vector<CpsStep> steps;
+    for (size_t clients = options.client_count(); clients <= options.max_client_count(); clients *= 2) {
+        CpsLoad load;
+        load.running = clients;
+        auto started = Clock::now();
+        for (size_t i = 0; i < clients; ++i)
+            asio::co_spawn(asio::make_strand(ctx), cps_client(options, load, proxy_endpoint, target_port),
+                           asio::detached);
+        std::this_thread::sleep_for(step_duration);
+        load.stop = true;
+        while (load.running > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::chrono::duration<double> elapsed = Clock::now() - started;
+
+        CpsStep step{clients, static_cast<double>(load.connections) / elapsed.count(),
+                     load.handshake_errors + load.transfer_errors, socks5::LatencySummary::of(load.handshake),
+                     socks5::LatencySummary::of(load.connection)};
+        std::println("  {:>5} clients: {:>10.0f} conn/s, handshake p50 {}us p99 {}us p999 {}us, {} handshake and {}"
+                     " transfer errors",
+                     clients, step.cps, step.handshake.p50.count(), step.handshake.p99.count(),
+                     step.handshake.p999.count(), load.handshake_errors.load(), load.transfer_errors.load());
+        steps.push_back(step);
+
+        bool saturated = steps.size() > 1 && step.cps < steps[steps.size() - 2].cps * (1 + CPS_SATURATION_GAIN);
+        if (saturated)
+            break;
+    }
+
+    work_guard.reset();
+    target.close();
+    ctx.stop();
+    for (auto& t : threads)
+        t.join();
+    proxy.stop();
+
+    const auto& peak = *std::max_element(steps.begin(), steps.end(),
+                                         [](const CpsStep& a, const CpsStep& b) { return a.cps < b.cps; });
+    uint64_t errors = 0;
+    for (const auto& step : steps)
+        errors += step.errors;
+    auto us = [](std::chrono::microseconds value) { return static_cast<double>(value.count()); };
+    return {
+        {"peak_cps", peak.cps, Better::HIGHER},
+        {"peak_clients", static_cast<double>(peak.clients), Better::NEITHER},
+        {"handshake_p50_us", us(peak.handshake.p50), Better::LOWER},
+        {"handshake_p99_us", us(peak.handshake.p99), Better::LOWER},
+        {"handshake_p999_us", us(peak.handshake.p999), Better::LOWER},
+        {"connection_p50_us", us(peak.connection.p50), Better::LOWER},
+        {"connection_p99_us", us(peak.connection.p99), Better::LOWER},
+        {"errors", static_cast<double>(errors), Better::LOWER},
+    };
+}
+
+// Shared by the ping-pong clients of one latency phase
+struct PingLoad {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<size_t> running{0};
+
+    std::mutex mutex; // Guards the rest, which each client merges into once at the end
+    socks5::Histogram rtt;
+    uint64_t pings = 0;
+    Clock::duration max{};
+};
+
+struct PingPhase {
+    uint64_t pings;
+    double seconds;
+    uint64_t errors;
+    socks5::LatencySummary rtt;
+    std::chrono::microseconds max;
+};
+
+// Echoes whatever arrives, as the target of ping-pong clients
+asio::awaitable<void> echo_session(asio::ip::tcp::socket socket) {
+    asio::error_code ec;
+    socket.set_option(asio::ip::tcp::no_delay(true), ec);
+    std::array<char, 4096> data;
+    while (true) {
+        auto [read_ec, n] = co_await socket.async_read_some(asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+        if (read_ec)
+            co_return;
+        auto [write_ec, written] =
+            co_await asio::async_write(socket, asio::buffer(data.data(), n), asio::as_tuple(asio::use_awaitable));
+        if (write_ec)
+            co_return;
+    }
+}
+
+asio::awaitable<void> run_echo(asio::ip::tcp::acceptor& acceptor) {
+    while (true) {
+        auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted)
+            co_return;
+        if (!ec)
+            asio::co_spawn(acceptor.get_executor(), echo_session(std::move(socket)), asio::detached);
+    }
+}
+
+// Keeps one message in flight and times each round trip. Without a proxy it connects straight to the target, which
+// gives the baseline the proxied numbers are read against.
+asio::awaitable<void> ping_client(const BenchOptions& options, PingLoad& load,
+                                  std::optional<asio::ip::tcp::endpoint> proxy, asio::ip::tcp::endpoint target) {
+    asio::ip::tcp::socket socket(co_await asio::this_coro::executor);
+    std::vector<char> message(options.message_size(), 'p');
+    std::vector<char> echo(options.message_size());
+    socks5::Histogram rtt;
+    uint64_t pings = 0;
+    Clock::duration max{};
+
+    try {
+        if (proxy)
+            co_await socks5::Client::connect(socket, *proxy, target.address().to_string(), target.port());
+        else
+            co_await socket.async_connect(target, asio::use_awaitable);
+        socket.set_option(asio::ip::tcp::no_delay(true));
+
+        while (!load.stop.load(std::memory_order_relaxed)) {
+            auto sent = Clock::now();
+            co_await asio::async_write(socket, asio::buffer(message), asio::use_awaitable);
+            co_await asio::async_read(socket, asio::buffer(echo), asio::use_awaitable);
+            auto elapsed = Clock::now() - sent;
+            rtt.record(elapsed);
+            max = std::max(max, elapsed);
+            ++pings;
+        }
+    } catch (...) {
+        load.errors.fetch_add(1, std::memory_order_relaxed);
     }
 
-    while (active_clients > 0) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    {
+        std::lock_guard lock(load.mutex);
+        load.rtt.merge(rtt);
+        load.pings += pings;
+        load.max = std::max(load.max, max);
     }
+    load.running.fetch_sub(1, std::memory_order_relaxed);
+}
+
+PingPhase run_ping_phase(asio::io_context& ctx, const BenchOptions& options,
+                         std::optional<asio::ip::tcp::endpoint> proxy, asio::ip::tcp::endpoint target) {
+    PingLoad load;
+    load.running = options.client_count();
+    auto started = Clock::now();
+    for (size_t i = 0; i < options.client_count(); ++i)
+        asio::co_spawn(asio::make_strand(ctx), ping_client(options, load, proxy, target), asio::detached);
+    std::this_thread::sleep_for(options.duration.value_or(PING_PHASE_DURATION));
+    load.stop = true;
+    while (load.running > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::chrono::duration<double> elapsed = Clock::now() - started;
+
+    std::lock_guard lock(load.mutex);
+    return {load.pings, elapsed.count(), load.errors, socks5::LatencySummary::of(load.rtt),
+            std::chrono::duration_cast<std::chrono::microseconds>(load.max)};
+}
+
+void print_ping_phase(std::string_view name, const PingPhase& phase) {
+    std::println("  {:<8} {:>10.0f} pings/s, p50 {}us p99 {}us p999 {}us max {}us, {} errors", name,
+                 phase.seconds > 0 ? static_cast<double>(phase.pings) / phase.seconds : 0, phase.rtt.p50.count(),
+                 phase.rtt.p99.count(), phase.rtt.p999.count(), phase.max.count(), phase.errors);
+}
 
-    auto end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> diff = end - start;
+// Round-trip times of small messages, first over direct connections to the echo target and then through the proxy,
+// with `bulk` flows pushing data through the proxy during both phases. The difference is what the proxy adds.
+std::vector<Metric> run_latency(const BenchOptions& options) {
+    socks5::Server proxy(0, "127.0.0.1", proxy_options(options));
+    proxy.start();
+    asio::ip::tcp::endpoint proxy_endpoint(asio::ip::make_address("127.0.0.1"), proxy.port());
+
+    asio::io_context ctx(static_cast<int>(options.client_threads));
+    auto work_guard = asio::make_work_guard(ctx);
+    asio::ip::tcp::acceptor echo(ctx, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(ctx, run_echo(echo), asio::detached);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.client_threads; ++i)
+        threads.emplace_back([&ctx] { ctx.run(); });
 
+    // Background load: unidirectional tunnels into a discard target, sending until both phases are over
+    BenchOptions bulk_options = options;
+    bulk_options.mode = "tcp";
+    bulk_options.bidirectional = false;
+    bulk_options.duration = PING_PHASE_DURATION; // Only makes keep_sending() wait for bulk.stop
+    Traffic bulk;
+    asio::ip::tcp::acceptor sink(ctx, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::co_spawn(ctx, run_sink_tcp(sink, bulk, TCP_CHUNK_SIZE, false), asio::detached);
+    std::vector<char> payload(TCP_CHUNK_SIZE, 'b');
+    bulk.started = Clock::now();
+    for (size_t i = 0; i < options.bulk; ++i) {
+        asio::co_spawn(asio::make_strand(ctx),
+                       client_tcp(bulk_options, bulk, payload, proxy_endpoint, sink.local_endpoint().port()),
+                       asio::detached);
+    }
+
+    auto direct = run_ping_phase(ctx, options, std::nullopt, echo.local_endpoint());
+    print_ping_phase("direct", direct);
+    auto proxied = run_ping_phase(ctx, options, proxy_endpoint, echo.local_endpoint());
+    print_ping_phase("proxied", proxied);
+
+    bulk.stop = true;
+    while (bulk.completed + bulk.errors < options.bulk)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::chrono::duration<double> bulk_elapsed = Clock::now() - bulk.started;
+
+    work_guard.reset();
+    echo.close();
+    sink.close();
     ctx.stop();
     for (auto& t : threads)
         t.join();
+    proxy.stop();
+
+    auto us = [](std::chrono::microseconds value) { return static_cast<double>(value.count()); };
+    auto overhead = [&](auto percentile) { return us(proxied.rtt.*percentile) - us(direct.rtt.*percentile); };
+    std::println("  overhead p50 {:+.0f}us p99 {:+.0f}us p999 {:+.0f}us", overhead(&socks5::LatencySummary::p50),
+                 overhead(&socks5::LatencySummary::p99), overhead(&socks5::LatencySummary::p999));
+    return {
+        {"proxied_p50_us", us(proxied.rtt.p50), Better::LOWER},
+        {"proxied_p99_us", us(proxied.rtt.p99), Better::LOWER},
+        {"proxied_p999_us", us(proxied.rtt.p999), Better::LOWER},
+        {"proxied_max_us", us(proxied.max), Better::LOWER},
+        {"direct_p50_us", us(direct.rtt.p50), Better::NEITHER},
+        {"direct_p99_us", us(direct.rtt.p99), Better::NEITHER},
+        {"direct_p999_us", us(direct.rtt.p999), Better::NEITHER},
+        {"direct_max_us", us(direct.max), Better::NEITHER},
+        {"overhead_p50_us", overhead(&socks5::LatencySummary::p50), Better::LOWER},
+        {"overhead_p99_us", overhead(&socks5::LatencySummary::p99), Better::LOWER},
+        {"overhead_p999_us", overhead(&socks5::LatencySummary::p999), Better::LOWER},
+        {"proxied_pings_per_s", proxied.seconds > 0 ? static_cast<double>(proxied.pings) / proxied.seconds : 0,
+         Better::HIGHER},
+        {"bulk_mib_s", static_cast<double>(bulk.sent) / (1024 * 1024) / bulk_elapsed.count(), Better::NEITHER},
+        {"errors", static_cast<double>(proxied.errors + direct.errors + bulk.errors), Better::LOWER},
+    };
+}
 
-    double total_bytes = static_cast<double>(NUM_CLIENTS * DATA_PER_CLIENT);
-    double mb = total_bytes / (1024 * 1024);
-    double mbs = mb / diff.count();
-    double gbps = (total_bytes * 8) / (1000 * 1000 * 1000) / diff.count();
+std::string render_json(const BenchOptions& options, const std::vector<Metric>& metrics) {
+    std::string out = "{\n";
+    auto field = [&](std::string_view name, auto value) {
+        std::format_to(std::back_inserter(out), "  \"{}\": {},\n", name, value);
+    };
+    auto string_field = [&](std::string_view name, std::string_view value) {
+        std::format_to(std::back_inserter(out), "  \"{}\": \"{}\",\n", name, value);
+    };
+    string_field("mode", options.mode);
+    string_field("engine", options.engine);
+    string_field("io_backend", socks5::io_backend());
+    field("clients", options.client_count());
+    if (options.mode == "cps")
+        field("max_clients", options.max_client_count());
+    if (options.mode == "cps" || options.mode == "latency")
+        field("message", options.message_size());
+    if (options.mode == "latency")
+        field("bulk", options.bulk);
+    field("payload", options.payload);
+    field("chunk", options.chunk_size());
+    field("duration", options.duration ? options.duration->count() : 0.0);
+    field("bidirectional", options.bidirectional);
+    field("proxy_threads", options.proxy_threads);
+    field("client_threads", options.client_threads);
+    out += "  \"results\": {\n";
+    for (size_t i = 0; i < metrics.size(); ++i) {
+        std::format_to(std::back_inserter(out), "    \"{}\": {}{}\n", metrics[i].name, metrics[i].value,
+                       i + 1 < metrics.size() ? "," : "");
+    }
+    out += "  }\n}\n";
+    return out;
+}
+
+// Finds `"name": <value>` in a file written by render_json; not a general JSON parser
+std::optional<std::string_view> json_value(std::string_view json, std::string_view name) {
+    auto key = json.find(std::format("\"{}\":", name));
+    if (key == std::string_view::npos)
+        return std::nullopt;
+    auto value = json.substr(key + name.size() + 3);
+    value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+    auto end = value.find_first_of(",\n}");
+    value = value.substr(0, end);
+    if (value.size() >= 2 && value.front() == '"')
+        value = value.substr(1, value.size() - 2);
+    return value;
+}
+
+// Prints how each result moved against the baseline; returns whether any got worse by more than the tolerance
+bool compare(const BenchOptions& options, const std::vector<Metric>& metrics, std::string_view baseline) {
+    std::println("Comparison with {} (tolerance {}%):", options.baseline, options.tolerance);
+    auto config = render_json(options, {});
+    for (std::string_view name : {"mode", "engine", "io_backend", "clients", "max_clients", "message", "bulk",
+                                  "payload", "chunk", "duration", "bidirectional", "proxy_threads", "client_threads"}) {
+        auto before = json_value(baseline, name);
+        auto now = json_value(config, name);
+        if (before && now && *before != *now)
+            std::println("  Note: baseline {} was {}, this run used {}", name, *before, *now);
+    }
+
+    bool regressed = false;
+    for (const auto& metric : metrics) {
+        auto text = json_value(baseline, metric.name);
+        auto before = text ? parse_number<double>(*text) : std::nullopt;
+        if (!before) {
+            std::println("  {:<20} {:>14.2f}   (not in baseline)", metric.name, metric.value);
+            continue;
+        }
+
+        double change = *before != 0 ? (metric.value - *before) / *before * 100 : 0;
+        double worse = metric.better == Better::HIGHER ? -change : change;
+        bool flagged = metric.better != Better::NEITHER &&
+                       (*before != 0 ? worse > options.tolerance : metric.better == Better::LOWER && metric.value > 0);
+        regressed |= flagged;
+        std::println("  {:<20} {:>14.2f} -> {:>14.2f} {:>+8.1f}%{}", metric.name, *before, metric.value, change,
+                     flagged ? "  REGRESSION" : "");
+    }
+    return regressed;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    auto parsed = parse_options(argc, argv);
+    if (!parsed) {
+        print_usage();
+        return 1;
+    }
+    const BenchOptions& options = *parsed;
+
+    std::println("Benchmark Configuration:");
+    std::println("  Mode: {}{}", options.mode, options.bidirectional ? " (bidirectional)" : "");
+    std::println("  Relay Engine: {}", options.engine);
+    std::println("  I/O Backend: {}", socks5::io_backend());
+    if (options.mode == "cps")
+        std::println("  Clients: {} doubling up to {}", options.client_count(), options.max_client_count());
+    else
+        std::println("  Clients: {}", options.client_count());
+    if (options.mode == "cps" || options.mode == "latency")
+        std::println("  Message: {} bytes", options.message_size());
+    else if (options.duration)
+        std::println("  Duration: {:.1f} s", options.duration->count());
+    else
+        std::println("  Data/Client: {:.2f} MiB", static_cast<double>(options.payload) / (1024 * 1024));
+    if (options.mode == "latency")
+        std::println("  Background Bulk Flows: {}", options.bulk);
+    else if (options.mode != "cps")
+        std::println("  Chunk: {} bytes", options.chunk_size());
+    std::println("  Threads: {} proxy, {} client", options.proxy_threads, options.client_threads);
+    std::println("Starting benchmark...");
+
+    std::vector<Metric> metrics;
+    if (options.mode == "cps")
+        metrics = run_cps(options);
+    else if (options.mode == "latency")
+        metrics = run_latency(options);
+    else
+        metrics = run_throughput(options);
 
     std::println("Benchmark Complete:");
-    std::println("  Time: {:.2f} s", diff.count());
-    std::println("  Throughput: {:.2f} MB/s", mbs);
-    std::println("  Bandwidth: {:.2f} Gbps", gbps);
+    for (const auto& metric : metrics)
+        std::println("  {:<20} {:.2f}", metric.name, metric.value);
 
+    if (!options.json.empty()) {
+        std::ofstream out(options.json);
+        out << render_json(options, metrics);
+        if (!out) {
+            std::println(stderr, "Cannot write {}", options.json);
+            return 1;
+        }
+    }
+
+    if (!options.baseline.empty()) {
+        std::ifstream in(options.baseline);
+        std::stringstream baseline;
+        baseline << in.rdbuf();
+        if (!in) {
+            std::println(stderr, "Cannot read {}", options.baseline);
+            return 1;
+        }
+        if (compare(options, metrics, baseline.str()))
+            return 1;
+    }
     return 0;
 }
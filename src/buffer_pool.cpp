@@ -0,0 +1,78 @@
+#include "socks5/buffer_pool.hpp"
+
+#include <bit>
+#include <new>
+
+namespace socks5 {
+
+namespace {
+
+// Trivially destructible, so it stays readable while the thread's other thread_locals are being torn down
+thread_local bool pool_destroyed = false;
+
+} // namespace
+
+BufferPool& BufferPool::local() {
+    thread_local BufferPool pool;
+    return pool;
+}
+
+BufferPool::~BufferPool() {
+    pool_destroyed = true;
+    for (size_t size_class = 0; size_class < BUFFER_SIZE_CLASSES; ++size_class) {
+        for (auto* data : free_[size_class])
+            ::operator delete(data, class_size(size_class));
+    }
+}
+
+size_t BufferPool::size_class_for(size_t size) {
+    if (size <= MIN_BUFFER_SIZE)
+        return 0;
+    if (size >= MAX_BUFFER_SIZE)
+        return BUFFER_SIZE_CLASSES - 1;
+    return static_cast<size_t>(std::bit_width((size - 1) / MIN_BUFFER_SIZE));
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    size_t size_class = size_class_for(size);
+    auto& list = free_[size_class];
+    if (!list.empty()) {
+        auto* data = list.back();
+        list.pop_back();
+        return {data, size_class};
+    }
+    return {static_cast<uint8_t*>(::operator new(class_size(size_class))), size_class};
+}
+
+void BufferPool::release(uint8_t* data, size_t size_class) {
+    auto& list = free_[size_class];
+    if (list.size() * class_size(size_class) >= MAX_IDLE_BYTES_PER_CLASS) {
+        ::operator delete(data, class_size(size_class));
+        return;
+    }
+    list.push_back(data);
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        data_ = other.data_;
+        size_class_ = other.size_class_;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
+
+void PooledBuffer::reset() {
+    if (!data_)
+        return;
+    if (pool_destroyed) {
+        // Buffers released during thread exit, after this thread's pool
+        ::operator delete(data_, BufferPool::class_size(size_class_));
+    } else {
+        BufferPool::local().release(data_, size_class_);
+    }
+    data_ = nullptr;
+}
+
+} // namespace socks5
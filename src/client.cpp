@@ -1,9 +1,20 @@
 #include "socks5/client.hpp"
 
+#include "socks5/fast_open.hpp"
+
+#include <algorithm>
+#include <array>
+
 namespace socks5 {
 
 asio::awaitable<void> Client::connect(asio::ip::tcp::socket& socket, const asio::ip::tcp::endpoint& proxy_endpoint,
-                                      const std::string& target_host, uint16_t target_port) {
+                                      const std::string& target_host, uint16_t target_port, ClientOptions options) {
+    if (options.fast_open) {
+        // The connect then returns at once and the greeting written by handshake() goes out with the SYN
+        if (!socket.is_open())
+            socket.open(proxy_endpoint.protocol());
+        enable_fast_open_connect(socket);
+    }
     co_await socket.async_connect(proxy_endpoint, asio::use_awaitable);
     co_await handshake(socket, target_host, target_port);
 }
@@ -29,74 +40,31 @@ asio::awaitable<void> Client::handshake(asio::ip::tcp::socket& socket, const std
         throw std::system_error(make_error_code(Error::NO_ACCEPTABLE_AUTH));
     }
 
-    // 3. Send Request (Connect)
-    std::vector<uint8_t> request;
-    request.push_back(VERSION);
-    request.push_back(static_cast<uint8_t>(Command::CONNECT));
-    request.push_back(RSV);
-
-    // Determine address type
-    asio::error_code ec;
-    auto ip_addr = asio::ip::make_address(target_host, ec);
-
-    if (!ec) {
-        if (ip_addr.is_v4()) {
-            request.push_back(static_cast<uint8_t>(AddressType::IPV4));
-            auto bytes = ip_addr.to_v4().to_bytes();
-            request.insert(request.end(), bytes.begin(), bytes.end());
-        } else {
-            request.push_back(static_cast<uint8_t>(AddressType::IPV6));
-            auto bytes = ip_addr.to_v6().to_bytes();
-            request.insert(request.end(), bytes.begin(), bytes.end());
-        }
-    } else {
-        // Domain name
-        request.push_back(static_cast<uint8_t>(AddressType::DOMAIN_NAME));
-        if (target_host.size() > 255) {
-            throw std::system_error(make_error_code(Error::INVALID_FORMAT));
-        }
-        request.push_back(static_cast<uint8_t>(target_host.size()));
-        request.insert(request.end(), target_host.begin(), target_host.end());
+    // 3. Send Request (Connect). The request and later the reply share one buffer.
+    auto target = Address::of(target_host, target_port);
+    if (!target) {
+        throw std::system_error(make_error_code(target.error()));
     }
-
-    // Port (Network Byte Order)
-    request.push_back(static_cast<uint8_t>((target_port >> 8) & 0xFF));
-    request.push_back(static_cast<uint8_t>(target_port & 0xFF));
-
-    co_await asio::async_write(socket, asio::buffer(request), asio::use_awaitable);
-
-    // 4. Receive Reply
-    // Read header first: VER, REP, RSV, ATYP
-    uint8_t reply_header[4];
-    co_await asio::async_read(socket, asio::buffer(reply_header), asio::use_awaitable);
-
-    if (reply_header[0] != VERSION) {
-        throw std::system_error(make_error_code(Error::INVALID_VERSION));
+    std::array<uint8_t, MAX_MESSAGE_SIZE> message;
+    size_t request_size = encode(Request{Command::CONNECT, *target}, message);
+    co_await asio::async_write(socket, asio::buffer(message.data(), request_size), asio::use_awaitable);
+
+    // 4. Receive Reply. Read no further than its end: what follows is the target's.
+    // VER REP RSV ATYP and the first address byte, which tells how long the rest is
+    co_await asio::async_read(socket, asio::buffer(message.data(), 5), asio::use_awaitable);
+    size_t reply_size = 3 + address_size(static_cast<AddressType>(message[3]), message[4]);
+    if (reply_size > 5) {
+        co_await asio::async_read(socket, asio::buffer(message.data() + 5, reply_size - 5), asio::use_awaitable);
     }
 
-    Reply rep = static_cast<Reply>(reply_header[1]);
-    if (rep != Reply::SUCCEEDED) {
+    auto reply = decode_reply({message.data(), std::max<size_t>(reply_size, 5)});
+    if (!reply) {
+        throw std::system_error(make_error_code(reply.error()));
+    }
+    if (reply->reply != Reply::SUCCEEDED) {
         // Map SOCKS5 errors to system_error or custom
         throw std::system_error(make_error_code(Error::CONNECTION_FAILED));
     }
-
-    AddressType atyp = static_cast<AddressType>(reply_header[3]);
-
-    // Read remaining address/port to clear the buffer
-    if (atyp == AddressType::IPV4) {
-        uint8_t buf[6]; // 4 IP + 2 Port
-        co_await asio::async_read(socket, asio::buffer(buf), asio::use_awaitable);
-    } else if (atyp == AddressType::IPV6) {
-        uint8_t buf[18]; // 16 IP + 2 Port
-        co_await asio::async_read(socket, asio::buffer(buf), asio::use_awaitable);
-    } else if (atyp == AddressType::DOMAIN_NAME) {
-        uint8_t len;
-        co_await asio::async_read(socket, asio::buffer(&len, 1), asio::use_awaitable);
-        std::vector<uint8_t> buf(len + 2); // Domain + 2 Port
-        co_await asio::async_read(socket, asio::buffer(buf), asio::use_awaitable);
-    } else {
-        throw std::system_error(make_error_code(Error::UNSUPPORTED_ADDRESS_TYPE));
-    }
 }
 
 } // namespace socks5
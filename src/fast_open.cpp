@@ -0,0 +1,44 @@
+#include "socks5/fast_open.hpp"
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+namespace socks5 {
+
+#if defined(__linux__) && defined(TCP_FASTOPEN) && defined(TCP_FASTOPEN_CONNECT)
+
+bool fast_open_supported() {
+    return true;
+}
+
+std::error_code enable_fast_open_listener(asio::ip::tcp::acceptor& acceptor, int queue_length) {
+    asio::error_code ec;
+    acceptor.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>(queue_length), ec);
+    return ec;
+}
+
+std::error_code enable_fast_open_connect(asio::ip::tcp::socket& socket) {
+    asio::error_code ec;
+    socket.set_option(asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(true), ec);
+    return ec;
+}
+
+#else
+
+bool fast_open_supported() {
+    return false;
+}
+
+std::error_code enable_fast_open_listener(asio::ip::tcp::acceptor&, int) {
+    return std::make_error_code(std::errc::not_supported);
+}
+
+std::error_code enable_fast_open_connect(asio::ip::tcp::socket&) {
+    return std::make_error_code(std::errc::not_supported);
+}
+
+#endif
+
+} // namespace socks5
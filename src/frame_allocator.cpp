@@ -0,0 +1,103 @@
+#include "socks5/frame_allocator.hpp"
+
+#include <array>
+
+namespace socks5 {
+
+namespace {
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+size_t size_class_for(size_t size) {
+    return (size + FrameAllocator::GRANULARITY - 1) / FrameAllocator::GRANULARITY - 1;
+}
+
+size_t block_size(size_t size_class) {
+    return (size_class + 1) * FrameAllocator::GRANULARITY;
+}
+
+struct FreeLists {
+    FreeLists();
+    ~FreeLists();
+
+    std::array<FreeBlock*, FrameAllocator::SIZE_CLASSES> heads{};
+    std::array<size_t, FrameAllocator::SIZE_CLASSES> counts{};
+    size_t bytes = 0;
+};
+
+// Trivially destructible, so it stays readable while the thread's other thread_locals are being torn down
+thread_local bool free_lists_destroyed = false;
+
+FreeLists::FreeLists() = default;
+
+FreeLists::~FreeLists() {
+    free_lists_destroyed = true;
+    for (size_t i = 0; i < FrameAllocator::SIZE_CLASSES; ++i) {
+        while (heads[i]) {
+            auto* block = heads[i];
+            heads[i] = block->next;
+            ::operator delete(block, block_size(i));
+        }
+    }
+}
+
+FreeLists& local_free_lists() {
+    thread_local FreeLists lists;
+    return lists;
+}
+
+} // namespace
+
+void* FrameAllocator::allocate(size_t size) {
+    if (size == 0 || size > MAX_RECYCLED_SIZE)
+        return ::operator new(size);
+
+    size_t size_class = size_class_for(size);
+    // Frames created during thread exit, after this thread's free lists; they must not bring the lists back to life
+    if (free_lists_destroyed)
+        return ::operator new(block_size(size_class));
+
+    auto& lists = local_free_lists();
+    if (auto* block = lists.heads[size_class]) {
+        lists.heads[size_class] = block->next;
+        --lists.counts[size_class];
+        lists.bytes -= block_size(size_class);
+        return block;
+    }
+    return ::operator new(block_size(size_class));
+}
+
+size_t FrameAllocator::idle_bytes() {
+    if (free_lists_destroyed)
+        return 0;
+    return local_free_lists().bytes;
+}
+
+void FrameAllocator::deallocate(void* pointer, size_t size) noexcept {
+    if (size == 0 || size > MAX_RECYCLED_SIZE) {
+        ::operator delete(pointer);
+        return;
+    }
+
+    size_t size_class = size_class_for(size);
+    if (free_lists_destroyed) {
+        // Frames destroyed during thread exit, after this thread's free lists
+        ::operator delete(pointer, block_size(size_class));
+        return;
+    }
+
+    auto& lists = local_free_lists();
+    if (lists.counts[size_class] >= MAX_FREE_PER_CLASS || lists.bytes + block_size(size_class) > MAX_FREE_BYTES) {
+        ::operator delete(pointer, block_size(size_class));
+        return;
+    }
+    auto* block = static_cast<FreeBlock*>(pointer);
+    block->next = lists.heads[size_class];
+    lists.heads[size_class] = block;
+    ++lists.counts[size_class];
+    lists.bytes += block_size(size_class);
+}
+
+} // namespace socks5
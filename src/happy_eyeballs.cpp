@@ -0,0 +1,198 @@
+#include "socks5/happy_eyeballs.hpp"
+
+#include "socks5/fast_open.hpp"
+#include "socks5/frame_allocator.hpp"
+#include "socks5/protocol.hpp"
+#include "socks5/timeout.hpp"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+namespace socks5 {
+
+void ConnectHistory::record_success(std::string_view destination, const asio::ip::address& address,
+                                    std::chrono::nanoseconds elapsed) {
+    update(destination, address.is_v6(), std::max(elapsed, std::chrono::nanoseconds(1)), false);
+}
+
+void ConnectHistory::record_failure(std::string_view destination, const asio::ip::address& address,
+                                    std::chrono::nanoseconds penalty) {
+    update(destination, address.is_v6(), penalty, true);
+}
+
+void ConnectHistory::update(std::string_view destination, bool v6, std::chrono::nanoseconds sample, bool failed) {
+    std::lock_guard lock(mutex_);
+    auto it = timings_.find(destination);
+    if (it == timings_.end()) {
+        if (timings_.size() >= max_entries_)
+            timings_.erase(timings_.begin());
+        it = timings_.try_emplace(std::string(destination)).first;
+    }
+
+    auto& timing = v6 ? it->second.v6 : it->second.v4;
+    timing.smoothed = timing.smoothed.count() == 0 ? sample : (timing.smoothed * 7 + sample) / 8;
+    timing.last_failed = failed;
+}
+
+std::optional<bool> ConnectHistory::prefers_v6(std::string_view destination) const {
+    std::lock_guard lock(mutex_);
+    auto it = timings_.find(destination);
+    if (it == timings_.end())
+        return std::nullopt;
+
+    const auto& [v4, v6] = it->second;
+    bool v4_known = v4.smoothed.count() != 0;
+    bool v6_known = v6.smoothed.count() != 0;
+    if (v4_known && v6_known) {
+        if (v4.last_failed != v6.last_failed)
+            return v4.last_failed;
+        return v6.smoothed <= v4.smoothed;
+    }
+    // Only one family tried so far: stay with it if it worked, otherwise give the other one a go
+    if (v6_known)
+        return !v6.last_failed;
+    return v4.last_failed;
+}
+
+void interleave_families(std::span<asio::ip::tcp::endpoint> endpoints, bool v6_first) {
+    // Each position takes the next address of the family whose turn it is; the ones it skips move back one
+    bool v6 = v6_first;
+    for (auto it = endpoints.begin(); it != endpoints.end(); ++it, v6 = !v6) {
+        auto next = std::find_if(it, endpoints.end(), [v6](const auto& e) { return e.address().is_v6() == v6; });
+        if (next == endpoints.end())
+            break; // Only the other family is left, already in order
+        std::rotate(it, next, next + 1);
+    }
+}
+
+namespace {
+
+// State shared by the racing attempts and the coroutine that starts them. Held inline and allocated through the
+// thread's FrameAllocator, so a race does not touch the heap.
+struct Race {
+    explicit Race(const asio::any_io_executor& executor) : executor(executor), wake(executor) {}
+
+    asio::any_io_executor executor;
+    std::array<asio::ip::tcp::endpoint, MAX_CONNECT_ENDPOINTS> endpoints;
+    std::array<std::optional<asio::ip::tcp::socket>, MAX_CONNECT_ENDPOINTS> sockets; // Opened as attempts start
+    size_t count = 0;
+    asio::steady_timer wake; // Cancelled by every finished attempt
+    size_t in_flight = 0;
+    std::optional<size_t> winner;
+    std::chrono::nanoseconds winner_elapsed{0};
+    std::error_code last_error;
+    bool fast_open = false;
+
+    ConnectHistory* history = nullptr;
+    Domain destination;
+    std::chrono::nanoseconds failure_penalty{0};
+};
+
+// Closes every socket but the winner's when the race ends, however it ends
+struct CloseLosers {
+    ~CloseLosers() {
+        for (size_t i = 0; i < race->count; ++i) {
+            asio::error_code ec;
+            if (race->winner != i && race->sockets[i])
+                race->sockets[i]->close(ec);
+        }
+    }
+
+    std::shared_ptr<Race> race;
+};
+
+asio::awaitable<void> attempt(std::shared_ptr<Race> race, size_t index) {
+    auto started = std::chrono::steady_clock::now();
+    auto& socket = race->sockets[index].emplace(race->executor);
+    if (race->fast_open) {
+        // Best effort: without it the connect is a regular handshake
+        asio::error_code ec;
+        socket.open(race->endpoints[index].protocol(), ec);
+        if (!ec)
+            enable_fast_open_connect(socket);
+    }
+    auto result =
+        as_expected(co_await socket.async_connect(race->endpoints[index], asio::as_tuple(asio::use_awaitable)));
+    --race->in_flight;
+
+    if (result && !race->winner) {
+        race->winner = index;
+        race->winner_elapsed = std::chrono::steady_clock::now() - started;
+    } else if (result) {
+        asio::error_code ec;
+        socket.close(ec);
+    } else if (result.error() != asio::error::operation_aborted) {
+        race->last_error = result.error();
+        if (race->history)
+            race->history->record_failure(race->destination.view(), race->endpoints[index].address(),
+                                          race->failure_penalty);
+    }
+    race->wake.cancel();
+}
+
+} // namespace
+
+asio::awaitable<std::expected<asio::ip::tcp::socket, std::error_code>>
+happy_eyeballs_connect(std::span<const asio::ip::tcp::endpoint> endpoints, HappyEyeballsOptions options,
+                       ConnectHistory* history, std::string_view destination) {
+    if (endpoints.empty())
+        co_return std::unexpected(asio::error::host_not_found);
+
+    auto executor = co_await asio::this_coro::executor;
+    auto race = std::allocate_shared<Race>(RecyclingAllocator<Race>(), executor);
+    race->count = std::min(endpoints.size(), MAX_CONNECT_ENDPOINTS);
+    std::copy_n(endpoints.begin(), race->count, race->endpoints.begin());
+    // Unnamed destinations would all share one entry
+    if (!destination.empty() && race->destination.assign(destination))
+        race->history = history;
+
+    bool v6_first = race->endpoints.front().address().is_v6();
+    if (race->history) {
+        if (auto preferred = race->history->prefers_v6(destination))
+            v6_first = *preferred;
+    }
+    interleave_families(std::span(race->endpoints.data(), race->count), v6_first);
+    race->failure_penalty = options.timeout;
+    race->fast_open = options.fast_open;
+    CloseLosers close_losers{race};
+
+    auto give_up_at = std::chrono::steady_clock::now() + options.timeout;
+    size_t next = 0;
+    while (!race->winner) {
+        if (next < race->count) {
+            ++race->in_flight;
+            asio::co_spawn(executor, attempt(race, next++), asio::detached);
+        } else if (race->in_flight == 0) {
+            break; // Every address failed
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= give_up_at)
+            break;
+        auto wait = give_up_at - now;
+        if (next < race->count)
+            wait = std::min<std::chrono::steady_clock::duration>(wait, options.attempt_delay);
+
+        // Wakes on the delay, or early when an attempt finishes; a failure starts the next attempt right away
+        race->wake.expires_after(wait);
+        co_await race->wake.async_wait(asio::as_tuple(asio::use_awaitable));
+
+        auto cancelled = (co_await asio::this_coro::cancellation_state).cancelled();
+        if (cancelled != asio::cancellation_type::none)
+            co_return std::unexpected(asio::error::operation_aborted);
+    }
+
+    if (!race->winner) {
+        if (race->in_flight > 0 || !race->last_error)
+            co_return std::unexpected(std::make_error_code(std::errc::timed_out));
+        co_return std::unexpected(race->last_error);
+    }
+
+    const auto& endpoint = race->endpoints[*race->winner];
+    if (race->history)
+        race->history->record_success(race->destination.view(), endpoint.address(), race->winner_elapsed);
+    co_return std::move(*race->sockets[*race->winner]);
+}
+
+} // namespace socks5
@@ -1,35 +1,176 @@
 #include "socks5/server.hpp"
+#include "socks5/splice.hpp"
 
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <functional>
+#include <optional>
 #include <print>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+namespace {
+
+void print_usage() {
+    std::println(stderr, "Usage: socks5_server <port> [bind_ip] [--shards N] [--relay copy|splice|pipelined]"
+                         " [--fast-open listen|connect|both] [--udp-relay per-association|shared[:PORT]]"
+                         " [--metrics-port PORT]");
+    std::println(stderr, "  --shards N            io_context threads, each with its own acceptor (0 = one per core)");
+    std::println(stderr, "  --relay ENGINE        TCP relay engine: copy, splice (Linux only, falls back to copy) or"
+                         " pipelined (reads overlap writes)");
+    std::println(stderr, "  --fast-open MODE      TCP Fast Open from clients (listen), to targets (connect) or both");
+    std::println(stderr, "  --udp-relay MODE      UDP socket per association, or a few shared per shard (from PORT)");
+    std::println(stderr, "  --metrics-port PORT   Serve Prometheus metrics on http://127.0.0.1:PORT/metrics");
+}
+
+// The whole of `text` as a number of type T, or nullopt when it is not one or does not fit
+template <typename T>
+std::optional<T> parse_number(std::string_view text) {
+    T value{};
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size())
+        return std::nullopt;
+    return value;
+}
+
+void print_shard_stats(const socks5::Server& server) {
+    auto stats = server.shard_stats();
+    for (size_t i = 0; i < stats.size(); ++i) {
+        std::println("shard {}: {} active sessions, {} total", i, stats[i].active_sessions, stats[i].total_sessions);
+    }
+}
+
+void print_handshake_latency(const socks5::Server& server) {
+    auto latency = server.handshake_latency();
+    for (size_t p = 0; p < latency.size(); ++p) {
+        const auto& phase = latency[p];
+        std::println("handshake {}: {} samples, p50 {}us, p99 {}us, p999 {}us",
+                     socks5::handshake_phase_name(static_cast<socks5::HandshakePhase>(p)), phase.count,
+                     phase.p50.count(), phase.p99.count(), phase.p999.count());
+    }
+}
+
+} // namespace
+
 int main(int argc, char* argv[]) {
-    if (argc < 2 || argc > 3) {
-        std::println(stderr, "Usage: socks5_server <port> [bind_ip]");
+    std::vector<std::string_view> positional;
+    socks5::ServerOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            auto shards = parse_number<size_t>(argv[++i]);
+            if (!shards) {
+                print_usage();
+                return 1;
+            }
+            options.shards = *shards;
+            if (options.shards == 0)
+                options.shards = std::max(1u, std::thread::hardware_concurrency());
+        } else if (arg == "--relay" && i + 1 < argc) {
+            std::string_view engine = argv[++i];
+            if (engine == "splice") {
+                // Said once here rather than discovered again by every session
+                if (socks5::splice_supported()) {
+                    options.relay_engine = socks5::RelayEngine::SPLICE;
+                } else {
+                    std::println(stderr, "--relay splice is not supported on this platform; using copy");
+                    options.relay_engine = socks5::RelayEngine::COPY;
+                }
+            } else if (engine == "pipelined") {
+                options.relay_engine = socks5::RelayEngine::PIPELINED;
+            } else if (engine == "copy") {
+                options.relay_engine = socks5::RelayEngine::COPY;
+            } else {
+                print_usage();
+                return 1;
+            }
+        } else if (arg == "--fast-open" && i + 1 < argc) {
+            std::string_view mode = argv[++i];
+            if (mode != "listen" && mode != "connect" && mode != "both") {
+                print_usage();
+                return 1;
+            }
+            options.fast_open_listen = mode != "connect";
+            options.happy_eyeballs.fast_open = mode != "listen";
+        } else if (arg == "--udp-relay" && i + 1 < argc) {
+            std::string_view mode = argv[++i];
+            if (mode == "per-association") {
+                options.udp_relay = socks5::UdpRelayMode::PER_ASSOCIATION;
+            } else if (mode.starts_with("shared")) {
+                options.udp_relay = socks5::UdpRelayMode::SHARED;
+                if (mode.starts_with("shared:")) {
+                    auto first_port = parse_number<uint16_t>(mode.substr(7));
+                    if (!first_port) {
+                        print_usage();
+                        return 1;
+                    }
+                    options.shared_udp.first_port = *first_port;
+                } else if (mode != "shared") {
+                    print_usage();
+                    return 1;
+                }
+            } else {
+                print_usage();
+                return 1;
+            }
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            auto metrics_port = parse_number<uint16_t>(argv[++i]);
+            if (!metrics_port) {
+                print_usage();
+                return 1;
+            }
+            options.metrics_port = *metrics_port;
+        } else if (arg.starts_with("--")) {
+            print_usage();
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    auto parsed_port = positional.empty() ? std::nullopt : parse_number<uint16_t>(positional[0]);
+    if (!parsed_port || positional.size() > 2) {
+        print_usage();
         return 1;
     }
 
-    uint16_t port = static_cast<uint16_t>(std::stoi(argv[1]));
-    std::string ip = (argc == 3) ? argv[2] : "0.0.0.0";
+    uint16_t port = *parsed_port;
+    std::string ip = (positional.size() == 2) ? std::string(positional[1]) : "0.0.0.0";
 
     try {
-        asio::io_context io_context(1); // One thread for now, or hardware_concurrency
-
-        socks5::Server server(io_context, port, ip);
+        socks5::Server server(port, ip, options);
         server.start();
 
-        std::println("SOCKS5 Server listening on {}:{}...", ip, port);
+        std::println("SOCKS5 Server listening on {}:{} with {} shard(s) on {}...", ip, port, options.shards,
+                     socks5::io_backend());
+
+        // Shards run on their own threads; the main thread only waits for signals
+        asio::io_context signal_context(1);
+        asio::signal_set signals(signal_context, SIGINT, SIGTERM);
+        signals.async_wait([&](auto, auto) { signal_context.stop(); });
 
-        // Signal handling
-        asio::signal_set signals(io_context, SIGINT, SIGTERM);
-        signals.async_wait([&](auto, auto) { io_context.stop(); });
+#if defined(SIGUSR1)
+        asio::signal_set report_signals(signal_context, SIGUSR1);
+        std::function<void(const asio::error_code&, int)> on_report = [&](const asio::error_code& ec, int) {
+            if (ec)
+                return;
+            print_shard_stats(server);
+            print_handshake_latency(server);
+            report_signals.async_wait(on_report);
+        };
+        report_signals.async_wait(on_report);
+#endif
 
-        io_context.run();
+        signal_context.run();
+        server.stop();
+        print_shard_stats(server);
     } catch (std::exception& e) {
         std::println(stderr, "Exception: {}", e.what());
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,168 @@
+#include "socks5/metrics.hpp"
+
+#include <algorithm>
+#include <format>
+#include <iterator>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace socks5 {
+
+namespace {
+
+void add_to(MetricsSnapshot& total, const ThreadMetrics& metrics) {
+    auto merge = [](auto& to, const auto& from) {
+        for (size_t i = 0; i < to.size(); ++i)
+            to[i] += from[i].value();
+    };
+    total.sessions_accepted += metrics.sessions_accepted.value();
+    total.sessions_closed += metrics.sessions_closed.value();
+    merge(total.sessions_failed, metrics.sessions_failed);
+    merge(total.timeouts, metrics.timeouts);
+    merge(total.relay_bytes, metrics.relay_bytes);
+    merge(total.udp_forwarded, metrics.udp_forwarded);
+    merge(total.udp_dropped, metrics.udp_dropped);
+    for (size_t p = 0; p < HANDSHAKE_PHASES; ++p)
+        total.handshake[p].merge(metrics.handshake[p]);
+}
+
+// Every thread's counters, plus the totals of threads that have exited. The lock is only taken when a thread first
+// counts something, when it exits and on scrapes, never on an increment.
+struct Registry {
+    std::mutex mutex;
+    std::vector<const ThreadMetrics*> live;
+    MetricsSnapshot exited;
+
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+};
+
+struct ThreadRegistration {
+    ThreadRegistration() {
+        auto& registry = Registry::instance();
+        std::lock_guard lock(registry.mutex);
+        registry.live.push_back(&metrics);
+    }
+
+    ~ThreadRegistration() {
+        auto& registry = Registry::instance();
+        std::lock_guard lock(registry.mutex);
+        add_to(registry.exited, metrics);
+        std::erase(registry.live, &metrics);
+    }
+
+    ThreadMetrics metrics;
+};
+
+constexpr std::array<std::string_view, REPLY_CODES> REPLY_NAMES = {
+    "succeeded",          "general_failure",    "not_allowed",           "network_unreachable",
+    "host_unreachable",   "connection_refused", "ttl_expired",           "command_not_supported",
+    "address_type_not_supported"};
+constexpr std::array<std::string_view, DIRECTIONS> DIRECTION_NAMES = {"upstream", "downstream"};
+constexpr std::array<std::string_view, TIMEOUT_PHASES> PHASE_NAMES = {"handshake", "idle"};
+constexpr std::array<std::string_view, UDP_DROP_REASONS> DROP_NAMES = {
+    "truncated",   "malformed", "fragmented", "unresolved", "pending_full", "unsolicited",
+    "send_failed", "no_port"};
+constexpr std::array<std::string_view, HANDSHAKE_PHASES> HANDSHAKE_PHASE_NAMES = {"greeting", "request", "resolve",
+                                                                                  "connect",  "reply",   "total"};
+
+void header(std::string& out, std::string_view name, std::string_view type, std::string_view help) {
+    std::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+void sample(std::string& out, std::string_view name, uint64_t value) {
+    std::format_to(std::back_inserter(out), "{} {}\n", name, value);
+}
+
+template <size_t N>
+void labelled(std::string& out, std::string_view name, std::string_view label,
+              const std::array<std::string_view, N>& values, const std::array<uint64_t, N>& samples) {
+    for (size_t i = 0; i < N; ++i)
+        std::format_to(std::back_inserter(out), "{}{{{}=\"{}\"}} {}\n", name, label, values[i], samples[i]);
+}
+
+} // namespace
+
+std::string_view handshake_phase_name(HandshakePhase phase) {
+    return HANDSHAKE_PHASE_NAMES[static_cast<size_t>(phase)];
+}
+
+LatencySummary LatencySummary::of(const Histogram& histogram) {
+    return {histogram.count(), std::chrono::microseconds(histogram.percentile(0.5)),
+            std::chrono::microseconds(histogram.percentile(0.99)),
+            std::chrono::microseconds(histogram.percentile(0.999))};
+}
+
+ThreadMetrics& Metrics::local() {
+    thread_local ThreadRegistration registration;
+    return registration.metrics;
+}
+
+MetricsSnapshot Metrics::collect() {
+    auto& registry = Registry::instance();
+    std::lock_guard lock(registry.mutex);
+    MetricsSnapshot total = registry.exited;
+    for (const auto* metrics : registry.live)
+        add_to(total, *metrics);
+    return total;
+}
+
+std::string render_prometheus(const MetricsSnapshot& m) {
+    std::string out;
+    out.reserve(8192);
+
+    header(out, "socks5_sessions_accepted_total", "counter", "Client connections accepted.");
+    sample(out, "socks5_sessions_accepted_total", m.sessions_accepted);
+    header(out, "socks5_sessions_active", "gauge", "Client connections currently open.");
+    sample(out, "socks5_sessions_active", m.sessions_accepted - std::min(m.sessions_closed, m.sessions_accepted));
+
+    // Reply 0 never marks a failure
+    std::array<uint64_t, REPLY_CODES - 1> failed;
+    std::copy(m.sessions_failed.begin() + 1, m.sessions_failed.end(), failed.begin());
+    std::array<std::string_view, REPLY_CODES - 1> failed_names;
+    std::copy(REPLY_NAMES.begin() + 1, REPLY_NAMES.end(), failed_names.begin());
+    header(out, "socks5_sessions_failed_total", "counter", "Requests refused, by the SOCKS reply sent.");
+    labelled(out, "socks5_sessions_failed_total", "reply", failed_names, failed);
+
+    header(out, "socks5_timeouts_total", "counter", "Sessions closed by their deadline, by phase.");
+    labelled(out, "socks5_timeouts_total", "phase", PHASE_NAMES, m.timeouts);
+
+    header(out, "socks5_relay_bytes_total", "counter", "Bytes relayed through CONNECT tunnels.");
+    labelled(out, "socks5_relay_bytes_total", "direction", DIRECTION_NAMES, m.relay_bytes);
+
+    header(out, "socks5_udp_datagrams_forwarded_total", "counter", "UDP datagrams relayed.");
+    labelled(out, "socks5_udp_datagrams_forwarded_total", "direction", DIRECTION_NAMES, m.udp_forwarded);
+    header(out, "socks5_udp_datagrams_dropped_total", "counter", "UDP datagrams dropped, by reason.");
+    labelled(out, "socks5_udp_datagrams_dropped_total", "reason", DROP_NAMES, m.udp_dropped);
+
+    header(out, "socks5_handshake_phase_seconds", "summary", "Duration of each CONNECT setup phase.");
+    for (size_t p = 0; p < HANDSHAKE_PHASES; ++p) {
+        const auto& histogram = m.handshake[p];
+        auto phase = HANDSHAKE_PHASE_NAMES[p];
+        for (double quantile : {0.5, 0.99, 0.999}) {
+            double seconds = static_cast<double>(histogram.percentile(quantile)) / 1e6;
+            std::format_to(std::back_inserter(out),
+                           "socks5_handshake_phase_seconds{{phase=\"{}\",quantile=\"{}\"}} {}\n", phase, quantile,
+                           seconds);
+        }
+        std::format_to(std::back_inserter(out), "socks5_handshake_phase_seconds_sum{{phase=\"{}\"}} {}\n", phase,
+                       static_cast<double>(histogram.sum) / 1e6);
+        std::format_to(std::back_inserter(out), "socks5_handshake_phase_seconds_count{{phase=\"{}\"}} {}\n", phase,
+                       histogram.count());
+    }
+
+    header(out, "socks5_resolver_cache_hits_total", "counter", "Names answered from the cache.");
+    sample(out, "socks5_resolver_cache_hits_total", m.resolver_hits);
+    header(out, "socks5_resolver_cache_negative_hits_total", "counter", "Cached NXDOMAIN answers served.");
+    sample(out, "socks5_resolver_cache_negative_hits_total", m.resolver_negative_hits);
+    header(out, "socks5_resolver_cache_misses_total", "counter", "Names that needed a lookup.");
+    sample(out, "socks5_resolver_cache_misses_total", m.resolver_misses);
+    header(out, "socks5_resolver_cache_coalesced_total", "counter", "Lookups that joined one already in flight.");
+    sample(out, "socks5_resolver_cache_coalesced_total", m.resolver_coalesced);
+    return out;
+}
+
+} // namespace socks5
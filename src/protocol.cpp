@@ -1,5 +1,7 @@
 #include "socks5/protocol.hpp"
 
+#include <algorithm>
+
 namespace socks5 {
 
 class Socks5Category : public std::error_category {
@@ -39,4 +41,199 @@ std::error_code make_error_code(Error e) {
     return {static_cast<int>(e), socks5_category()};
 }
 
+Address Address::of(const asio::ip::address& ip, uint16_t port) {
+    Address address;
+    address.type = ip.is_v4() ? AddressType::IPV4 : AddressType::IPV6;
+    address.ip = ip;
+    address.port = port;
+    return address;
+}
+
+std::expected<Address, Error> Address::of(const std::string& host, uint16_t port) {
+    asio::error_code ec;
+    auto ip = asio::ip::make_address(host, ec);
+    if (!ec)
+        return of(ip, port);
+
+    Address address;
+    address.type = AddressType::DOMAIN_NAME;
+    if (!address.domain.assign(host))
+        return std::unexpected(Error::INVALID_FORMAT);
+    address.port = port;
+    return address;
+}
+
+namespace {
+
+size_t encode_port(uint16_t port, std::span<uint8_t> out) {
+    out[0] = static_cast<uint8_t>(port >> 8);
+    out[1] = static_cast<uint8_t>(port & 0xFF);
+    return 2;
+}
+
+size_t encode(const Address& address, std::span<uint8_t> out) {
+    if (address.type != AddressType::DOMAIN_NAME)
+        return encode_address(address.ip, address.port, out);
+
+    auto name = address.domain.view();
+    size_t size = 1 + 1 + name.size() + 2;
+    if (out.size() < size)
+        return 0;
+    out[0] = static_cast<uint8_t>(AddressType::DOMAIN_NAME);
+    out[1] = static_cast<uint8_t>(name.size());
+    std::copy(name.begin(), name.end(), out.begin() + 2);
+    encode_port(address.port, out.subspan(2 + name.size()));
+    return size;
+}
+
+// VER CODE RSV ATYP ADDR PORT, the shape requests and replies share
+size_t encode_message(uint8_t code, const Address& address, std::span<uint8_t> out) {
+    if (out.size() < 3)
+        return 0;
+    size_t size = encode(address, out.subspan(3));
+    if (size == 0)
+        return 0;
+    out[0] = VERSION;
+    out[1] = code;
+    out[2] = RSV;
+    return 3 + size;
+}
+
+// ATYP ADDR PORT at the front of `data`: the bytes it occupies, 0 while incomplete, or an unknown ATYP
+std::expected<size_t, Error> address_length(std::span<const uint8_t> data) {
+    if (data.empty() || (data[0] == static_cast<uint8_t>(AddressType::DOMAIN_NAME) && data.size() < 2))
+        return 0;
+    size_t size = address_size(static_cast<AddressType>(data[0]), data.size() > 1 ? data[1] : 0);
+    if (size == 0)
+        return std::unexpected(Error::UNSUPPORTED_ADDRESS_TYPE);
+    return data.size() < size ? 0 : size;
+}
+
+} // namespace
+
+size_t encode(const Request& request, std::span<uint8_t> out) {
+    return encode_message(static_cast<uint8_t>(request.command), request.address, out);
+}
+
+size_t encode(const Response& response, std::span<uint8_t> out) {
+    return encode_message(static_cast<uint8_t>(response.reply), response.address, out);
+}
+
+size_t encode_address(const asio::ip::address& ip, uint16_t port, std::span<uint8_t> out) {
+    if (ip.is_v4()) {
+        if (out.size() < 1 + 4 + 2)
+            return 0;
+        out[0] = static_cast<uint8_t>(AddressType::IPV4);
+        auto bytes = ip.to_v4().to_bytes();
+        std::copy(bytes.begin(), bytes.end(), out.begin() + 1);
+        return 1 + bytes.size() + encode_port(port, out.subspan(1 + bytes.size()));
+    }
+    if (out.size() < 1 + 16 + 2)
+        return 0;
+    out[0] = static_cast<uint8_t>(AddressType::IPV6);
+    auto bytes = ip.to_v6().to_bytes();
+    std::copy(bytes.begin(), bytes.end(), out.begin() + 1);
+    return 1 + bytes.size() + encode_port(port, out.subspan(1 + bytes.size()));
+}
+
+size_t encode_success_reply(const asio::ip::address& ip, uint16_t port, std::span<uint8_t> out) {
+    if (out.size() < 3)
+        return 0;
+    size_t size = encode_address(ip, port, out.subspan(3));
+    if (size == 0)
+        return 0;
+    out[0] = VERSION;
+    out[1] = static_cast<uint8_t>(Reply::SUCCEEDED);
+    out[2] = RSV;
+    return 3 + size;
+}
+
+size_t encode_udp_header(const asio::ip::udp::endpoint& sender, std::span<uint8_t> out) {
+    if (out.size() < 3)
+        return 0;
+    size_t size = encode_address(sender.address(), sender.port(), out.subspan(3));
+    if (size == 0)
+        return 0;
+    out[0] = 0x00;
+    out[1] = 0x00; // RSV
+    out[2] = 0x00; // FRAG
+    return 3 + size;
+}
+
+asio::ip::address AddressView::ip() const {
+    if (type() == AddressType::IPV4) {
+        asio::ip::address_v4::bytes_type address;
+        std::copy_n(bytes.begin() + 1, address.size(), address.begin());
+        return asio::ip::make_address_v4(address);
+    }
+    if (type() == AddressType::IPV6) {
+        asio::ip::address_v6::bytes_type address;
+        std::copy_n(bytes.begin() + 1, address.size(), address.begin());
+        return asio::ip::make_address_v6(address);
+    }
+    return {};
+}
+
+std::string_view AddressView::domain() const {
+    if (type() != AddressType::DOMAIN_NAME)
+        return {};
+    return {reinterpret_cast<const char*>(bytes.data() + 2), bytes[1]};
+}
+
+bool GreetingView::offers(AuthMethod method) const {
+    return std::ranges::find(methods, static_cast<uint8_t>(method)) != methods.end();
+}
+
+std::expected<GreetingView, Error> decode_greeting(std::span<const uint8_t> data) {
+    if (data.size() < 2)
+        return GreetingView{};
+    if (data[0] != VERSION)
+        return std::unexpected(Error::INVALID_VERSION);
+
+    size_t total = 2 + static_cast<size_t>(data[1]);
+    if (data.size() < total)
+        return GreetingView{};
+    return GreetingView{data.subspan(2, data[1]), total};
+}
+
+std::expected<RequestView, Error> decode_request(std::span<const uint8_t> data) {
+    if (data.size() < 4)
+        return RequestView{};
+    if (data[0] != VERSION)
+        return std::unexpected(Error::INVALID_VERSION);
+
+    auto address = address_length(data.subspan(3));
+    if (!address)
+        return std::unexpected(address.error());
+    if (*address == 0)
+        return RequestView{};
+    return RequestView{static_cast<Command>(data[1]), {data.subspan(3, *address)}, 3 + *address};
+}
+
+std::expected<ReplyView, Error> decode_reply(std::span<const uint8_t> data) {
+    if (data.size() < 4)
+        return ReplyView{};
+    if (data[0] != VERSION)
+        return std::unexpected(Error::INVALID_VERSION);
+
+    auto address = address_length(data.subspan(3));
+    if (!address)
+        return std::unexpected(address.error());
+    if (*address == 0)
+        return ReplyView{};
+    return ReplyView{static_cast<Reply>(data[1]), {data.subspan(3, *address)}, 3 + *address};
+}
+
+std::expected<UdpHeaderView, Error> decode_udp_header(std::span<const uint8_t> datagram) {
+    if (datagram.size() < 4 || datagram[0] != 0x00 || datagram[1] != 0x00)
+        return std::unexpected(Error::INVALID_FORMAT);
+
+    auto address = address_length(datagram.subspan(3));
+    if (!address)
+        return std::unexpected(address.error());
+    if (*address == 0)
+        return std::unexpected(Error::INVALID_FORMAT);
+    return UdpHeaderView{datagram[2], {datagram.subspan(3, *address)}, 3 + *address};
+}
+
 } // namespace socks5
@@ -0,0 +1,183 @@
+#include "socks5/resolver_cache.hpp"
+
+#include <algorithm>
+
+namespace socks5 {
+
+SystemResolver::SystemResolver(size_t threads) : pool_(threads) {}
+
+SystemResolver::~SystemResolver() {
+    pool_.stop();
+    pool_.join();
+}
+
+void SystemResolver::lookup(const std::string& host, Callback done) {
+    // A blocking resolve on one of the pool's threads. async_resolve would run every getaddrinfo on the one internal
+    // thread asio keeps per execution context, however many threads run the context.
+    asio::post(pool_, [this, host, done = std::move(done)] {
+        asio::ip::tcp::resolver resolver(pool_);
+        asio::error_code ec;
+        auto results = resolver.resolve(host, "0", ec);
+        ResolveAnswer answer;
+        answer.error = ec;
+        for (const auto& entry : results) {
+            auto address = entry.endpoint().address();
+            if (std::find(answer.addresses.begin(), answer.addresses.end(), address) == answer.addresses.end())
+                answer.addresses.push_back(address);
+        }
+        if (!ec && answer.addresses.empty())
+            answer.error = asio::error::host_not_found;
+        done(std::move(answer));
+    });
+}
+
+ResolverCache::ResolverCache(std::shared_ptr<ResolverBackend> backend, ResolverCacheOptions options)
+    : backend_(std::move(backend)), options_(options) {}
+
+std::optional<std::expected<ResolverCache::Addresses, std::error_code>> ResolverCache::try_get(std::string_view host) {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(host);
+    if (it == entries_.end() || it->second.pending || it->second.expires <= clock::now())
+        return std::nullopt;
+
+    if (it->second.error) {
+        ++stats_.negative_hits;
+        return std::unexpected(it->second.error);
+    }
+    ++stats_.hits;
+    return it->second.addresses;
+}
+
+ResolverCache::Stats ResolverCache::stats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void ResolverCache::start(std::string host, Handler handler) {
+    auto slot = asio::get_associated_cancellation_slot(handler);
+    uint64_t waiter_id;
+    bool query = false;
+    {
+        std::unique_lock lock(mutex_);
+        auto now = clock::now();
+        auto [it, inserted] = entries_.try_emplace(host);
+        auto& entry = it->second;
+
+        if (!inserted && !entry.pending && entry.expires > now) {
+            // Fresh answer; completion still goes through the caller's executor
+            if (entry.error)
+                ++stats_.negative_hits;
+            else
+                ++stats_.hits;
+            auto ec = entry.error;
+            auto addresses = entry.addresses;
+            lock.unlock();
+            post_completion(std::move(handler), ec, std::move(addresses));
+            return;
+        }
+
+        if (entry.pending) {
+            ++stats_.coalesced;
+        } else {
+            ++stats_.misses;
+            if (!inserted)
+                by_expiry_.erase({entry.expires, it->first}); // Expired; pending entries are not evictable
+            entry.pending = true;
+            query = true;
+            if (inserted)
+                evict();
+        }
+        waiter_id = next_waiter_id_++;
+        entry.waiters.push_back({waiter_id, std::move(handler)});
+    }
+
+    if (slot.is_connected()) {
+        slot.assign([weak = weak_from_this(), host, waiter_id](asio::cancellation_type) {
+            if (auto self = weak.lock())
+                self->cancel(host, waiter_id);
+        });
+    }
+
+    if (query) {
+        backend_->lookup(host, [weak = weak_from_this(), host](ResolveAnswer answer) {
+            if (auto self = weak.lock())
+                self->complete(host, std::move(answer));
+        });
+    }
+}
+
+void ResolverCache::complete(const std::string& host, ResolveAnswer answer) {
+    std::vector<Waiter> waiters;
+    Addresses addresses;
+    std::error_code ec = answer.error;
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(host);
+        if (it == entries_.end())
+            return;
+        auto& entry = it->second;
+        waiters = std::move(entry.waiters);
+        entry.waiters.clear();
+        entry.pending = false;
+
+        auto now = clock::now();
+        if (!ec) {
+            auto ttl = answer.ttl.count() > 0 ? answer.ttl : options_.default_ttl;
+            ttl = std::clamp(ttl, options_.min_ttl, options_.max_ttl);
+            addresses = std::make_shared<const std::vector<asio::ip::address>>(std::move(answer.addresses));
+            entry.addresses = addresses;
+            entry.error = {};
+            entry.expires = now + ttl;
+            by_expiry_.emplace(entry.expires, it->first);
+        } else if (ec == asio::error::host_not_found || ec == asio::error::no_data) {
+            entry.addresses.reset();
+            entry.error = ec;
+            entry.expires = now + options_.negative_ttl;
+            by_expiry_.emplace(entry.expires, it->first);
+        } else {
+            // Transient failures (timeouts, SERVFAIL) are not remembered
+            entries_.erase(it);
+        }
+    }
+
+    for (auto& waiter : waiters)
+        post_completion(std::move(waiter.handler), ec, addresses);
+}
+
+void ResolverCache::cancel(const std::string& host, uint64_t waiter_id) {
+    Handler handler;
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(host);
+        if (it == entries_.end())
+            return;
+        auto& waiters = it->second.waiters;
+        auto waiter = std::find_if(waiters.begin(), waiters.end(), [&](auto& w) { return w.id == waiter_id; });
+        if (waiter == waiters.end())
+            return;
+        handler = std::move(waiter->handler);
+        waiters.erase(waiter);
+        // The backend query keeps running and still fills the cache for the next caller
+    }
+    post_completion(std::move(handler), asio::error::operation_aborted, nullptr);
+}
+
+void ResolverCache::evict() {
+    // Expired answers sort first; past them, the live answer with the least time left goes
+    while (entries_.size() > options_.max_entries && !by_expiry_.empty()) {
+        auto oldest = by_expiry_.begin();
+        auto host = oldest->second;
+        by_expiry_.erase(oldest);
+        entries_.erase(entries_.find(host));
+    }
+}
+
+void ResolverCache::post_completion(Handler handler, std::error_code ec, Addresses addresses) {
+    auto executor = asio::get_associated_executor(handler, asio::system_executor());
+    asio::post(executor, [handler = std::move(handler), ec, addresses = std::move(addresses)]() mutable {
+        asio::get_associated_cancellation_slot(handler).clear();
+        std::move(handler)(ec, std::move(addresses));
+    });
+}
+
+} // namespace socks5
@@ -1,10 +1,28 @@
 #include "socks5/server.hpp"
 
+#include "socks5/buffer_pool.hpp"
+#include "socks5/fast_open.hpp"
+#include "socks5/frame_allocator.hpp"
+#include "socks5/happy_eyeballs.hpp"
+#include "socks5/metrics.hpp"
 #include "socks5/protocol.hpp"
+#include "socks5/resolver_cache.hpp"
+#include "socks5/splice.hpp"
 #include "socks5/timeout.hpp"
+#include "socks5/timing_wheel.hpp"
+#include "socks5/udp_batch.hpp"
+#include "socks5/udp_nat.hpp"
+#include "socks5/udp_pending.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <format>
 #include <print>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 using namespace asio::experimental::awaitable_operators;
@@ -14,142 +32,500 @@ namespace socks5 {
 
 constexpr auto HANDSHAKE_TIMEOUT = 10s;
 constexpr auto IDLE_TIMEOUT = 300s;
+constexpr int FAST_OPEN_QUEUE = 256; // Pending TFO connections per listener
+
+// Under io_uring a synchronous read_some is a syscall of its own, outside the ring. The TCP relays then wait for
+// readiness and read through the ring instead: a poll and a recv SQE per wakeup, no other syscall, and still no buffer
+// held while the tunnel is idle.
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+constexpr bool READ_THROUGH_RING = true;
+#else
+constexpr bool READ_THROUGH_RING = false;
+#endif
+
+namespace {
+
+#if defined(SO_REUSEPORT)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+// Bytes received during the handshake that have not been parsed yet. Fits the largest greeting (257 bytes) and
+// request (262 bytes) back to back, plus some early data. Also holds what the handshake needs only until the tunnel
+// is up: our reply and the addresses to race.
+struct HandshakeBuffer {
+    std::array<uint8_t, 1024> bytes;
+    std::array<uint8_t, 3 + MAX_IP_ADDRESS_SIZE> reply; // Our success reply, encoded here rather than in the frame
+    std::array<asio::ip::tcp::endpoint, MAX_CONNECT_ENDPOINTS> endpoints;
+    size_t endpoint_count = 0;
+    size_t begin = 0;
+    size_t end = 0;
+
+    std::span<const uint8_t> pending() const { return {bytes.data() + begin, end - begin}; }
+    asio::mutable_buffer free_space() { return asio::buffer(bytes.data() + end, bytes.size() - end); }
+    bool full() const { return end == bytes.size(); }
+    void commit(size_t n) { end += n; }
+    void consume(size_t n) { begin += n; }
+};
+
+// Sockets a session's deadline shuts down when it expires, failing whatever operation is pending on them
+struct SessionSockets {
+    asio::ip::tcp::socket* client = nullptr;
+    asio::ip::tcp::socket* target = nullptr;
+    TimeoutPhase phase = TimeoutPhase::HANDSHAKE;
+
+    static void close(void* context) {
+        auto* sockets = static_cast<SessionSockets*>(context);
+        Metrics::local().timeout(sockets->phase).add();
+        asio::error_code ec;
+        if (sockets->client)
+            sockets->client->close(ec);
+        if (sockets->target)
+            sockets->target->close(ec);
+    }
+};
+
+// What a UDP association's background resolutions need. Owned by relay_udp; completions hold it weakly and do nothing
+// once the association is gone.
+struct UdpAssociation {
+    // Bounds on datagrams held back while their destination resolves
+    static constexpr size_t MAX_PENDING_DESTINATIONS = 16;
+    static constexpr size_t MAX_PENDING_DATAGRAMS = 32; // Per destination
+    static constexpr size_t MAX_PENDING_BYTES = 64 * 1024;
+
+    explicit UdpAssociation(asio::ip::udp::socket& socket)
+        : socket(socket), pending(MAX_PENDING_DESTINATIONS, MAX_PENDING_DATAGRAMS, MAX_PENDING_BYTES) {}
+
+    // Maps a domain destination to the address it resolved to. Replies come from that address, so it gets an entry
+    // of its own.
+    UdpNatTable::Entry& remember(std::span<const uint8_t> key, const asio::ip::udp::endpoint& target,
+                                 UdpNatTable::clock::time_point now) {
+        std::array<uint8_t, UdpNatTable::MAX_IP_KEY> ip_key;
+        size_t ip_key_len = UdpNatTable::encode(target, ip_key);
+        nat.insert({ip_key.data(), ip_key_len}, target, now);
+        return nat.insert(key, target, now);
+    }
+
+    // Sends what was held for `key` once it resolved. The socket is non-blocking; datagrams that do not fit in its
+    // send buffer are dropped, as UDP would.
+    void resolved(const DestinationKey& key, const asio::ip::udp::endpoint& target) {
+        remember(key.bytes(), target, UdpNatTable::clock::now());
+        auto datagrams = pending.take(key);
+        if (!datagrams)
+            return;
+        auto& metrics = Metrics::local();
+        for (const auto& datagram : *datagrams) {
+            asio::error_code ec;
+            socket.send_to(asio::buffer(datagram), target, 0, ec);
+            if (ec)
+                metrics.dropped(UdpDrop::SEND_FAILED).add();
+            else
+                metrics.forwarded(Direction::UPSTREAM).add();
+        }
+    }
+
+    asio::ip::udp::socket& socket;
+    UdpNatTable nat;
+    PendingDatagrams<DestinationKey, DestinationKeyHash> pending; // Keyed like the NAT table
+};
+
+// Holds `payload` until its destination resolves. The first datagram for a destination starts its resolution off the
+// receive loop, whose answer goes to the association if it still exists. Not a coroutine, so the key stays out of
+// relay_udp's frame.
+void hold_until_resolved(ResolverCache& resolver, const std::shared_ptr<UdpAssociation>& association,
+                         std::span<const uint8_t> destination, std::string_view host, uint16_t port,
+                         std::span<const uint8_t> payload) {
+    DestinationKey key(destination);
+    if (!association->pending.hold(key, payload))
+        return;
+    auto on_resolved = [weak = std::weak_ptr(association), key, port](std::error_code ec,
+                                                                      ResolverCache::Addresses addresses) {
+        auto association = weak.lock();
+        if (!association)
+            return;
+        if (ec || !addresses || addresses->empty())
+            association->pending.fail(key);
+        else
+            association->resolved(key, {addresses->front(), port});
+    };
+    resolver.async_resolve(host, asio::bind_executor(association->socket.get_executor(), std::move(on_resolved)));
+}
+
+// Closes a session's association with the shard's shared UDP relay on every way out of handle_session
+struct SharedAssociation {
+    ~SharedAssociation() {
+        if (relay)
+            relay->close(id);
+    }
+
+    SharedUdpRelay* relay = nullptr;
+    uint64_t id = 0;
+};
+
+// Keeps the shard's session gauges accurate across every co_return in handle_session
+struct SessionCount {
+    explicit SessionCount(std::atomic<size_t>& active) : active_(active) {
+        active_.fetch_add(1, std::memory_order_relaxed);
+        Metrics::local().sessions_accepted.add();
+    }
+    ~SessionCount() {
+        active_.fetch_sub(1, std::memory_order_relaxed);
+        Metrics::local().sessions_closed.add();
+    }
+
+    std::atomic<size_t>& active_;
+};
+
+// Times the consecutive phases of a session's handshake into the thread's histograms
+class PhaseTimer {
+  public:
+    PhaseTimer() : accepted_(std::chrono::steady_clock::now()), last_(accepted_) {}
+
+    // Records the time since the previous phase ended as `phase`
+    void end(HandshakePhase phase) {
+        auto now = std::chrono::steady_clock::now();
+        Metrics::local().phase(phase).record(now - last_);
+        last_ = now;
+    }
+
+    // Ends the reply phase and records the whole handshake
+    void finish() {
+        end(HandshakePhase::REPLY);
+        Metrics::local().phase(HandshakePhase::TOTAL).record(last_ - accepted_);
+    }
 
-Server::Server(asio::io_context& io_context, uint16_t port, const std::string& ip_address)
-    : io_context_(io_context), acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::make_address(ip_address), port)),
-      listen_ip_(ip_address) {}
+  private:
+    std::chrono::steady_clock::time_point accepted_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+} // namespace
+
+// Chunks read but not yet written in one direction of a pipelined relay. Reader and writer run on the session's
+// executor, so plain fields suffice; each side waits on `wake` (never expiring) and the other cancels it to notify.
+struct Server::RelayPipeline {
+    // Reading stops while this much is queued, so a slow receiver holds back the sender instead of growing the queue
+    static constexpr size_t HIGH_WATERMARK = 512 * 1024;
+    // Most chunks one gathered write takes
+    static constexpr size_t MAX_GATHER = 16;
+
+    struct Chunk {
+        PooledBuffer buffer;
+        size_t size;
+    };
+
+    explicit RelayPipeline(const asio::any_io_executor& executor)
+        : wake(executor, asio::steady_timer::time_point::max()) {}
+
+    void notify() { wake.cancel(); }
+
+    std::deque<Chunk> chunks;
+    size_t queued = 0;         // Bytes in chunks
+    bool reading_done = false; // EOF or error on the read side; the writer drains what is left and stops
+    bool failed = false;       // The write side failed; the reader stops
+    asio::steady_timer wake;
+};
+
+Server::Server(asio::io_context& io_context, uint16_t port, const std::string& ip_address, ServerOptions options)
+    : listen_ip_(ip_address), options_(options),
+      resolver_(options_.resolver ? options_.resolver : std::make_shared<ResolverCache>()) {
+    options_.shards = 1;
+    shards_.push_back(std::make_shared<Shard>(io_context));
+    open_acceptors(port);
+    open_udp_relays();
+    open_metrics();
+}
+
+Server::Server(uint16_t port, const std::string& ip_address, ServerOptions options)
+    : listen_ip_(ip_address), options_(options),
+      resolver_(options_.resolver ? options_.resolver : std::make_shared<ResolverCache>()) {
+    if (options_.shards == 0)
+        options_.shards = 1;
+    for (size_t i = 0; i < options_.shards; ++i) {
+        owned_contexts_.push_back(std::make_unique<asio::io_context>(1));
+        shards_.push_back(std::make_shared<Shard>(*owned_contexts_.back()));
+    }
+    open_acceptors(port);
+    open_udp_relays();
+    open_metrics();
+}
+
+Server::~Server() {
+    stop();
+}
+
+void Server::open_acceptors(uint16_t port) {
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(listen_ip_), port);
+
+#if defined(SO_REUSEPORT)
+    // Every shard binds the same port and the kernel spreads incoming connections across them
+    size_t listeners = shards_.size();
+#else
+    // Without SO_REUSEPORT the first shard accepts on behalf of all of them
+    size_t listeners = 1;
+#endif
+
+    for (size_t i = 0; i < listeners; ++i) {
+        auto& acceptor = shards_[i]->acceptor;
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(asio::socket_base::reuse_address(true));
+#if defined(SO_REUSEPORT)
+        if (shards_.size() > 1)
+            acceptor.set_option(reuse_port(true));
+#endif
+        acceptor.bind(endpoint);
+        if (options_.fast_open_listen) {
+            if (auto ec = enable_fast_open_listener(acceptor, FAST_OPEN_QUEUE))
+                std::println(stderr, "TCP Fast Open unavailable on listener: {}", ec.message());
+        }
+        acceptor.listen();
+
+        // Port 0 picks an ephemeral port; the remaining shards must share it
+        endpoint.port(acceptor.local_endpoint().port());
+    }
+}
+
+void Server::open_udp_relays() {
+    if (options_.udp_relay != UdpRelayMode::SHARED)
+        return;
+    auto address = asio::ip::make_address(listen_ip_);
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        auto relay_options = options_.shared_udp;
+        if (relay_options.first_port != 0)
+            relay_options.first_port = static_cast<uint16_t>(relay_options.first_port + i * relay_options.ports);
+        shards_[i]->udp_relay = std::make_shared<SharedUdpRelay>(shards_[i]->io_context.get_executor(), address,
+                                                                 resolver_, relay_options, options_.udp_offload);
+    }
+}
+
+void Server::open_metrics() {
+    if (!options_.metrics_port)
+        return;
+    asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), *options_.metrics_port);
+    auto& acceptor = shards_.front()->metrics;
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(asio::socket_base::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+}
 
 void Server::start() {
-    asio::co_spawn(io_context_, listen(), asio::detached);
+    if (shards_.front()->metrics.is_open())
+        asio::co_spawn(shards_.front()->io_context, serve_metrics(shards_.front()), asio::detached);
+    for (auto& shard : shards_) {
+        if (shard->acceptor.is_open())
+            asio::co_spawn(shard->io_context, listen(shard), asio::detached);
+        if (shard->udp_relay)
+            shard->udp_relay->start();
+    }
+
+    for (auto& context : owned_contexts_) {
+        threads_.emplace_back([&context] {
+            auto work_guard = asio::make_work_guard(*context);
+            context->run();
+        });
+    }
+}
+
+void Server::stop() {
+    for (auto& context : owned_contexts_)
+        context->stop();
+    for (auto& thread : threads_) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threads_.clear();
+}
+
+uint16_t Server::port() const {
+    return shards_.front()->acceptor.local_endpoint().port();
+}
+
+std::vector<ShardStats> Server::shard_stats() const {
+    std::vector<ShardStats> stats;
+    stats.reserve(shards_.size());
+    for (auto& shard : shards_) {
+        stats.push_back({shard->active_sessions.load(std::memory_order_relaxed),
+                         shard->total_sessions.load(std::memory_order_relaxed)});
+    }
+    return stats;
+}
+
+MetricsSnapshot Server::metrics() const {
+    auto snapshot = Metrics::collect();
+    auto resolver = resolver_->stats();
+    snapshot.resolver_hits = resolver.hits;
+    snapshot.resolver_negative_hits = resolver.negative_hits;
+    snapshot.resolver_misses = resolver.misses;
+    snapshot.resolver_coalesced = resolver.coalesced;
+    return snapshot;
+}
+
+std::array<LatencySummary, HANDSHAKE_PHASES> Server::handshake_latency() const {
+    auto snapshot = Metrics::collect();
+    std::array<LatencySummary, HANDSHAKE_PHASES> latency;
+    for (size_t p = 0; p < HANDSHAKE_PHASES; ++p)
+        latency[p] = LatencySummary::of(snapshot.handshake[p]);
+    return latency;
 }
 
-asio::awaitable<void> Server::listen() {
+uint16_t Server::metrics_port() const {
+    auto& acceptor = shards_.front()->metrics;
+    return acceptor.is_open() ? acceptor.local_endpoint().port() : 0;
+}
+
+asio::awaitable<void> Server::serve_metrics(std::shared_ptr<Shard> shard) {
+    while (true) {
+        auto [ec, socket] = co_await shard->metrics.async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted || ec == asio::error::bad_descriptor)
+            co_return;
+        if (ec)
+            continue;
+        asio::co_spawn(shard->io_context, serve_scrape(shard, std::move(socket)), asio::detached);
+    }
+}
+
+asio::awaitable<void> Server::serve_scrape(std::shared_ptr<Shard> shard, asio::ip::tcp::socket socket) {
+    // A scraper that never finishes its request is cut off like a stalled handshake
+    Deadline deadline;
+    deadline.arm(
+        shard->wheel, HANDSHAKE_TIMEOUT,
+        [](void* context) {
+            asio::error_code ec;
+            static_cast<asio::ip::tcp::socket*>(context)->close(ec);
+        },
+        &socket);
+
+    // Only the request head matters; a body, if any, is ignored
+    std::array<char, 1024> request;
+    size_t size = 0;
+    while (size < request.size()) {
+        auto space = asio::buffer(request.data() + size, request.size() - size);
+        auto read = as_expected(co_await socket.async_read_some(space, asio::as_tuple(asio::use_awaitable)));
+        if (!read)
+            co_return;
+        size += *read;
+        if (std::string_view(request.data(), size).find("\r\n\r\n") != std::string_view::npos)
+            break;
+    }
+
+    std::string_view head(request.data(), size);
+    bool found = head.starts_with("GET /metrics ") || head.starts_with("GET / ");
+    std::string body = found ? render_prometheus(metrics()) : "Not Found\n";
+    std::string response =
+        std::format("HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+                    found ? "200 OK" : "404 Not Found", found ? "text/plain; version=0.0.4" : "text/plain",
+                    body.size());
+    response += body;
+    co_await asio::async_write(socket, asio::buffer(response), asio::as_tuple(asio::use_awaitable));
+
+    asio::error_code ec;
+    socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+}
+
+asio::awaitable<void> Server::listen(std::shared_ptr<Shard> shard) {
+    // Without SO_REUSEPORT only the first shard listens and hands sockets to the others round-robin
+    bool distribute = shards_.size() > 1 && !shards_[1]->acceptor.is_open();
+    size_t next = 0;
     try {
         while (true) {
-            auto [ec, socket] = co_await acceptor_.async_accept(asio::as_tuple(asio::use_awaitable));
+            auto& target = distribute ? shards_[next++ % shards_.size()] : shard;
+            auto [ec, socket] =
+                co_await shard->acceptor.async_accept(target->io_context, asio::as_tuple(asio::use_awaitable));
             if (ec) {
                 std::println(stderr, "Accept failed: {}", ec.message());
                 continue;
             }
-            asio::co_spawn(io_context_, handle_session(std::move(socket)), asio::detached);
+            asio::co_spawn(target->io_context, handle_session(target, std::move(socket)), asio::detached);
         }
     } catch (std::exception& e) {
         std::println(stderr, "Listen loop error: {}", e.what());
     }
 }
 
-asio::awaitable<void> Server::handle_session(asio::ip::tcp::socket client_socket) {
-    // 1. Handshake
-    uint8_t version;
-    auto read_ver = co_await with_timeout_nothrow<size_t>(
-        asio::async_read(client_socket, asio::buffer(&version, 1), asio::as_tuple(asio::use_awaitable)),
-        HANDSHAKE_TIMEOUT);
-    if (!read_ver)
-        co_return;
-
-    if (version != VERSION)
-        co_return;
-
-    uint8_t nmethods;
-    auto read_nm = co_await with_timeout_nothrow<size_t>(
-        asio::async_read(client_socket, asio::buffer(&nmethods, 1), asio::as_tuple(asio::use_awaitable)),
-        HANDSHAKE_TIMEOUT);
-    if (!read_nm)
-        co_return;
-
-    std::vector<uint8_t> methods(nmethods);
-    auto read_methods = co_await with_timeout_nothrow<size_t>(
-        asio::async_read(client_socket, asio::buffer(methods), asio::as_tuple(asio::use_awaitable)), HANDSHAKE_TIMEOUT);
-    if (!read_methods)
-        co_return;
-
-    bool no_auth_supported = false;
-    for (auto m : methods) {
-        if (static_cast<AuthMethod>(m) == AuthMethod::NO_AUTH) {
-            no_auth_supported = true;
+asio::awaitable<void> Server::handle_session(std::shared_ptr<Shard> shard, asio::ip::tcp::socket client_socket) {
+    SessionCount session_count(shard->active_sessions);
+    shard->total_sessions.fetch_add(1, std::memory_order_relaxed);
+    PhaseTimer phases;
+
+    // One deadline bounds the whole handshake and later the relay's idle time
+    SessionSockets sockets{&client_socket};
+    Deadline deadline;
+    deadline.arm(shard->wheel, HANDSHAKE_TIMEOUT, &SessionSockets::close, &sockets);
+
+    // 1. Handshake. Parse out of whatever each read returns, so a greeting and request sent back to back cost one
+    // read, and bytes the client sends ahead of our reply are kept for the target.
+    // From the buffer pool and returned before the relay starts, so a long-lived tunnel does not carry it in its frame
+    PooledBuffer in_buffer;
+    auto* in = place_pooled<HandshakeBuffer>(in_buffer);
+    GreetingView greeting;
+    while (true) {
+        auto decoded = decode_greeting(in->pending());
+        if (!decoded)
+            co_return;
+        if (decoded->size > 0) {
+            greeting = *decoded;
+            in->consume(greeting.size);
+            phases.end(HandshakePhase::GREETING);
             break;
         }
+        auto read = as_expected(
+            co_await client_socket.async_read_some(in->free_space(), asio::as_tuple(asio::use_awaitable)));
+        if (!read)
+            co_return;
+        in->commit(*read);
     }
 
-    if (!no_auth_supported) {
-        uint8_t resp[] = {VERSION, static_cast<uint8_t>(AuthMethod::NO_ACCEPTABLE)};
+    if (!greeting.offers(AuthMethod::NO_AUTH)) {
+        constexpr auto resp = method_selection(AuthMethod::NO_ACCEPTABLE);
         co_await asio::async_write(client_socket, asio::buffer(resp), asio::as_tuple(asio::use_awaitable));
         co_return;
     }
 
-    uint8_t resp[] = {VERSION, static_cast<uint8_t>(AuthMethod::NO_AUTH)};
-    auto write_auth = co_await with_timeout_nothrow<size_t>(
-        asio::async_write(client_socket, asio::buffer(resp), asio::as_tuple(asio::use_awaitable)), HANDSHAKE_TIMEOUT);
+    constexpr auto resp = method_selection(AuthMethod::NO_AUTH);
+    auto write_auth = as_expected(
+        co_await asio::async_write(client_socket, asio::buffer(resp), asio::as_tuple(asio::use_awaitable)));
     if (!write_auth)
         co_return;
 
-    // 2. Request
-    uint8_t req_header[4];
-    auto read_req = co_await with_timeout_nothrow<size_t>(
-        asio::async_read(client_socket, asio::buffer(req_header), asio::as_tuple(asio::use_awaitable)),
-        HANDSHAKE_TIMEOUT);
-    if (!read_req)
-        co_return;
-
-    if (req_header[0] != VERSION)
-        co_return;
-    Command cmd = static_cast<Command>(req_header[1]);
-    AddressType atyp = static_cast<AddressType>(req_header[3]);
-
-    // Consume address fields even if we don't use them for UDP_ASSOCIATE right away
+    // 2. Request. Often already buffered behind the greeting.
     // RFC: UDP ASSOCIATE DST.ADDR/PORT are the address the client expects to send FROM.
-    // We generally allow any, or strict check. For now, just read and ignore (allow any).
-
-    std::string target_host;
-    std::string target_port_str;
-
-    if (atyp == AddressType::IPV4) {
-        asio::ip::address_v4::bytes_type bytes;
-        auto read_ip = co_await with_timeout_nothrow<size_t>(
-            asio::async_read(client_socket, asio::buffer(bytes), asio::as_tuple(asio::use_awaitable)),
-            HANDSHAKE_TIMEOUT);
-        if (!read_ip)
-            co_return;
-        target_host = asio::ip::make_address_v4(bytes).to_string();
-    } else if (atyp == AddressType::DOMAIN_NAME) {
-        uint8_t len;
-        auto read_len = co_await with_timeout_nothrow<size_t>(
-            asio::async_read(client_socket, asio::buffer(&len, 1), asio::as_tuple(asio::use_awaitable)),
-            HANDSHAKE_TIMEOUT);
-        if (!read_len)
+    // We generally allow any, or strict check. For now, just parse and ignore (allow any).
+    // The request points into `in`, which is kept until the reply is written
+    RequestView request;
+    while (true) {
+        auto decoded = decode_request(in->pending());
+        if (!decoded) {
+            if (decoded.error() == Error::UNSUPPORTED_ADDRESS_TYPE) {
+                auto err_resp = failure_reply(Reply::ADDRESS_TYPE_NOT_SUPPORTED);
+                Metrics::local().failed(err_resp[1]).add();
+                co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
+            }
             co_return;
-        target_host.resize(len);
-        auto read_domain = co_await with_timeout_nothrow<size_t>(
-            asio::async_read(client_socket, asio::buffer(target_host), asio::as_tuple(asio::use_awaitable)),
-            HANDSHAKE_TIMEOUT);
-        if (!read_domain)
+        }
+        if (decoded->size > 0) {
+            request = *decoded;
+            in->consume(request.size);
+            phases.end(HandshakePhase::REQUEST);
+            break;
+        }
+        if (in->full())
             co_return;
-    } else if (atyp == AddressType::IPV6) {
-        asio::ip::address_v6::bytes_type bytes;
-        auto read_ip6 = co_await with_timeout_nothrow<size_t>(
-            asio::async_read(client_socket, asio::buffer(bytes), asio::as_tuple(asio::use_awaitable)),
-            HANDSHAKE_TIMEOUT);
-        if (!read_ip6)
+        auto read = as_expected(
+            co_await client_socket.async_read_some(in->free_space(), asio::as_tuple(asio::use_awaitable)));
+        if (!read)
             co_return;
-        target_host = asio::ip::make_address_v6(bytes).to_string();
-    } else {
-        uint8_t err_resp[] = {
-            VERSION, static_cast<uint8_t>(Reply::ADDRESS_TYPE_NOT_SUPPORTED), RSV, 0x01, 0, 0, 0, 0, 0, 0};
-        co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
-        co_return;
+        in->commit(*read);
     }
 
-    uint8_t port_bytes[2];
-    auto read_port = co_await with_timeout_nothrow<size_t>(
-        asio::async_read(client_socket, asio::buffer(port_bytes, 2), asio::as_tuple(asio::use_awaitable)),
-        HANDSHAKE_TIMEOUT);
-    if (!read_port)
-        co_return;
-    uint16_t port = static_cast<uint16_t>((port_bytes[0] << 8) | port_bytes[1]);
-    target_port_str = std::to_string(port);
+    Command cmd = request.command;
 
     // Handle Commands
     if (cmd == Command::UDP_ASSOCIATE) {
+        asio::error_code ec;
+        auto client_peer_ep = client_socket.remote_endpoint(ec);
+        if (ec)
+            co_return;
+
         // Create UDP socket on ANY port, same IP family as control connection preferably, or just v4/v6 dual stack if
         // possible. For simplicity, we bind to the same IP version as the acceptor or just V4. Let's use the local
         // address of the client connection to determine family.
@@ -157,312 +533,454 @@ asio::awaitable<void> Server::handle_session(asio::ip::tcp::socket client_socket
         asio::ip::udp::endpoint udp_bind_ep(local_ep_tcp.address(), 0);
 
         asio::ip::udp::socket udp_socket(client_socket.get_executor());
-        asio::error_code ec;
-        udp_socket.open(udp_bind_ep.protocol(), ec);
-        if (!ec)
-            udp_socket.bind(udp_bind_ep, ec);
-
-        if (ec) {
-            uint8_t err_resp[] = {VERSION, static_cast<uint8_t>(Reply::GENERIC_FAILURE), RSV, 0x01, 0, 0, 0, 0, 0, 0};
-            co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
-            co_return;
-        }
+        asio::ip::udp::endpoint udp_local_ep;
+        SharedAssociation shared;
+        if (shard->udp_relay) {
+            // Register before replying, so the client's first datagram finds its association. DST.ADDR/PORT name
+            // where the client will send from, if it knows.
+            auto named = request.address.ip();
+            bool names_client = request.address.type() != AddressType::DOMAIN_NAME &&
+                                (named.is_unspecified() || named == client_peer_ep.address());
+            shared.id = shard->udp_relay->open(client_peer_ep.address(), names_client ? request.address.port() : 0);
+            shared.relay = shard->udp_relay.get();
+            udp_local_ep = {local_ep_tcp.address(), shard->udp_relay->port()};
+        } else {
+            udp_socket.open(udp_bind_ep.protocol(), ec);
+            if (!ec)
+                udp_socket.bind(udp_bind_ep, ec);
 
-        auto udp_local_ep = udp_socket.local_endpoint(ec);
+            if (ec) {
+                auto err_resp = failure_reply(Reply::GENERIC_FAILURE);
+                Metrics::local().failed(err_resp[1]).add();
+                co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
+                co_return;
+            }
 
-        // Reply with BND.ADDR/PORT
-        std::vector<uint8_t> success_resp;
-        success_resp.push_back(VERSION);
-        success_resp.push_back(static_cast<uint8_t>(Reply::SUCCEEDED));
-        success_resp.push_back(RSV);
-
-        if (udp_local_ep.address().is_v4()) {
-            success_resp.push_back(static_cast<uint8_t>(AddressType::IPV4));
-            auto bytes = udp_local_ep.address().to_v4().to_bytes();
-            success_resp.insert(success_resp.end(), bytes.begin(), bytes.end());
-        } else {
-            success_resp.push_back(static_cast<uint8_t>(AddressType::IPV6));
-            auto bytes = udp_local_ep.address().to_v6().to_bytes();
-            success_resp.insert(success_resp.end(), bytes.begin(), bytes.end());
+            udp_local_ep = udp_socket.local_endpoint(ec);
         }
 
-        uint16_t bound_port = udp_local_ep.port();
-        success_resp.push_back(static_cast<uint8_t>((bound_port >> 8) & 0xFF));
-        success_resp.push_back(static_cast<uint8_t>(bound_port & 0xFF));
-
-        auto write_success = co_await with_timeout_nothrow<size_t>(
-            asio::async_write(client_socket, asio::buffer(success_resp), asio::as_tuple(asio::use_awaitable)),
-            HANDSHAKE_TIMEOUT);
+        // Reply with BND.ADDR/PORT
+        size_t reply_size = encode_success_reply(udp_local_ep.address(), udp_local_ep.port(), in->reply);
+        auto write_success = as_expected(co_await asio::async_write(
+            client_socket, asio::buffer(in->reply.data(), reply_size), asio::as_tuple(asio::use_awaitable)));
         if (!write_success)
             co_return;
 
-        // Start UDP Relay
-        auto client_peer_ep = client_socket.remote_endpoint(ec);
-        if (ec)
+        // The association lives as long as the control connection, however quiet
+        deadline.cancel();
+        if (shared.relay) {
+            // The shard's relay moves the datagrams; this session only holds the association open
+            char dummy;
+            while (true) {
+                auto [read_ec, n] = co_await client_socket.async_read_some(asio::buffer(&dummy, 1),
+                                                                           asio::as_tuple(asio::use_awaitable));
+                if (read_ec)
+                    break;
+            }
             co_return;
+        }
 
+        // Start UDP Relay
         co_await relay_udp(client_socket, std::move(udp_socket), client_peer_ep.address());
         co_return;
     } else if (cmd != Command::CONNECT) {
-        uint8_t err_resp[] = {VERSION, static_cast<uint8_t>(Reply::COMMAND_NOT_SUPPORTED), RSV, 0x01, 0, 0, 0, 0, 0, 0};
+        auto err_resp = failure_reply(Reply::COMMAND_NOT_SUPPORTED);
+        Metrics::local().failed(err_resp[1]).add();
         co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
         co_return;
     }
 
-    // 3. Connect to Target
-    asio::ip::tcp::resolver resolver(client_socket.get_executor());
-    asio::ip::tcp::socket target_socket(client_socket.get_executor());
-
-    auto endpoints_result = co_await with_timeout_nothrow<asio::ip::tcp::resolver::results_type>(
-        resolver.async_resolve(target_host, target_port_str, asio::as_tuple(asio::use_awaitable)), HANDSHAKE_TIMEOUT);
-
-    if (!endpoints_result) {
-        uint8_t err_resp[] = {VERSION, static_cast<uint8_t>(Reply::HOST_UNREACHABLE), RSV, 0x01, 0, 0, 0, 0, 0, 0};
-        co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
-        co_return;
+    // 3. Connect to Target. IP literals need no lookup; names go through the shared cache and race their addresses.
+    auto host = request.address.domain();
+    if (request.address.type() == AddressType::DOMAIN_NAME) {
+        auto resolved = co_await resolve(host);
+        if (!resolved || (*resolved)->empty()) {
+            auto err_resp = failure_reply(Reply::HOST_UNREACHABLE);
+            Metrics::local().failed(err_resp[1]).add();
+            co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
+            co_return;
+        }
+        for (const auto& address : **resolved) {
+            if (in->endpoint_count == in->endpoints.size())
+                break;
+            in->endpoints[in->endpoint_count++] = asio::ip::tcp::endpoint(address, request.address.port());
+        }
+        phases.end(HandshakePhase::RESOLVE);
+    } else {
+        in->endpoints[in->endpoint_count++] = asio::ip::tcp::endpoint(request.address.ip(), request.address.port());
     }
 
-    auto connect_result = co_await with_timeout_nothrow<asio::ip::tcp::endpoint>(
-        asio::async_connect(target_socket, *endpoints_result, asio::as_tuple(asio::use_awaitable)), HANDSHAKE_TIMEOUT);
+    // A literal is its one address with no family to choose: its empty `host` keeps it out of the history
+    auto connect_result =
+        co_await happy_eyeballs_connect(std::span(in->endpoints.data(), in->endpoint_count), options_.happy_eyeballs,
+                                        &connect_history_, host);
 
     if (!connect_result) {
-        uint8_t err_resp[] = {VERSION, static_cast<uint8_t>(Reply::CONNECTION_REFUSED), RSV, 0x01, 0, 0, 0, 0, 0, 0};
+        auto err_resp = failure_reply(Reply::CONNECTION_REFUSED);
+        Metrics::local().failed(err_resp[1]).add();
         co_await asio::async_write(client_socket, asio::buffer(err_resp), asio::as_tuple(asio::use_awaitable));
         co_return;
     }
 
+    asio::ip::tcp::socket target_socket = std::move(*connect_result);
+    sockets.target = &target_socket;
+    phases.end(HandshakePhase::CONNECT);
+
     // 4. Send Success Reply
     asio::error_code ec;
     auto local_ep = target_socket.local_endpoint(ec);
+    // Fallback to 0.0.0.0:0 if the local endpoint is unknown
+    if (ec)
+        local_ep = {};
+    size_t reply_size = encode_success_reply(local_ep.address(), local_ep.port(), in->reply);
 
-    std::vector<uint8_t> success_resp;
-    success_resp.push_back(VERSION);
-    success_resp.push_back(static_cast<uint8_t>(Reply::SUCCEEDED));
-    success_resp.push_back(RSV);
-
-    if (!ec && local_ep.address().is_v4()) {
-        success_resp.push_back(static_cast<uint8_t>(AddressType::IPV4));
-        auto bytes = local_ep.address().to_v4().to_bytes();
-        success_resp.insert(success_resp.end(), bytes.begin(), bytes.end());
-    } else if (!ec && local_ep.address().is_v6()) {
-        success_resp.push_back(static_cast<uint8_t>(AddressType::IPV6));
-        auto bytes = local_ep.address().to_v6().to_bytes();
-        success_resp.insert(success_resp.end(), bytes.begin(), bytes.end());
-    } else {
-        // Fallback to 0.0.0.0 if error or unknown
-        success_resp.push_back(static_cast<uint8_t>(AddressType::IPV4));
-        success_resp.push_back(0);
-        success_resp.push_back(0);
-        success_resp.push_back(0);
-        success_resp.push_back(0);
-    }
-
-    uint16_t bound_port = (!ec) ? local_ep.port() : 0;
-    success_resp.push_back(static_cast<uint8_t>((bound_port >> 8) & 0xFF));
-    success_resp.push_back(static_cast<uint8_t>(bound_port & 0xFF));
-
-    auto write_success = co_await with_timeout_nothrow<size_t>(
-        asio::async_write(client_socket, asio::buffer(success_resp), asio::as_tuple(asio::use_awaitable)),
-        HANDSHAKE_TIMEOUT);
+    auto write_success = as_expected(co_await asio::async_write(
+        client_socket, asio::buffer(in->reply.data(), reply_size), asio::as_tuple(asio::use_awaitable)));
     if (!write_success)
         co_return;
+    phases.finish();
+
+    // Data the client pipelined behind its request goes out first
+    if (!in->pending().empty()) {
+        auto early = in->pending();
+        auto write_early = as_expected(co_await asio::async_write(
+            target_socket, asio::buffer(early.data(), early.size()), asio::as_tuple(asio::use_awaitable)));
+        if (!write_early)
+            co_return;
+    }
+    in_buffer.reset();
+
+    // 5. Relay, one coroutine per direction; when either ends, both sockets are closed and the other ends too. Traffic
+    // in either direction keeps the session alive.
+    sockets.phase = TimeoutPhase::IDLE;
+    deadline.arm(shard->wheel, IDLE_TIMEOUT, &SessionSockets::close, &sockets);
+    auto& metrics = Metrics::local();
+    co_await (relay(client_socket, target_socket, deadline, metrics.bytes(Direction::UPSTREAM)) &&
+              relay(target_socket, client_socket, deadline, metrics.bytes(Direction::DOWNSTREAM)));
+}
 
-    // 5. Relay (Zig-style error propagation)
-    co_await (relay(client_socket, target_socket) && relay(target_socket, client_socket));
+asio::awaitable<std::expected<ResolverCache::Addresses, std::error_code>> Server::resolve(std::string_view host) {
+    if (auto cached = resolver_->try_get(host))
+        co_return *cached;
+    co_return co_await with_timeout_nothrow<ResolverCache::Addresses>(
+        resolver_->async_resolve(host, asio::as_tuple(asio::use_awaitable)), HANDSHAKE_TIMEOUT);
 }
 
-asio::awaitable<void> Server::relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to) {
-    std::array<uint8_t, 8192> buffer;
+asio::awaitable<void> Server::relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to, Deadline& deadline,
+                                    Counter& relayed) {
+    if (options_.relay_engine == RelayEngine::SPLICE) {
+        auto ec = co_await splice_relay(from, to, deadline, &relayed);
+        if (ec != std::errc::not_supported) {
+            asio::error_code close_ec;
+            from.close(close_ec);
+            to.close(close_ec);
+            co_return;
+        }
+    }
+    if (options_.relay_engine == RelayEngine::PIPELINED) {
+        co_await relay_pipelined(from, to, deadline, relayed);
+        co_return;
+    }
+
+    // Pooled and sized to the flow, so the frame itself stays small. Held only while data is moving: reads are
+    // non-blocking, and when the socket runs dry the buffer goes back to the pool before waiting for readability, so
+    // an idle tunnel holds no buffer at all. A busy flow keeps its buffer and never waits.
+    AdaptiveBuffer buffer;
+    if constexpr (!READ_THROUGH_RING) {
+        asio::error_code mode_ec;
+        from.non_blocking(true, mode_ec);
+    }
+    auto read_started = std::chrono::steady_clock::now();
     while (true) {
         // Read
-        auto read_res = co_await with_timeout_nothrow<size_t>(
-            from.async_read_some(asio::buffer(buffer), asio::as_tuple(asio::use_awaitable)), IDLE_TIMEOUT);
-
-        if (!read_res) {
-            // E.g. EOF or Timeout or Reset
+        if constexpr (READ_THROUGH_RING) {
+            buffer.release();
+            auto wait_res = as_expected(co_await from.async_wait(asio::socket_base::wait_read, use_recycled_awaitable));
+            if (!wait_res)
+                break;
+        }
+        auto chunk = buffer.get();
+        asio::error_code read_ec;
+        size_t n = 0;
+        if constexpr (READ_THROUGH_RING)
+            std::tie(read_ec, n) =
+                co_await from.async_read_some(asio::buffer(chunk.data(), chunk.size()), use_recycled_awaitable);
+        else
+            n = from.read_some(asio::buffer(chunk.data(), chunk.size()), read_ec);
+        if (read_ec == asio::error::would_block) {
+            buffer.release();
+            auto wait_res = as_expected(co_await from.async_wait(asio::socket_base::wait_read, use_recycled_awaitable));
+            if (!wait_res)
+                break; // E.g. the session deadline closing the socket
+            continue;
+        }
+        if (read_ec) {
+            // E.g. EOF, Reset or the session deadline closing the socket
             break;
         }
-        size_t n = *read_res;
+        auto read_done = std::chrono::steady_clock::now();
+        deadline.touch();
 
         // Write
-        auto write_res = co_await with_timeout_nothrow<size_t>(
-            asio::async_write(to, asio::buffer(buffer, n), asio::as_tuple(asio::use_awaitable)), IDLE_TIMEOUT);
+        auto write_res =
+            as_expected(co_await asio::async_write(to, asio::buffer(chunk.data(), n), use_recycled_awaitable));
 
         if (!write_res) {
             break;
         }
+        deadline.touch();
+        relayed.add(n);
+
+        buffer.record_read(n, read_done - read_started);
+        read_started = std::chrono::steady_clock::now();
     }
 
-    // Cleanup: Close both ends
+    // Cleanup: Close both ends, which also ends the other direction's read_some/async_wait loop
+    asio::error_code ec;
+    from.close(ec);
+    to.close(ec);
+}
+
+asio::awaitable<void> Server::relay_pipelined(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to,
+                                             Deadline& deadline, Counter& relayed) {
+    RelayPipeline pipeline(from.get_executor());
+    co_await (pipeline_read(from, pipeline, deadline) && pipeline_write(from, to, pipeline, deadline, relayed));
+
     asio::error_code ec;
     from.close(ec);
     to.close(ec);
-    co_return; // Important: explicit return for void awaitable if not falling off end
+}
+
+asio::awaitable<void> Server::pipeline_read(asio::ip::tcp::socket& from, RelayPipeline& pipeline, Deadline& deadline) {
+    // As in the copy relay, a buffer is only taken once data is readable
+    AdaptiveBuffer buffer;
+    if constexpr (!READ_THROUGH_RING) {
+        asio::error_code mode_ec;
+        from.non_blocking(true, mode_ec);
+    }
+    auto read_started = std::chrono::steady_clock::now();
+    while (!pipeline.failed) {
+        if (pipeline.queued >= RelayPipeline::HIGH_WATERMARK) {
+            co_await pipeline.wake.async_wait(use_recycled_awaitable);
+            continue;
+        }
+
+        if constexpr (READ_THROUGH_RING) {
+            auto wait_res = as_expected(co_await from.async_wait(asio::socket_base::wait_read, use_recycled_awaitable));
+            if (!wait_res)
+                break;
+        }
+        auto chunk = buffer.get();
+        asio::error_code read_ec;
+        size_t n = 0;
+        if constexpr (READ_THROUGH_RING)
+            std::tie(read_ec, n) =
+                co_await from.async_read_some(asio::buffer(chunk.data(), chunk.size()), use_recycled_awaitable);
+        else
+            n = from.read_some(asio::buffer(chunk.data(), chunk.size()), read_ec);
+        if (read_ec == asio::error::would_block) {
+            buffer.release();
+            auto wait_res = as_expected(co_await from.async_wait(asio::socket_base::wait_read, use_recycled_awaitable));
+            if (!wait_res)
+                break;
+            continue;
+        }
+        if (read_ec)
+            break; // E.g. EOF, Reset or the session deadline closing the socket
+        deadline.touch();
+
+        auto now = std::chrono::steady_clock::now();
+        buffer.record_read(n, now - read_started);
+        read_started = now;
+
+        pipeline.chunks.push_back({buffer.take(), n});
+        pipeline.queued += n;
+        pipeline.notify();
+    }
+    pipeline.reading_done = true;
+    pipeline.notify();
+}
+
+asio::awaitable<void> Server::pipeline_write(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to,
+                                             RelayPipeline& pipeline, Deadline& deadline, Counter& relayed) {
+    std::array<asio::const_buffer, RelayPipeline::MAX_GATHER> gather;
+    while (true) {
+        if (pipeline.chunks.empty()) {
+            if (pipeline.reading_done)
+                break;
+            co_await pipeline.wake.async_wait(use_recycled_awaitable);
+            continue;
+        }
+
+        // Everything the reader queued while the previous write was in flight leaves in one writev
+        size_t count = std::min(pipeline.chunks.size(), RelayPipeline::MAX_GATHER);
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            gather[i] = asio::buffer(pipeline.chunks[i].buffer.data(), pipeline.chunks[i].size);
+            bytes += pipeline.chunks[i].size;
+        }
+        auto write_res = as_expected(
+            co_await asio::async_write(to, std::span(gather.data(), count), use_recycled_awaitable));
+        if (!write_res) {
+            // Stop the reader wherever it waits
+            pipeline.failed = true;
+            asio::error_code ec;
+            from.cancel(ec);
+            pipeline.notify();
+            break;
+        }
+        deadline.touch();
+        relayed.add(bytes);
+
+        for (size_t i = 0; i < count; ++i)
+            pipeline.chunks.pop_front();
+        pipeline.queued -= bytes;
+        pipeline.notify();
+    }
 }
 
 asio::awaitable<void> Server::relay_udp(asio::ip::tcp::socket& control_socket, asio::ip::udp::socket udp_socket,
                                         asio::ip::address client_ip) {
-    std::array<uint8_t, 65536> buffer;
-    asio::ip::udp::endpoint sender_ep;
+    // Datagrams move in batches: one readiness wait, one recvmmsg for everything queued, one sendmmsg per flush.
+    // With offload, runs of same-flow datagrams also cross the kernel boundary as GRO/GSO super-packets.
+    UdpBatch batch(udp_socket, options_.udp_offload);
     asio::ip::udp::endpoint last_client_ep;
     uint16_t client_port = 0; // Learned from first packet
 
-    // Resolution Cache
-    std::string cached_host;
-    std::string cached_port_str;
-    asio::ip::udp::endpoint cached_target_ep;
-    bool has_cached_target = false;
-
-    // Reuse resolver
-    asio::ip::udp::resolver resolver(control_socket.get_executor());
+    // Where this association's datagrams go, the headers for what comes back, and datagrams waiting on DNS
+    auto association = std::make_shared<UdpAssociation>(udp_socket);
+    UdpNatTable& nat = association->nat;
+    auto& metrics = Metrics::local();
+    asio::error_code mode_ec;
+    udp_socket.non_blocking(true, mode_ec);
 
     try {
         while (true) {
             char dummy;
             auto race_result = co_await (
-                udp_socket.async_receive_from(asio::buffer(buffer), sender_ep, asio::as_tuple(asio::use_awaitable)) ||
+                udp_socket.async_wait(asio::socket_base::wait_read, use_recycled_awaitable) ||
                 control_socket.async_read_some(asio::buffer(&dummy, 1), asio::as_tuple(asio::use_awaitable)));
 
             if (race_result.index() == 1)
                 break; // TCP closed
-
-            auto& [ec, n] = std::get<0>(race_result);
-            if (ec || n == 0)
-                continue;
-
-            bool is_from_client = false;
-
-            if (sender_ep.address() == client_ip) {
-                if (client_port == 0) {
-                    client_port = sender_ep.port();
-                    is_from_client = true;
-                } else if (sender_ep.port() == client_port) {
-                    is_from_client = true;
-                } else {
-                    is_from_client = false;
-                }
-            } else {
-                is_from_client = false;
-            }
-
-            if (is_from_client) {
-                // Packet from Client -> Forward to Target
-                last_client_ep = sender_ep;
-
-                if (n < 10)
-                    continue;
-                if (buffer[0] != 0x00 || buffer[1] != 0x00)
-                    continue;
-                if (buffer[2] != 0x00)
-                    continue; // Drop fragmented
-
-                size_t header_len = 0;
-                AddressType atyp = static_cast<AddressType>(buffer[3]);
-
-                // We need to parse destination to check cache
-                // Pointers to the raw data in buffer to avoid string copy if possible,
-                // but for cache comparison we might need string or carefully compare bytes.
-                // For simplicity and safety, we parse.
-
-                std::string current_host;     // Use string to own the data (prevents dangling view)
-                std::string current_port_str; // Need storage for conversion
-
-                if (atyp == AddressType::IPV4) {
-                    header_len = 10;
-                    if (n < header_len)
-                        continue;
-                    // Optimization: Check if bytes match cached bytes?
-                    // Actually, constructing IP object is fast.
-                    asio::ip::address_v4::bytes_type bytes;
-                    std::memcpy(bytes.data(), &buffer[4], 4);
-                    // Convert to string for cache key? Or store address object?
-                    // Let's stick to string for generic resolver support, but could optimize further.
-                    // Ideally we avoid to_string() if matches cache.
-                    // Let's just do full parse for now, optimize resolve.
-                    current_host = asio::ip::make_address_v4(bytes).to_string();
-                } else if (atyp == AddressType::IPV6) {
-                    header_len = 22;
-                    if (n < header_len)
+            if (std::get<0>(std::get<0>(race_result)))
+                break;
+
+            // Drain the socket; a full batch means more may be waiting
+            do {
+                auto batch_result = batch.receive(udp_socket);
+                size_t received = batch_result ? *batch_result : 0;
+                auto now = UdpNatTable::clock::now();
+
+                for (size_t i = 0; i < received; ++i) {
+                    if (batch.truncated(i)) {
+                        // Larger than a slot; forwarding a cut-off datagram would corrupt it
+                        metrics.dropped(UdpDrop::TRUNCATED).add();
                         continue;
-                    asio::ip::address_v6::bytes_type bytes;
-                    std::memcpy(bytes.data(), &buffer[4], 16);
-                    current_host = asio::ip::make_address_v6(bytes).to_string();
-                } else if (atyp == AddressType::DOMAIN_NAME) {
-                    uint8_t dlen = buffer[4];
-                    header_len = 5 + static_cast<size_t>(dlen) + 2;
-                    if (n < header_len)
+                    }
+
+                    std::span<uint8_t> buffer = batch.data(i);
+                    const asio::ip::udp::endpoint& sender_ep = batch.sender(i);
+                    size_t n = buffer.size();
+                    if (n == 0)
                         continue;
-                    current_host = std::string(reinterpret_cast<char*>(&buffer[5]), dlen);
-                } else {
-                    continue;
-                }
 
-                size_t port_idx = header_len - 2;
-                uint16_t port_nbo = static_cast<uint16_t>((buffer[port_idx] << 8) | buffer[port_idx + 1]);
-                // Optimization: integer compare is faster than string compare.
-                // But resolver needs string.
-
-                // Better: cache the uint16_t port
-                static uint16_t cached_port_int = 0;
-                if (has_cached_target && port_nbo == cached_port_int && current_host == cached_host) {
-                    // Hit
-                } else {
-                    // Miss
-                    cached_host = std::string(current_host);
-                    cached_port_int = port_nbo;
-                    cached_port_str = std::to_string(port_nbo);
-
-                    auto [rec, endpoints] = co_await resolver.async_resolve(cached_host, cached_port_str,
-                                                                            asio::as_tuple(asio::use_awaitable));
-                    if (!rec && endpoints.begin() != endpoints.end()) {
-                        cached_target_ep = *endpoints.begin();
-                        has_cached_target = true;
+                    bool is_from_client = false;
+
+                    if (sender_ep.address() == client_ip) {
+                        if (client_port == 0) {
+                            client_port = sender_ep.port();
+                            is_from_client = true;
+                        } else if (sender_ep.port() == client_port) {
+                            is_from_client = true;
+                        } else {
+                            is_from_client = false;
+                        }
                     } else {
-                        has_cached_target = false;
+                        is_from_client = false;
                     }
-                }
 
-                if (has_cached_target) {
-                    auto payload = asio::buffer(&buffer[header_len], n - header_len);
-                    co_await udp_socket.async_send_to(payload, cached_target_ep, asio::as_tuple(asio::use_awaitable));
-                }
+                    if (is_from_client) {
+                        // Packet from Client -> Forward to Target
+                        last_client_ep = sender_ep;
+
+                        auto header = decode_udp_header(buffer);
+                        if (!header) {
+                            metrics.dropped(UdpDrop::MALFORMED).add();
+                            continue;
+                        }
+                        if (header->fragment != 0x00) {
+                            metrics.dropped(UdpDrop::FRAGMENTED).add(); // Drop fragmented
+                            continue;
+                        }
+                        auto payload = buffer.subspan(header->size);
+
+                        // ATYP | DST.ADDR | DST.PORT, straight from the datagram
+                        auto destination = header->address;
+                        auto key = destination.bytes;
+                        auto* entry = nat.find(key, now);
+                        if (!entry) {
+                            uint16_t port = destination.port();
+                            if (destination.type() != AddressType::DOMAIN_NAME) {
+                                entry = &nat.insert(key, {destination.ip(), port}, now);
+                            } else {
+                                auto host = destination.domain();
+                                auto cached = resolver_->try_get(host);
+                                if (!cached) {
+                                    // Resolve off the receive loop; traffic to known destinations keeps flowing
+                                    hold_until_resolved(*resolver_, association, key, host, port, payload);
+                                    continue;
+                                }
+                                if (!*cached || (**cached)->empty()) {
+                                    metrics.dropped(UdpDrop::UNRESOLVED).add();
+                                    continue;
+                                }
+                                entry = &association->remember(key, {(**cached)->front(), port}, now);
+                            }
+                        }
+
+                        batch.queue({}, payload, entry->target);
+                        metrics.forwarded(Direction::UPSTREAM).add();
 
-            } else {
-                // Packet from Target -> Forward to Client
-                if (client_port == 0)
-                    continue;
-
-                // Encapsulate with Stack Buffer
-                // Max header: 4 (IPv4) or 16 (IPv6) + 6 overhead = 22 bytes.
-                // Let's use 24 bytes fixed array.
-                uint8_t header_buf[24];
-                size_t h_len = 0;
-
-                header_buf[0] = 0x00;
-                header_buf[1] = 0x00; // RSV
-                header_buf[2] = 0x00; // FRAG
-
-                if (sender_ep.address().is_v4()) {
-                    header_buf[3] = static_cast<uint8_t>(AddressType::IPV4);
-                    auto bytes = sender_ep.address().to_v4().to_bytes();
-                    std::memcpy(&header_buf[4], bytes.data(), 4);
-                    h_len = 10;
-                } else {
-                    header_buf[3] = static_cast<uint8_t>(AddressType::IPV6);
-                    auto bytes = sender_ep.address().to_v6().to_bytes();
-                    std::memcpy(&header_buf[4], bytes.data(), 16);
-                    h_len = 22;
+                    } else {
+                        // Packet from Target -> Forward to Client
+                        if (client_port == 0) {
+                            metrics.dropped(UdpDrop::UNSOLICITED).add();
+                            continue;
+                        }
+
+                        std::array<uint8_t, UdpNatTable::MAX_IP_KEY> key;
+                        size_t key_len = UdpNatTable::encode(sender_ep, key);
+                        if (auto* entry = nat.find({key.data(), key_len}, now)) {
+                            batch.queue(entry->reply(), buffer, last_client_ep);
+                        } else {
+                            // Not a destination the client has used; build the header on the spot
+                            uint8_t header[UdpNatTable::MAX_REPLY_HEADER];
+                            size_t header_len = encode_udp_header(sender_ep, header);
+                            batch.queue({header, header_len}, buffer, last_client_ep);
+                        }
+                        metrics.forwarded(Direction::DOWNSTREAM).add();
+                    }
                 }
 
-                uint16_t port = sender_ep.port();
-                header_buf[h_len - 2] = static_cast<uint8_t>((port >> 8) & 0xFF);
-                header_buf[h_len - 1] = static_cast<uint8_t>(port & 0xFF);
-
-                std::array<asio::const_buffer, 2> buffers = {asio::buffer(header_buf, h_len),
-                                                             asio::buffer(buffer.data(), n)};
-
-                co_await udp_socket.async_send_to(buffers, last_client_ep, asio::as_tuple(asio::use_awaitable));
-            }
+                // Flush before the next receive reuses the slots the queued payloads point into
+                while (batch.has_queued()) {
+                    auto sent = batch.send(udp_socket);
+                    if (sent)
+                        continue;
+                    if (sent.error() != asio::error::would_block) {
+                        metrics.dropped(UdpDrop::SEND_FAILED).add(); // Dropped, as UDP would
+                        continue;
+                    }
+                    auto [ec] = co_await udp_socket.async_wait(asio::socket_base::wait_write, use_recycled_awaitable);
+                    if (ec) {
+                        batch.clear_queue();
+                        break;
+                    }
+                }
+            } while (batch.filled());
+            // Nothing queued points into the slots any more; an idle association holds no buffer while it waits
+            batch.release();
         }
     } catch (...) {
     }
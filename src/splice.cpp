@@ -0,0 +1,126 @@
+#include "socks5/splice.hpp"
+
+#include "socks5/timeout.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace socks5 {
+
+#if defined(__linux__)
+
+namespace {
+
+// Default pipe capacity on Linux; one splice call moves at most this much
+constexpr size_t SPLICE_CHUNK = 64 * 1024;
+
+class Pipe {
+  public:
+    Pipe() {
+        if (::pipe2(fds_, O_NONBLOCK | O_CLOEXEC) != 0)
+            fds_[0] = fds_[1] = -1;
+    }
+    ~Pipe() {
+        if (fds_[0] >= 0)
+            ::close(fds_[0]);
+        if (fds_[1] >= 0)
+            ::close(fds_[1]);
+    }
+    Pipe(const Pipe&) = delete;
+    Pipe& operator=(const Pipe&) = delete;
+
+    bool is_open() const { return fds_[0] >= 0; }
+    int read_end() const { return fds_[0]; }
+    int write_end() const { return fds_[1]; }
+
+  private:
+    int fds_[2];
+};
+
+std::error_code last_error() {
+    return {errno, std::system_category()};
+}
+
+} // namespace
+
+bool splice_supported() {
+    return true;
+}
+
+asio::awaitable<std::error_code> splice_relay(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to,
+                                              Deadline& deadline, Counter* relayed) {
+    Pipe pipe;
+    if (!pipe.is_open())
+        co_return std::make_error_code(std::errc::not_supported);
+
+    asio::error_code ec;
+    from.native_non_blocking(true, ec);
+    if (!ec)
+        to.native_non_blocking(true, ec);
+    if (ec)
+        co_return std::make_error_code(std::errc::not_supported);
+
+    constexpr unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    bool moved_any = false;
+
+    while (true) {
+        // Socket -> pipe. The pipe is always empty here, so EAGAIN means the socket has nothing to read.
+        ssize_t n = ::splice(from.native_handle(), nullptr, pipe.write_end(), nullptr, SPLICE_CHUNK, flags);
+        if (n == 0)
+            co_return std::error_code{}; // EOF
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                auto ready = as_expected(
+                    co_await from.async_wait(asio::socket_base::wait_read, asio::as_tuple(asio::use_awaitable)));
+                if (!ready)
+                    co_return ready.error();
+                continue;
+            }
+            if (!moved_any && (errno == EINVAL || errno == ENOSYS))
+                co_return std::make_error_code(std::errc::not_supported);
+            co_return last_error();
+        }
+        moved_any = true;
+        deadline.touch();
+
+        // Pipe -> socket. EAGAIN means the peer's send buffer is full.
+        size_t in_pipe = static_cast<size_t>(n);
+        while (in_pipe > 0) {
+            ssize_t m = ::splice(pipe.read_end(), nullptr, to.native_handle(), nullptr, in_pipe, flags);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    co_return last_error();
+                auto ready = as_expected(
+                    co_await to.async_wait(asio::socket_base::wait_write, asio::as_tuple(asio::use_awaitable)));
+                if (!ready)
+                    co_return ready.error();
+                continue;
+            }
+            in_pipe -= static_cast<size_t>(m);
+            deadline.touch();
+            if (relayed)
+                relayed->add(static_cast<uint64_t>(m));
+        }
+    }
+}
+
+#else
+
+bool splice_supported() {
+    return false;
+}
+
+asio::awaitable<std::error_code> splice_relay(asio::ip::tcp::socket&, asio::ip::tcp::socket&, Deadline&, Counter*) {
+    co_return std::make_error_code(std::errc::not_supported);
+}
+
+#endif
+
+} // namespace socks5
@@ -0,0 +1,160 @@
+#include "socks5/timing_wheel.hpp"
+
+namespace socks5 {
+
+void Deadline::arm(TimingWheel& wheel, clock::duration timeout, Callback on_expire, void* context) {
+    cancel();
+    if (wheel.size_ == 0)
+        wheel.advance(clock::now());
+    else
+        wheel.now_ = clock::now();
+
+    wheel_ = &wheel;
+    timeout_ = timeout;
+    last_activity_ = wheel.now_;
+    on_expire_ = on_expire;
+    context_ = context;
+    expired_ = false;
+
+    ++wheel.size_;
+    wheel.insert(*this, wheel.due_tick(*this));
+    wheel.schedule();
+}
+
+void Deadline::cancel() {
+    if (wheel_) {
+        wheel_->remove(*this);
+        --wheel_->size_;
+        wheel_ = nullptr;
+    }
+}
+
+TimingWheel::TimingWheel(asio::any_io_executor executor)
+    : timer_(std::move(executor)), self_(std::make_shared<TimingWheel*>(this)), epoch_(clock::now()), now_(epoch_) {}
+
+TimingWheel::~TimingWheel() {
+    for (auto& level : slots_) {
+        for (auto* head : level) {
+            for (auto* deadline = head; deadline; deadline = deadline->next_)
+                deadline->wheel_ = nullptr;
+        }
+    }
+}
+
+uint64_t TimingWheel::due_tick(const Deadline& deadline) const {
+    // Round up so a deadline never fires early
+    auto due = deadline.last_activity_ + deadline.timeout_ - epoch_;
+    return static_cast<uint64_t>((due + TICK - clock::duration(1)) / TICK);
+}
+
+void TimingWheel::insert(Deadline& deadline, uint64_t expiry_tick) {
+    if (expiry_tick < current_tick_)
+        expiry_tick = current_tick_;
+
+    uint64_t delta = expiry_tick - current_tick_;
+    constexpr uint64_t max_delta = (uint64_t{1} << (SLOT_BITS * LEVELS)) - 1;
+    if (delta > max_delta) {
+        delta = max_delta;
+        expiry_tick = current_tick_ + delta;
+    }
+
+    size_t level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t{1} << (SLOT_BITS * (level + 1))))
+        ++level;
+    size_t index = static_cast<size_t>((expiry_tick >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+    deadline.expiry_tick_ = expiry_tick;
+    auto& head = slots_[level][index];
+    deadline.next_ = head;
+    deadline.pprev_ = &head;
+    if (head)
+        head->pprev_ = &deadline.next_;
+    head = &deadline;
+}
+
+void TimingWheel::remove(Deadline& deadline) {
+    *deadline.pprev_ = deadline.next_;
+    if (deadline.next_)
+        deadline.next_->pprev_ = deadline.pprev_;
+    deadline.next_ = nullptr;
+    deadline.pprev_ = nullptr;
+}
+
+void TimingWheel::schedule() {
+    if (waiting_ || size_ == 0)
+        return;
+
+    waiting_ = true;
+    timer_.expires_at(epoch_ + TICK * static_cast<clock::rep>(current_tick_ + 1));
+    timer_.async_wait([self = std::weak_ptr<TimingWheel*>(self_)](const asio::error_code& ec) {
+        auto alive = self.lock();
+        if (!alive)
+            return;
+        auto* wheel = *alive;
+        wheel->waiting_ = false;
+        if (ec)
+            return;
+        wheel->advance(clock::now());
+        wheel->schedule();
+    });
+}
+
+void TimingWheel::advance(clock::time_point now) {
+    now_ = now;
+    auto target = static_cast<uint64_t>((now - epoch_) / TICK);
+
+    if (size_ == 0) {
+        // Nothing to expire; skip the idle stretch in one step
+        current_tick_ = std::max(current_tick_, target);
+        return;
+    }
+
+    while (current_tick_ < target) {
+        ++current_tick_;
+        if ((current_tick_ & (SLOTS - 1)) == 0) {
+            if (((current_tick_ >> SLOT_BITS) & (SLOTS - 1)) == 0)
+                cascade(2);
+            cascade(1);
+        }
+        expire_slot(current_tick_);
+    }
+}
+
+void TimingWheel::cascade(size_t level) {
+    size_t index = static_cast<size_t>((current_tick_ >> (SLOT_BITS * level)) & (SLOTS - 1));
+    Deadline* list = slots_[level][index];
+    slots_[level][index] = nullptr;
+
+    while (list) {
+        Deadline* deadline = list;
+        list = deadline->next_;
+        insert(*deadline, deadline->expiry_tick_);
+    }
+}
+
+void TimingWheel::expire_slot(uint64_t tick) {
+    size_t index = static_cast<size_t>(tick & (SLOTS - 1));
+    Deadline* list = slots_[0][index];
+    slots_[0][index] = nullptr;
+    if (list)
+        list->pprev_ = &list;
+
+    while (list) {
+        Deadline* deadline = list;
+        remove(*deadline);
+
+        // Activity since the deadline was filed pushes it out instead of firing it
+        uint64_t due = due_tick(*deadline);
+        if (due > tick) {
+            insert(*deadline, due);
+            continue;
+        }
+
+        deadline->wheel_ = nullptr;
+        deadline->expired_ = true;
+        --size_;
+        deadline->on_expire_(deadline->context_);
+    }
+}
+
+} // namespace socks5
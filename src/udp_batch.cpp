@@ -0,0 +1,347 @@
+#include "socks5/udp_batch.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+// Older libc headers lack the offload options
+#if !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+#if !defined(UDP_GRO)
+#define UDP_GRO 104
+#endif
+#endif
+
+namespace socks5 {
+
+namespace {
+
+// Payload bytes of one UDP_SEGMENT send; leaves room for the UDP and IPv6 headers within 64 KiB
+constexpr size_t MAX_GSO_BYTES = 65000;
+
+} // namespace
+
+UdpBatch::UdpBatch(asio::ip::udp::socket& socket, bool offload) {
+#if defined(__linux__)
+    if (offload) {
+        int one = 1;
+        gro_ = ::setsockopt(socket.native_handle(), IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+        // Setting a zero segment size succeeds exactly when the kernel knows UDP_SEGMENT
+        int zero = 0;
+        gso_ = ::setsockopt(socket.native_handle(), IPPROTO_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+    }
+#else
+    (void)socket;
+    (void)offload;
+#endif
+    if (gro_)
+        use_large_slots();
+}
+
+void UdpBatch::acquire_slots() {
+    if (slots_)
+        return;
+    slots_ = BufferPool::local().acquire(MAX_BUFFER_SIZE);
+    rx_ = place_pooled<ReceiveState>(receive_block_);
+}
+
+void UdpBatch::release() {
+    slots_.reset();
+    receive_block_.reset();
+    rx_ = nullptr;
+    received_ = 0;
+    filled_ = false;
+}
+
+bool UdpBatch::queue(std::span<const uint8_t> header, std::span<const uint8_t> payload,
+                     const asio::ip::udp::endpoint& to) {
+    if (full())
+        return false;
+    if (!tx_)
+        tx_ = place_pooled<QueueState>(queue_block_);
+    size_t header_size = std::min(header.size(), MAX_HEADER);
+    size_t pieces = header_size > 0 ? 2 : 1;
+    size_t bytes = header_size + payload.size();
+
+    if (header_size > 0) {
+        auto& copy = tx_->headers[queued_];
+        std::memcpy(copy.data(), header.data(), header_size);
+        tx_->pieces[pieces_++] = {copy.data(), header_size};
+    }
+    tx_->pieces[pieces_++] = payload;
+    ++queued_;
+
+    // Extend the last send into (or further along) a segment run when the kernel can split it again. Every segment but
+    // the last must be exactly segment_size, so a shorter datagram closes the run.
+    if (gso_ && has_queued() && bytes > 0) {
+        auto& last = tx_->outgoing[outgoing_ - 1];
+        bool run_open = last.bytes == last.datagrams * last.segment_size;
+        if (last.to == to && last.pieces_per_datagram == pieces && run_open && bytes <= last.segment_size &&
+            last.datagrams < UDP_MAX_SEGMENTS && last.bytes + bytes <= MAX_GSO_BYTES) {
+            ++last.datagrams;
+            last.bytes += bytes;
+            return true;
+        }
+    }
+    tx_->outgoing[outgoing_++] = {to, pieces_ - pieces, pieces, 1, bytes, bytes};
+    return true;
+}
+
+void UdpBatch::clear_queue() {
+    queue_block_.reset();
+    tx_ = nullptr;
+    pieces_ = 0;
+    outgoing_ = 0;
+    queued_ = 0;
+    sent_ = 0;
+}
+
+void UdpBatch::use_large_slots() {
+    large_slots_ = true;
+    slot_count_ = UDP_LARGE_SLOTS;
+}
+
+void UdpBatch::split_segments() {
+    // At most one send per queued datagram, so the split queue fits where the old one was
+    std::array<Outgoing, MAX_QUEUED> split;
+    size_t count = 0;
+    for (size_t i = sent_; i < outgoing_; ++i) {
+        const auto& out = tx_->outgoing[i];
+        for (size_t d = 0; d < out.datagrams; ++d) {
+            size_t first = out.first_piece + d * out.pieces_per_datagram;
+            size_t bytes = 0;
+            for (size_t p = first; p < first + out.pieces_per_datagram; ++p)
+                bytes += tx_->pieces[p].size();
+            split[count++] = {out.to, first, out.pieces_per_datagram, 1, bytes, bytes};
+        }
+    }
+    std::copy_n(split.begin(), count, tx_->outgoing.begin());
+    outgoing_ = count;
+    sent_ = 0;
+}
+
+#if defined(__linux__)
+
+namespace {
+
+std::error_code last_error() {
+    return {errno, std::system_category()};
+}
+
+// Room for the one int or uint16_t control message the offloads use
+constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+
+} // namespace
+
+std::expected<size_t, std::error_code> UdpBatch::receive(asio::ip::udp::socket& socket) {
+    acquire_slots();
+    auto& senders = rx_->senders;
+    std::array<mmsghdr, UDP_BATCH_SLOTS> messages{};
+    std::array<iovec, UDP_BATCH_SLOTS> iovecs;
+    alignas(cmsghdr) std::array<std::array<char, CONTROL_SIZE>, UDP_BATCH_SLOTS> controls;
+    for (size_t i = 0; i < slot_count_; ++i) {
+        iovecs[i] = {slot(i), slot_size(i)};
+        auto& header = messages[i].msg_hdr;
+        header.msg_name = senders[i].data();
+        header.msg_namelen = static_cast<socklen_t>(senders[i].capacity());
+        header.msg_iov = &iovecs[i];
+        header.msg_iovlen = 1;
+        if (gro_) {
+            header.msg_control = controls[i].data();
+            header.msg_controllen = CONTROL_SIZE;
+        }
+    }
+
+    received_ = 0;
+    filled_ = false;
+    int n;
+    do {
+        n = ::recvmmsg(socket.native_handle(), messages.data(), static_cast<unsigned int>(slot_count_), MSG_DONTWAIT,
+                       nullptr);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return std::unexpected(last_error());
+    }
+    filled_ = static_cast<size_t>(n) == slot_count_;
+
+    bool large = false;
+    for (int i = 0; i < n; ++i) {
+        auto& header = messages[i].msg_hdr;
+        senders[i].resize(header.msg_namelen);
+        bool truncated = (header.msg_flags & MSG_TRUNC) != 0;
+        std::span<uint8_t> data(slot(i), messages[i].msg_len);
+        large = large || truncated || data.size() > UDP_SLOT_SIZE;
+
+        // A GRO super-packet carries its segment size; hand its segments out as the datagrams they were
+        size_t segment_size = 0;
+        for (auto* cmsg = gro_ ? CMSG_FIRSTHDR(&header) : nullptr; cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int size;
+                std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                segment_size = static_cast<size_t>(size);
+            }
+        }
+        if (segment_size == 0 || segment_size >= data.size()) {
+            rx_->received[received_++] = {data, static_cast<uint8_t>(i), truncated};
+            continue;
+        }
+        for (size_t offset = 0; offset < data.size(); offset += segment_size) {
+            auto segment = data.subspan(offset, std::min(segment_size, data.size() - offset));
+            bool last = offset + segment.size() == data.size();
+            rx_->received[received_++] = {segment, static_cast<uint8_t>(i), truncated && last};
+        }
+    }
+    // The spans above are already taken; the next receive lays out its slots anew
+    if (large && !large_slots_)
+        use_large_slots();
+    return received_;
+}
+
+std::expected<size_t, std::error_code> UdpBatch::send(asio::ip::udp::socket& socket) {
+    size_t count = std::min(outgoing_ - sent_, UDP_BATCH_SLOTS);
+    if (count == 0)
+        return 0;
+
+    std::array<mmsghdr, UDP_BATCH_SLOTS> messages{};
+    std::array<iovec, 2 * MAX_QUEUED> iovecs;
+    alignas(cmsghdr) std::array<std::array<char, CONTROL_SIZE>, UDP_BATCH_SLOTS> controls{};
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto& out = tx_->outgoing[sent_ + i];
+        // The queue never holds more pieces than this, but a send must not outgrow the array either way
+        if (used + out.datagrams * out.pieces_per_datagram > iovecs.size()) {
+            count = i;
+            break;
+        }
+        auto& header = messages[i].msg_hdr;
+        header.msg_name = const_cast<void*>(static_cast<const void*>(out.to.data()));
+        header.msg_namelen = static_cast<socklen_t>(out.to.size());
+        header.msg_iov = &iovecs[used];
+        header.msg_iovlen = out.datagrams * out.pieces_per_datagram;
+        for (size_t p = 0; p < header.msg_iovlen; ++p) {
+            auto piece = tx_->pieces[out.first_piece + p];
+            iovecs[used++] = {const_cast<uint8_t*>(piece.data()), piece.size()};
+        }
+
+        if (out.datagrams > 1) {
+            header.msg_control = controls[i].data();
+            header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            auto* cmsg = CMSG_FIRSTHDR(&header);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            auto segment_size = static_cast<uint16_t>(out.segment_size);
+            std::memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+    }
+
+    int n;
+    do {
+        n = ::sendmmsg(socket.native_handle(), messages.data(), static_cast<unsigned int>(count), MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return std::unexpected(asio::error::would_block);
+
+        // The kernel knows UDP_SEGMENT but this path cannot do it (e.g. no checksum offload): stop using it and resend
+        // the same datagrams one by one
+        if (tx_->outgoing[sent_].datagrams > 1 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+            gso_ = false;
+            split_segments();
+            return 0;
+        }
+
+        // sendmmsg only fails when the first send does; drop it so the rest can go
+        auto ec = last_error();
+        ++sent_;
+        if (!has_queued())
+            clear_queue();
+        return std::unexpected(ec);
+    }
+
+    sent_ += static_cast<size_t>(n);
+    if (!has_queued())
+        clear_queue();
+    return static_cast<size_t>(n);
+}
+
+#else
+
+std::expected<size_t, std::error_code> UdpBatch::receive(asio::ip::udp::socket& socket) {
+    acquire_slots();
+    received_ = 0;
+    filled_ = false;
+
+    asio::error_code ec;
+    if (!socket.non_blocking())
+        socket.non_blocking(true, ec);
+    if (ec)
+        return std::unexpected(ec);
+
+    size_t n = 0;
+    bool large = false;
+    for (; n < slot_count_; ++n) {
+        size_t size = socket.receive_from(asio::buffer(slot(n), slot_size(n)), rx_->senders[n], 0, ec);
+        if (ec == asio::error::message_size) {
+            rx_->received[received_++] = {{slot(n), slot_size(n)}, static_cast<uint8_t>(n), true};
+            large = true;
+            continue;
+        }
+        if (ec == asio::error::would_block)
+            break;
+        if (ec) {
+            if (n == 0)
+                return std::unexpected(ec);
+            break;
+        }
+        rx_->received[received_++] = {{slot(n), size}, static_cast<uint8_t>(n), false};
+        large = large || size > UDP_SLOT_SIZE;
+    }
+    filled_ = n == slot_count_;
+    if (large && !large_slots_)
+        use_large_slots();
+    return received_;
+}
+
+std::expected<size_t, std::error_code> UdpBatch::send(asio::ip::udp::socket& socket) {
+    // Without UDP_SEGMENT every send is a single datagram of at most two pieces
+    size_t n = 0;
+    while (has_queued()) {
+        const auto& out = tx_->outgoing[sent_];
+        std::array<asio::const_buffer, 2> buffers;
+        for (size_t p = 0; p < out.pieces_per_datagram; ++p) {
+            auto piece = tx_->pieces[out.first_piece + p];
+            buffers[p] = asio::buffer(piece.data(), piece.size());
+        }
+
+        asio::error_code ec;
+        socket.send_to(std::span(buffers.data(), out.pieces_per_datagram), out.to, 0, ec);
+        if (ec == asio::error::would_block) {
+            if (n == 0)
+                return std::unexpected(ec);
+            break;
+        }
+        ++sent_;
+        if (ec) {
+            if (!has_queued())
+                clear_queue();
+            return std::unexpected(ec);
+        }
+        ++n;
+    }
+    if (!has_queued())
+        clear_queue();
+    return n;
+}
+
+#endif
+
+} // namespace socks5
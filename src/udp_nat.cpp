@@ -0,0 +1,110 @@
+#include "socks5/udp_nat.hpp"
+
+#include "socks5/protocol.hpp"
+
+#include <string_view>
+
+namespace socks5 {
+
+uint64_t UdpNatTable::hash(std::span<const uint8_t> key) {
+    // FNV-1a; keys are at most a few hundred bytes
+    uint64_t h = 14695981039346656037ull;
+    for (uint8_t byte : key) {
+        h ^= byte;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool UdpNatTable::matches(const Slot& slot, uint64_t hash, std::span<const uint8_t> key) const {
+    return slot.hash == hash &&
+           std::string_view(slot.key) == std::string_view(reinterpret_cast<const char*>(key.data()), key.size());
+}
+
+size_t UdpNatTable::encode(const asio::ip::udp::endpoint& endpoint, std::span<uint8_t, MAX_IP_KEY> out) {
+    return encode_address(endpoint.address(), endpoint.port(), out);
+}
+
+UdpNatTable::Entry* UdpNatTable::find(std::span<const uint8_t> key, clock::time_point now) {
+    uint64_t h = hash(key);
+    for (size_t i = home(h), probes = 0; probes < CAPACITY; i = (i + 1) & (CAPACITY - 1), ++probes) {
+        auto& slot = slots_[i];
+        if (!slot.used)
+            return nullptr;
+        if (matches(slot, h, key)) {
+            if (expired(slot.entry, now)) {
+                erase(i);
+                return nullptr;
+            }
+            slot.entry.last_used = now;
+            return &slot.entry;
+        }
+    }
+    return nullptr;
+}
+
+UdpNatTable::Entry& UdpNatTable::insert(std::span<const uint8_t> key, const asio::ip::udp::endpoint& target,
+                                        clock::time_point now) {
+    uint64_t h = hash(key);
+    size_t i = home(h);
+    for (size_t probes = 0; probes < CAPACITY; i = (i + 1) & (CAPACITY - 1), ++probes) {
+        if (!slots_[i].used || matches(slots_[i], h, key))
+            break;
+    }
+
+    if (!slots_[i].used) {
+        if (size_ >= MAX_ENTRIES) {
+            make_room(now);
+            return insert(key, target, now); // Slots moved; probe again
+        }
+        slots_[i].used = true;
+        slots_[i].hash = h;
+        slots_[i].key.assign(reinterpret_cast<const char*>(key.data()), key.size());
+        ++size_;
+    }
+
+    // Replies carry the target's own address, whatever form the client named it in
+    Entry& entry = slots_[i].entry;
+    entry.target = target;
+    entry.reply_header_size = encode_udp_header(target, entry.reply_header);
+    entry.last_used = now;
+    return entry;
+}
+
+void UdpNatTable::make_room(clock::time_point now) {
+    // Idle entries go first. Erasing shifts later entries back into the freed slot, so look at it again.
+    for (size_t i = 0; i < CAPACITY;) {
+        if (slots_[i].used && expired(slots_[i].entry, now))
+            erase(i);
+        else
+            ++i;
+    }
+    if (size_ < MAX_ENTRIES)
+        return;
+
+    size_t oldest = CAPACITY;
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        if (slots_[i].used && (oldest == CAPACITY || slots_[i].entry.last_used < slots_[oldest].entry.last_used))
+            oldest = i;
+    }
+    erase(oldest);
+}
+
+void UdpNatTable::erase(size_t index) {
+    // Backward-shift deletion: pull later members of the probe chain into the hole so lookups never stop early
+    size_t hole = index;
+    for (size_t next = (hole + 1) & (CAPACITY - 1); slots_[next].used; next = (next + 1) & (CAPACITY - 1)) {
+        size_t want = home(slots_[next].hash);
+        // Leave entries whose home lies cyclically in (hole, next]
+        bool stays = hole <= next ? (hole < want && want <= next) : (hole < want || want <= next);
+        if (stays)
+            continue;
+        slots_[hole] = std::move(slots_[next]);
+        hole = next;
+    }
+    slots_[hole].used = false;
+    slots_[hole].key.clear();
+    --size_;
+}
+
+} // namespace socks5
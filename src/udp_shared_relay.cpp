@@ -0,0 +1,436 @@
+#include "socks5/udp_shared_relay.hpp"
+
+#include "socks5/metrics.hpp"
+#include "socks5/protocol.hpp"
+
+#include <algorithm>
+
+namespace socks5 {
+
+namespace {
+
+// Bounds on what a shard holds back while destinations resolve, across all its associations
+constexpr size_t MAX_PENDING_DESTINATIONS = 256;
+constexpr size_t MAX_PENDING_DATAGRAMS = 8; // Per destination
+constexpr size_t MAX_PENDING_BYTES = 16 * 1024;
+
+// Oldest flows of an association make room past this many
+constexpr size_t MAX_FLOWS_PER_ASSOCIATION = 64;
+
+} // namespace
+
+SharedUdpRelay::SharedUdpRelay(const asio::any_io_executor& executor, const asio::ip::address& bind_address,
+                               std::shared_ptr<ResolverCache> resolver, SharedUdpRelayOptions options, bool offload)
+    : executor_(executor), resolver_(std::move(resolver)), bind_address_(bind_address), offload_(offload),
+      fixed_ports_(std::max<size_t>(options.ports, 1)), max_ports_(std::max(options.max_ports, fixed_ports_)),
+      sweep_timer_(executor), pending_(MAX_PENDING_DESTINATIONS, MAX_PENDING_DATAGRAMS, MAX_PENDING_BYTES) {
+    for (size_t i = 0; i < fixed_ports_; ++i) {
+        auto port = options.first_port == 0 ? 0 : static_cast<uint16_t>(options.first_port + i);
+        asio::ip::udp::socket socket(executor_, asio::ip::udp::endpoint(bind_address, port));
+        socket.non_blocking(true);
+        ports_.push_back(std::make_shared<Port>(std::move(socket), offload));
+    }
+}
+
+void SharedUdpRelay::start() {
+    for (size_t i = 0; i < ports_.size(); ++i) {
+        asio::co_spawn(
+            executor_, [self = shared_from_this(), port = ports_[i], i] { return self->receive_loop(port, i); },
+            asio::detached);
+    }
+    asio::co_spawn(executor_, [self = shared_from_this()] { return self->sweep_idle_flows(); }, asio::detached);
+}
+
+uint16_t SharedUdpRelay::port() const {
+    return ports_.front()->socket.local_endpoint().port();
+}
+
+size_t SharedUdpRelay::open_ports() const {
+    return static_cast<size_t>(std::ranges::count_if(ports_, [](const auto& port) { return port != nullptr; }));
+}
+
+std::optional<size_t> SharedUdpRelay::open_port() {
+    auto free = std::find(ports_.begin() + static_cast<std::ptrdiff_t>(fixed_ports_), ports_.end(), nullptr);
+    if (free == ports_.end() && ports_.size() >= max_ports_)
+        return std::nullopt;
+
+    asio::ip::udp::socket socket(executor_);
+    asio::error_code ec;
+    socket.open(bind_address_.is_v6() ? asio::ip::udp::v6() : asio::ip::udp::v4(), ec);
+    if (!ec)
+        socket.bind({bind_address_, 0}, ec);
+    if (!ec)
+        socket.non_blocking(true, ec);
+    if (ec)
+        return std::nullopt; // Out of descriptors or ports: as good as the limit
+
+    auto port = std::make_shared<Port>(std::move(socket), offload_);
+    size_t index = static_cast<size_t>(free - ports_.begin());
+    if (free == ports_.end())
+        ports_.push_back(port);
+    else
+        *free = port;
+    asio::co_spawn(
+        executor_, [self = shared_from_this(), port, index] { return self->receive_loop(port, index); },
+        asio::detached);
+    return index;
+}
+
+void SharedUdpRelay::close_idle_ports() {
+    for (size_t i = fixed_ports_; i < ports_.size(); ++i) {
+        auto& port = ports_[i];
+        if (!port || port->flows > 0 || port->batch.has_queued())
+            continue;
+        // Ends its receive loop, which owns the port from here on
+        asio::error_code ec;
+        port->socket.close(ec);
+        port.reset();
+    }
+    while (ports_.size() > fixed_ports_ && !ports_.back())
+        ports_.pop_back();
+}
+
+uint64_t SharedUdpRelay::open(const asio::ip::address& client_ip, uint16_t client_port) {
+    uint64_t id = next_association_++;
+    auto& association = associations_.try_emplace(id).first->second;
+    association.client = {client_ip, client_port};
+    // Spread associations over the ports so that each port's flows stay few
+    association.home_port = id % fixed_ports_;
+
+    if (client_port != 0 && by_client_.try_emplace(association.client, id).second)
+        return id;
+    // Port not given, or already claimed by another association: take it from the first datagram
+    association.client.port(0);
+    unbound_.emplace(client_ip, id);
+    return id;
+}
+
+void SharedUdpRelay::close(uint64_t id) {
+    auto node = associations_.extract(id);
+    if (node.empty())
+        return;
+    auto& association = node.mapped();
+
+    if (association.client.port() != 0) {
+        by_client_.erase(association.client);
+    } else {
+        auto [first, last] = unbound_.equal_range(association.client.address());
+        for (auto it = first; it != last; ++it) {
+            if (it->second == id) {
+                unbound_.erase(it);
+                break;
+            }
+        }
+    }
+
+    // The association is already out of associations_, so erasing its flows leaves its list alone
+    for (Flow* flow : association.flows)
+        erase_flow(*flow->key);
+    pending_.forget_if([id](const FlowKey& key) { return key.association == id; });
+}
+
+asio::awaitable<void> SharedUdpRelay::receive_loop(std::shared_ptr<Port> owned, size_t index) {
+    auto& port = *owned;
+    auto& metrics = Metrics::local();
+    while (true) {
+        auto [ec] = co_await port.socket.async_wait(asio::socket_base::wait_read, asio::as_tuple(asio::use_awaitable));
+        if (ec || !port.socket.is_open())
+            co_return;
+
+        // Drain the socket; a full batch means more may be waiting
+        do {
+            // Replies from every port go out through port 0, so while one loop waits for a full socket the others
+            // could pile their datagrams onto the same queue. Receiving only once every queue is empty bounds what
+            // a queue holds to one receive's worth, which it always has room for.
+            while (queued())
+                co_await flush();
+
+            auto received = port.batch.receive(port.socket);
+            auto now = clock::now();
+            for (size_t i = 0; i < (received ? *received : 0); ++i) {
+                if (port.batch.truncated(i)) {
+                    metrics.dropped(UdpDrop::TRUNCATED).add();
+                    continue;
+                }
+                if (port.batch.data(i).empty())
+                    continue;
+                const auto& sender = port.batch.sender(i);
+
+                // Known clients first, then replies to mapped flows; only then may a new client port be learned,
+                // so that a reply from a target on the client's host is not taken for the client
+                if (index == 0) {
+                    if (auto client = by_client_.find(sender); client != by_client_.end()) {
+                        from_client(client->second, port.batch.data(i), now);
+                        continue;
+                    }
+                }
+                if (auto reply = replies_.find({index, sender}); reply != replies_.end()) {
+                    to_client(*reply->second, port.batch.data(i), now);
+                    continue;
+                }
+                if (index == 0) {
+                    if (auto id = learn_client(sender)) {
+                        from_client(*id, port.batch.data(i), now);
+                        continue;
+                    }
+                }
+                // Anything else is unsolicited: on a shared port there is no telling whose it would be
+                metrics.dropped(UdpDrop::UNSOLICITED).add();
+            }
+
+            // Payloads in any port's queue may point into this port's slots
+            co_await flush();
+        } while (port.batch.filled());
+        // The flush above left nothing pointing into the slots; an idle port holds no buffer while it waits
+        port.batch.release();
+    }
+}
+
+bool SharedUdpRelay::queued() const {
+    return std::ranges::any_of(ports_, [](const auto& port) { return port && port->batch.has_queued(); });
+}
+
+asio::awaitable<void> SharedUdpRelay::flush() {
+    // By index and holding the port: ports may be opened while this waits
+    for (size_t i = 0; i < ports_.size(); ++i) {
+        auto port = ports_[i];
+        while (port && port->batch.has_queued()) {
+            auto sent = port->batch.send(port->socket);
+            if (sent)
+                continue;
+            if (sent.error() != asio::error::would_block) {
+                Metrics::local().dropped(UdpDrop::SEND_FAILED).add(); // Dropped, as UDP would
+                continue;
+            }
+            auto [ec] =
+                co_await port->socket.async_wait(asio::socket_base::wait_write, asio::as_tuple(asio::use_awaitable));
+            if (ec) {
+                port->batch.clear_queue();
+                break;
+            }
+        }
+    }
+}
+
+asio::awaitable<void> SharedUdpRelay::sweep_idle_flows() {
+    while (true) {
+        sweep_timer_.expires_after(FLOW_IDLE_TIMEOUT / 4);
+        auto [ec] = co_await sweep_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (ec)
+            co_return;
+
+        auto now = clock::now();
+        std::vector<Flow*> idle;
+        for (auto& [key, flow] : flows_) {
+            if (now - flow.last_used > FLOW_IDLE_TIMEOUT)
+                idle.push_back(&flow);
+        }
+        for (Flow* flow : idle)
+            erase_flow(*flow->key);
+        close_idle_ports();
+    }
+}
+
+std::optional<uint64_t> SharedUdpRelay::learn_client(const asio::ip::udp::endpoint& sender) {
+    // The oldest association from this address that has not sent yet takes the port
+    auto [first, last] = unbound_.equal_range(sender.address());
+    if (first == last)
+        return std::nullopt;
+    auto oldest = std::min_element(first, last, [](const auto& a, const auto& b) { return a.second < b.second; });
+    uint64_t id = oldest->second;
+    unbound_.erase(oldest);
+
+    associations_.at(id).client.port(sender.port());
+    by_client_.try_emplace(sender, id);
+    return id;
+}
+
+void SharedUdpRelay::from_client(uint64_t id, std::span<uint8_t> datagram, clock::time_point now) {
+    auto& metrics = Metrics::local();
+    auto header = decode_udp_header(datagram);
+    if (!header) {
+        metrics.dropped(UdpDrop::MALFORMED).add();
+        return;
+    }
+    if (header->fragment != 0x00) {
+        metrics.dropped(UdpDrop::FRAGMENTED).add(); // Drop fragmented
+        return;
+    }
+
+    auto destination = header->address;
+    auto payload = datagram.subspan(header->size);
+    FlowKey key{id, DestinationKey(destination.bytes)};
+
+    Flow* flow = nullptr;
+    if (auto it = flows_.find(key); it != flows_.end()) {
+        flow = &it->second;
+    } else {
+        auto port = destination.port();
+        if (destination.type() != AddressType::DOMAIN_NAME) {
+            flow = create_flow(key, {destination.ip(), port}, now);
+        } else {
+            auto host = destination.domain();
+            auto cached = resolver_->try_get(host);
+            if (!cached) {
+                hold(key, host, port, payload);
+                return;
+            }
+            if (!*cached || (**cached)->empty()) {
+                metrics.dropped(UdpDrop::UNRESOLVED).add();
+                return;
+            }
+            flow = create_flow(key, {(**cached)->front(), port}, now);
+        }
+        if (!flow) {
+            metrics.dropped(UdpDrop::NO_PORT).add();
+            return;
+        }
+    }
+
+    flow->last_used = now;
+    if (!ports_[flow->port]->batch.queue({}, payload, flow->target)) {
+        metrics.dropped(UdpDrop::SEND_FAILED).add();
+        return;
+    }
+    metrics.forwarded(Direction::UPSTREAM).add();
+}
+
+void SharedUdpRelay::to_client(Flow& flow, std::span<const uint8_t> datagram, clock::time_point now) {
+    auto it = associations_.find(flow.association);
+    if (it == associations_.end() || it->second.client.port() == 0) {
+        Metrics::local().dropped(UdpDrop::UNSOLICITED).add();
+        return;
+    }
+    flow.last_used = now;
+    if (!ports_.front()->batch.queue(flow.reply(), datagram, it->second.client)) {
+        Metrics::local().dropped(UdpDrop::SEND_FAILED).add();
+        return;
+    }
+    Metrics::local().forwarded(Direction::DOWNSTREAM).add();
+}
+
+SharedUdpRelay::Flow* SharedUdpRelay::create_flow(const FlowKey& key, const asio::ip::udp::endpoint& target,
+                                                  clock::time_point now) {
+    uint64_t id = key.association;
+    auto& association = associations_.at(id);
+
+    // A port where no other association talks to this target; replies on it can only be for this one
+    size_t chosen = ports_.size();
+    for (size_t k = 0; k < ports_.size(); ++k) {
+        size_t index = (association.home_port + k) % ports_.size();
+        if (!ports_[index])
+            continue;
+        auto reply = replies_.find({index, target});
+        if (reply == replies_.end() || reply->second->association == id) {
+            chosen = index;
+            break;
+        }
+    }
+    if (chosen == ports_.size()) {
+        // Every open port already talks to this target for someone else
+        auto opened = open_port();
+        if (!opened)
+            return nullptr;
+        chosen = *opened;
+    }
+
+    if (association.flows.size() >= MAX_FLOWS_PER_ASSOCIATION) {
+        auto oldest = std::min_element(association.flows.begin(), association.flows.end(),
+                                       [](const Flow* a, const Flow* b) { return a->last_used < b->last_used; });
+        erase_flow(*(*oldest)->key);
+    }
+
+    auto& [stored_key, flow] = *flows_.try_emplace(key).first;
+    flow.key = &stored_key;
+    flow.association = id;
+    flow.target = target;
+    flow.port = chosen;
+    flow.last_used = now;
+    // Replies carry the target's own address, whatever form the client named it in
+    flow.reply_header_size = encode_udp_header(target, flow.reply_header);
+
+    replies_.try_emplace({chosen, target}, &flow);
+    ++ports_[chosen]->flows;
+    association.flows.push_back(&flow);
+    // Ports opened on demand serve the one flow they were opened for, and close with it
+    if (chosen < fixed_ports_)
+        association.home_port = chosen;
+    return &flow;
+}
+
+void SharedUdpRelay::erase_flow(const FlowKey& key) {
+    auto it = flows_.find(key);
+    if (it == flows_.end())
+        return;
+    Flow& flow = it->second;
+    auto association = associations_.find(flow.association);
+    if (association != associations_.end())
+        std::erase(association->second.flows, &flow);
+
+    auto reply = replies_.find({flow.port, flow.target});
+    if (reply != replies_.end() && reply->second == &flow) {
+        replies_.erase(reply);
+        // The same target may also be named another way (by name and by address); that flow takes the replies over
+        if (association != associations_.end()) {
+            for (Flow* other : association->second.flows) {
+                if (other->port == flow.port && other->target == flow.target) {
+                    replies_.try_emplace({flow.port, flow.target}, other);
+                    break;
+                }
+            }
+        }
+    }
+    --ports_[flow.port]->flows;
+    flows_.erase(it);
+}
+
+void SharedUdpRelay::hold(const FlowKey& key, std::string_view host, uint16_t port,
+                          std::span<const uint8_t> payload) {
+    if (!pending_.hold(key, payload))
+        return;
+
+    // Resolve off the receive loops; traffic to known destinations keeps flowing
+    auto on_resolved = [weak = weak_from_this(), key, port](std::error_code ec, ResolverCache::Addresses addresses) {
+        auto self = weak.lock();
+        if (!self)
+            return;
+        if (ec || !addresses || addresses->empty())
+            self->pending_.fail(key);
+        else
+            self->resolved(key, {addresses->front(), port});
+    };
+    resolver_->async_resolve(host, asio::bind_executor(executor_, std::move(on_resolved)));
+}
+
+void SharedUdpRelay::resolved(const FlowKey& key, const asio::ip::udp::endpoint& target) {
+    // Gone when the association closed while the name resolved
+    auto datagrams = pending_.take(key);
+    if (!datagrams)
+        return;
+
+    uint64_t id = key.association;
+    Flow* flow = nullptr;
+    if (auto it = flows_.find(key); it != flows_.end())
+        flow = &it->second;
+    else if (associations_.contains(id))
+        flow = create_flow(key, target, clock::now());
+    if (!flow) {
+        if (associations_.contains(id))
+            Metrics::local().dropped(UdpDrop::NO_PORT).add(datagrams->size());
+        return;
+    }
+
+    // The socket is non-blocking; datagrams that do not fit in its send buffer are dropped, as UDP would
+    auto& socket = ports_[flow->port]->socket;
+    auto& metrics = Metrics::local();
+    for (const auto& datagram : *datagrams) {
+        asio::error_code ec;
+        socket.send_to(asio::buffer(datagram), flow->target, 0, ec);
+        if (ec)
+            metrics.dropped(UdpDrop::SEND_FAILED).add();
+        else
+            metrics.forwarded(Direction::UPSTREAM).add();
+    }
+}
+
+} // namespace socks5
@@ -0,0 +1,141 @@
+#include "asio_config.hpp"
+#include "socks5/client.hpp"
+#include "socks5/server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <gtest/gtest.h>
+#include <new>
+#include <string>
+#include <thread>
+
+using namespace socks5;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Allocations through the global operator new made on one watched thread. Every test in the binary goes through this
+// operator new; only the watched thread's calls are counted.
+std::atomic<std::thread::id> watched_thread;
+std::atomic<uint64_t> watched_allocations{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    if (std::this_thread::get_id() == watched_thread.load(std::memory_order_relaxed))
+        watched_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+// Accepts one connection and echoes it until the client hangs up
+asio::awaitable<void> echo_once(asio::ip::tcp::acceptor& acceptor) {
+    auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+    if (ec)
+        co_return;
+    char data[256];
+    while (true) {
+        auto [read_ec, n] = co_await socket.async_read_some(asio::buffer(data), asio::as_tuple(asio::use_awaitable));
+        if (read_ec)
+            co_return;
+        auto [write_ec, written] =
+            co_await asio::async_write(socket, asio::buffer(data, n), asio::as_tuple(asio::use_awaitable));
+        if (write_ec)
+            co_return;
+    }
+}
+
+} // namespace
+
+TEST(AllocationTest, ConnectSessionsDoNotAllocateOnceWarm) {
+    // The proxy runs on a thread of its own, whose allocations are counted; the clients and the target run here
+    asio::io_context proxy_io;
+    Server proxy(proxy_io, 0, "127.0.0.1");
+    proxy.start();
+    std::thread proxy_thread([&] {
+        watched_thread.store(std::this_thread::get_id());
+        auto work_guard = asio::make_work_guard(proxy_io);
+        proxy_io.run();
+    });
+
+    asio::io_context io;
+    asio::ip::tcp::acceptor target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    asio::ip::tcp::endpoint proxy_endpoint(asio::ip::make_address("127.0.0.1"), proxy.port());
+
+    // A CONNECT by address, one echoed message, then the client hangs up and the proxy tears the tunnel down
+    auto session = [&]() -> asio::awaitable<void> {
+        asio::co_spawn(io, echo_once(target), asio::detached);
+        asio::ip::tcp::socket socket(io);
+        co_await Client::connect(socket, proxy_endpoint, "127.0.0.1", target_port);
+        std::string msg = "no allocations";
+        co_await asio::async_write(socket, asio::buffer(msg), asio::use_awaitable);
+        char reply[64];
+        size_t n = co_await asio::async_read(socket, asio::buffer(reply, msg.size()), asio::use_awaitable);
+        EXPECT_EQ(std::string(reply, n), msg);
+    };
+    auto proxy_idle = [&]() -> asio::awaitable<void> {
+        asio::steady_timer timer(io);
+        do {
+            timer.expires_after(10ms);
+            co_await timer.async_wait(asio::use_awaitable);
+        } while (proxy.shard_stats().front().active_sessions > 0);
+    };
+
+    // The first sessions fill the pools and asio's recycling caches; from then on a session only reuses memory
+    constexpr int WARM_UP_SESSIONS = 16;
+    constexpr int MEASURED_SESSIONS = 64;
+    bool done = false;
+    uint64_t allocations = 0;
+    asio::co_spawn(
+        io,
+        [&]() -> asio::awaitable<void> {
+            for (int i = 0; i < WARM_UP_SESSIONS; ++i)
+                co_await session();
+            co_await proxy_idle();
+            auto before = watched_allocations.load();
+            for (int i = 0; i < MEASURED_SESSIONS; ++i)
+                co_await session();
+            co_await proxy_idle();
+            allocations = watched_allocations.load() - before;
+            done = true;
+        },
+        [](std::exception_ptr e) {
+            if (e)
+                std::rethrow_exception(e);
+        });
+    io.run_for(20s);
+
+    proxy_io.stop();
+    proxy_thread.join();
+    watched_thread.store({});
+
+    ASSERT_TRUE(done);
+    EXPECT_EQ(allocations, 0u) << "over " << MEASURED_SESSIONS << " sessions";
+}
@@ -0,0 +1,142 @@
+#include "socks5/buffer_pool.hpp"
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using namespace socks5;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Runs `body` on a fresh thread, so it starts from an empty pool and its pool is torn down before returning
+template <typename Body>
+void on_new_thread(Body body) {
+    std::thread(body).join();
+}
+
+// Feeds `count` reads of `n` bytes that did not wait
+void read(AdaptiveBuffer& buffer, size_t n, unsigned count) {
+    for (unsigned i = 0; i < count; ++i)
+        buffer.record_read(n, 0ms);
+}
+
+} // namespace
+
+TEST(BufferPoolTest, SizesRoundUpToAClassAndClamp) {
+    EXPECT_EQ(BufferPool::size_class_for(1), 0u);
+    EXPECT_EQ(BufferPool::size_class_for(MIN_BUFFER_SIZE), 0u);
+    EXPECT_EQ(BufferPool::size_class_for(MIN_BUFFER_SIZE + 1), 1u);
+    EXPECT_EQ(BufferPool::size_class_for(MAX_BUFFER_SIZE), BUFFER_SIZE_CLASSES - 1);
+    EXPECT_EQ(BufferPool::size_class_for(4 * MAX_BUFFER_SIZE), BUFFER_SIZE_CLASSES - 1);
+
+    on_new_thread([] {
+        auto buffer = BufferPool::local().acquire(5000);
+        EXPECT_EQ(buffer.size(), 8 * 1024u);
+        EXPECT_EQ(buffer.span().size(), buffer.size());
+    });
+}
+
+TEST(BufferPoolTest, ReleasedBuffersAreReused) {
+    on_new_thread([] {
+        auto& pool = BufferPool::local();
+        auto first = pool.acquire(MIN_BUFFER_SIZE);
+        uint8_t* data = first.data();
+        first.reset();
+        EXPECT_FALSE(first);
+        EXPECT_EQ(pool.idle(0), 1u);
+
+        // Same class: the released buffer comes back. Another class leaves it waiting.
+        auto larger = pool.acquire(2 * MIN_BUFFER_SIZE);
+        EXPECT_EQ(pool.idle(0), 1u);
+        auto second = pool.acquire(MIN_BUFFER_SIZE);
+        EXPECT_EQ(second.data(), data);
+        EXPECT_EQ(pool.idle(0), 0u);
+
+        // Moving a handle hands over the buffer without returning it
+        PooledBuffer moved = std::move(second);
+        EXPECT_EQ(moved.data(), data);
+        EXPECT_EQ(pool.idle(0), 0u);
+    });
+}
+
+TEST(BufferPoolTest, IdleMemoryPerClassIsCapped) {
+    on_new_thread([] {
+        auto& pool = BufferPool::local();
+        constexpr size_t LARGEST = BUFFER_SIZE_CLASSES - 1;
+        constexpr size_t KEPT = MAX_IDLE_BYTES_PER_CLASS / MAX_BUFFER_SIZE;
+
+        std::vector<PooledBuffer> buffers;
+        for (size_t i = 0; i < KEPT + 4; ++i)
+            buffers.push_back(pool.acquire(MAX_BUFFER_SIZE));
+        buffers.clear();
+        EXPECT_EQ(pool.idle(LARGEST), KEPT);
+        EXPECT_EQ(pool.idle(0), 0u);
+    });
+}
+
+TEST(BufferPoolTest, BufferOutlivingItsThreadsPoolIsFreed) {
+    on_new_thread([] {
+        // Constructed before the pool, so destroyed after it at thread exit
+        thread_local PooledBuffer held;
+        held = BufferPool::local().acquire(MIN_BUFFER_SIZE);
+        EXPECT_TRUE(held);
+    });
+}
+
+TEST(AdaptiveBufferTest, GrowsAfterFullReadsUpToTheLargestClass) {
+    on_new_thread([] {
+        AdaptiveBuffer buffer;
+        EXPECT_EQ(buffer.get().size(), MIN_BUFFER_SIZE);
+
+        read(buffer, buffer.get().size(), AdaptiveBuffer::GROW_AFTER_FULL_READS - 1);
+        EXPECT_EQ(buffer.size_class(), 0u);
+        read(buffer, buffer.get().size(), 1);
+        EXPECT_EQ(buffer.size_class(), 1u);
+        EXPECT_EQ(buffer.get().size(), 2 * MIN_BUFFER_SIZE);
+
+        for (size_t i = 0; i < 2 * BUFFER_SIZE_CLASSES; ++i)
+            read(buffer, buffer.get().size(), AdaptiveBuffer::GROW_AFTER_FULL_READS);
+        EXPECT_EQ(buffer.size_class(), BUFFER_SIZE_CLASSES - 1);
+        EXPECT_EQ(buffer.get().size(), MAX_BUFFER_SIZE);
+    });
+}
+
+TEST(AdaptiveBufferTest, OtherReadsInterruptARunOfFullReads) {
+    on_new_thread([] {
+        AdaptiveBuffer buffer;
+        size_t capacity = buffer.get().size();
+        for (unsigned i = 0; i < 4 * AdaptiveBuffer::GROW_AFTER_FULL_READS; ++i) {
+            read(buffer, capacity, AdaptiveBuffer::GROW_AFTER_FULL_READS - 1);
+            read(buffer, capacity / 2, 1);
+        }
+        EXPECT_EQ(buffer.size_class(), 0u);
+    });
+}
+
+TEST(AdaptiveBufferTest, ShrinksAfterShortReadsAndWhenQuiet) {
+    on_new_thread([] {
+        AdaptiveBuffer buffer;
+        for (int i = 0; i < 3; ++i)
+            read(buffer, buffer.get().size(), AdaptiveBuffer::GROW_AFTER_FULL_READS);
+        ASSERT_EQ(buffer.size_class(), 3u);
+
+        // A run of reads under a quarter of the buffer steps down one class
+        size_t short_read = buffer.get().size() / 4 - 1;
+        read(buffer, short_read, AdaptiveBuffer::SHRINK_AFTER_SHORT_READS - 1);
+        EXPECT_EQ(buffer.size_class(), 3u);
+        read(buffer, short_read, 1);
+        EXPECT_EQ(buffer.size_class(), 2u);
+        EXPECT_EQ(buffer.get().size(), 4 * MIN_BUFFER_SIZE);
+
+        // A read that waited a quiet period drops straight to the smallest class
+        buffer.record_read(1, AdaptiveBuffer::QUIET_PERIOD);
+        EXPECT_EQ(buffer.size_class(), 0u);
+
+        // Released, and swapped for one of the new class on the next get()
+        buffer.release();
+        EXPECT_EQ(BufferPool::local().idle(2), 1u);
+        EXPECT_EQ(buffer.get().size(), MIN_BUFFER_SIZE);
+    });
+}
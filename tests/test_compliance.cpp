@@ -219,3 +219,44 @@ TEST_F(ComplianceTest, DomainNameConnect) {
 
     target_thread.join();
 }
+
+// 8. Greeting, request and early data in a single write
+TEST_F(ComplianceTest, PipelinedGreetingAndRequest) {
+    asio::io_context io;
+    asio::ip::tcp::acceptor target(io, {asio::ip::tcp::v4(), 0});
+    uint16_t target_port = target.local_endpoint().port();
+
+    std::thread target_thread([&]() {
+        try {
+            auto s = target.accept();
+            char buf[64];
+            size_t n = s.read_some(asio::buffer(buf));
+            asio::write(s, asio::buffer(buf, n));
+        } catch (...) {
+        }
+    });
+
+    asio::ip::tcp::socket socket(io);
+    socket.connect({asio::ip::make_address("127.0.0.1"), server_port_});
+
+    std::vector<uint8_t> req = {0x05, 0x01, 0x00,                      // Greeting: NO_AUTH
+                                0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1}; // CONNECT 127.0.0.1
+    req.push_back((target_port >> 8) & 0xFF);
+    req.push_back(target_port & 0xFF);
+    std::string early = "ping";
+    req.insert(req.end(), early.begin(), early.end());
+    asio::write(socket, asio::buffer(req));
+
+    uint8_t resp[12];
+    asio::read(socket, asio::buffer(resp));
+    EXPECT_EQ(resp[0], 0x05);
+    EXPECT_EQ(resp[1], 0x00); // NO_AUTH selected
+    EXPECT_EQ(resp[2], 0x05);
+    EXPECT_EQ(resp[3], 0x00); // SUCCEEDED
+
+    char echo[4];
+    asio::read(socket, asio::buffer(echo));
+    EXPECT_EQ(std::string(echo, 4), early);
+
+    target_thread.join();
+}
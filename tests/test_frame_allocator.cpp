@@ -0,0 +1,41 @@
+#include "socks5/frame_allocator.hpp"
+
+#include <gtest/gtest.h>
+#include <memory>
+
+using namespace socks5;
+
+TEST(FrameAllocatorTest, BlocksAreReusedWithinASizeClass) {
+    void* first = FrameAllocator::allocate(200);
+    FrameAllocator::deallocate(first, 200);
+    size_t kept = FrameAllocator::idle_bytes();
+
+    // Same 64-byte class, so the same block comes back
+    void* second = FrameAllocator::allocate(250);
+    EXPECT_EQ(second, first);
+    EXPECT_EQ(FrameAllocator::idle_bytes(), kept - 256);
+    FrameAllocator::deallocate(second, 250);
+    EXPECT_EQ(FrameAllocator::idle_bytes(), kept);
+}
+
+TEST(FrameAllocatorTest, LargeBlocksAreNotKept) {
+    size_t kept = FrameAllocator::idle_bytes();
+    void* large = FrameAllocator::allocate(FrameAllocator::MAX_RECYCLED_SIZE + 1);
+    FrameAllocator::deallocate(large, FrameAllocator::MAX_RECYCLED_SIZE + 1);
+    EXPECT_EQ(FrameAllocator::idle_bytes(), kept);
+}
+
+TEST(FrameAllocatorTest, SharedStateIsRecycled) {
+    struct State {
+        int value[20];
+    };
+    auto first = std::allocate_shared<State>(RecyclingAllocator<State>());
+    const void* address = first.get();
+    first.reset();
+    size_t kept = FrameAllocator::idle_bytes();
+
+    // The control block and State come back as one block of the same size
+    auto second = std::allocate_shared<State>(RecyclingAllocator<State>());
+    EXPECT_EQ(second.get(), address);
+    EXPECT_LT(FrameAllocator::idle_bytes(), kept);
+}
@@ -0,0 +1,114 @@
+#include "asio_config.hpp"
+#include "socks5/happy_eyeballs.hpp"
+
+#include <array>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <optional>
+#include <span>
+#include <vector>
+
+using namespace socks5;
+using namespace std::chrono_literals;
+
+TEST(HappyEyeballsTest, InterleavesFamiliesKeepingResolverOrder) {
+    auto v4a = asio::ip::tcp::endpoint(asio::ip::make_address("192.0.2.1"), 80);
+    auto v4b = asio::ip::tcp::endpoint(asio::ip::make_address("192.0.2.2"), 80);
+    auto v6a = asio::ip::tcp::endpoint(asio::ip::make_address("2001:db8::1"), 80);
+    auto v6b = asio::ip::tcp::endpoint(asio::ip::make_address("2001:db8::2"), 80);
+
+    std::vector<asio::ip::tcp::endpoint> endpoints{v6a, v6b, v4a, v4b};
+    interleave_families(endpoints, true);
+    EXPECT_EQ(endpoints, (std::vector{v6a, v4a, v6b, v4b}));
+
+    interleave_families(endpoints, false);
+    EXPECT_EQ(endpoints, (std::vector{v4a, v6a, v4b, v6b}));
+}
+
+TEST(HappyEyeballsTest, HistoryPrefersTheFasterFamily) {
+    ConnectHistory history;
+    auto v4 = asio::ip::make_address("192.0.2.1");
+    auto v6 = asio::ip::make_address("2001:db8::1");
+
+    EXPECT_FALSE(history.prefers_v6("example.test").has_value());
+
+    history.record_success("example.test", v4, 5ms);
+    EXPECT_EQ(history.prefers_v6("example.test"), false);
+
+    history.record_success("example.test", v6, 1ms);
+    EXPECT_EQ(history.prefers_v6("example.test"), true);
+
+    history.record_failure("example.test", v6, 10s);
+    EXPECT_EQ(history.prefers_v6("example.test"), false);
+}
+
+TEST(HappyEyeballsTest, StalledAddressDoesNotDelayTheNext) {
+    asio::io_context io;
+    asio::ip::tcp::acceptor acceptor(io, {asio::ip::make_address("127.0.0.1"), 0});
+    auto live = acceptor.local_endpoint();
+
+    // Non-routable: the SYN goes nowhere, so only the staggered second attempt can win
+    auto blackhole = asio::ip::tcp::endpoint(asio::ip::make_address("10.255.255.1"), live.port());
+
+    std::array endpoints{blackhole, live};
+    ConnectHistory history;
+    std::optional<std::expected<asio::ip::tcp::socket, std::error_code>> result;
+    auto started = std::chrono::steady_clock::now();
+    asio::co_spawn(
+        io,
+        [&]() -> asio::awaitable<void> {
+            result = co_await happy_eyeballs_connect(endpoints, {.attempt_delay = 100ms, .timeout = 5s}, &history,
+                                                     "dual.test");
+        },
+        asio::detached);
+    acceptor.async_accept([](asio::error_code, asio::ip::tcp::socket) {});
+
+    io.run_for(3s);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_TRUE(result->has_value()) << result->error().message();
+    EXPECT_EQ((*result)->remote_endpoint(), live);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, 2s);
+}
+
+TEST(HappyEyeballsTest, ReportsFailureWhenEveryAddressRefuses) {
+    asio::io_context io;
+    asio::ip::tcp::endpoint closed;
+    {
+        // Grab a free port, then release it so connects are refused
+        asio::ip::tcp::acceptor acceptor(io, {asio::ip::make_address("127.0.0.1"), 0});
+        closed = acceptor.local_endpoint();
+    }
+
+    std::array endpoints{closed, closed};
+    std::optional<std::expected<asio::ip::tcp::socket, std::error_code>> result;
+    asio::co_spawn(
+        io, [&]() -> asio::awaitable<void> { result = co_await happy_eyeballs_connect(endpoints, {}); },
+        asio::detached);
+
+    io.run_for(3s);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_FALSE(result->has_value());
+    EXPECT_EQ(result->error(), asio::error::connection_refused);
+}
+
+TEST(HappyEyeballsTest, UnnamedDestinationsStayOutOfHistory) {
+    asio::io_context io;
+    asio::ip::tcp::acceptor acceptor(io, {asio::ip::make_address("127.0.0.1"), 0});
+    auto live = acceptor.local_endpoint();
+
+    // IP-literal CONNECTs have no name; one shared "" entry would steer every literal by every other's timings
+    ConnectHistory history;
+    std::optional<std::expected<asio::ip::tcp::socket, std::error_code>> result;
+    asio::co_spawn(
+        io,
+        [&]() -> asio::awaitable<void> {
+            result = co_await happy_eyeballs_connect(std::span(&live, 1), {}, &history, "");
+        },
+        asio::detached);
+    acceptor.async_accept([](asio::error_code, asio::ip::tcp::socket) {});
+
+    io.run_for(3s);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_TRUE(result->has_value()) << result->error().message();
+    EXPECT_FALSE(history.prefers_v6("").has_value());
+}
@@ -0,0 +1,119 @@
+#include "asio_config.hpp"
+#include "socks5/metrics.hpp"
+#include "socks5/server.hpp"
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace socks5;
+
+TEST(MetricsTest, ThreadCountersAreMergedOnCollect) {
+    auto before = Metrics::collect();
+
+    // Exited threads are folded into the totals, live ones are read in place
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([] {
+            auto& metrics = Metrics::local();
+            for (int i = 0; i < 1000; ++i)
+                metrics.bytes(Direction::UPSTREAM).add(10);
+            metrics.dropped(UdpDrop::FRAGMENTED).add();
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    Metrics::local().timeout(TimeoutPhase::IDLE).add(3);
+
+    auto after = Metrics::collect();
+    EXPECT_EQ(after.bytes(Direction::UPSTREAM) - before.bytes(Direction::UPSTREAM), 40000u);
+    EXPECT_EQ(after.dropped(UdpDrop::FRAGMENTED) - before.dropped(UdpDrop::FRAGMENTED), 4u);
+    EXPECT_EQ(after.timeout(TimeoutPhase::IDLE) - before.timeout(TimeoutPhase::IDLE), 3u);
+}
+
+TEST(MetricsTest, HistogramBucketsStayWithinAnEighth) {
+    for (uint64_t value : {0ull, 7ull, 8ull, 15ull, 16ull, 17ull, 1000ull, 123456ull, 1ull << 35}) {
+        size_t index = Histogram::bucket(value);
+        EXPECT_GE(Histogram::highest(index), value);
+        EXPECT_LE(Histogram::highest(index) - value, value / Histogram::SUB_BUCKETS);
+        if (index > 0)
+            EXPECT_LT(Histogram::highest(index - 1), value);
+    }
+    EXPECT_EQ(Histogram::bucket(~0ull), Histogram::BUCKETS - 1);
+}
+
+TEST(MetricsTest, HistogramPercentilesMergeAcrossThreads) {
+    auto before = Metrics::collect().phase(HandshakePhase::CONNECT);
+
+    // 500 fast connects on one thread and a single slow one on another
+    std::thread fast([] {
+        for (int i = 0; i < 500; ++i)
+            Metrics::local().phase(HandshakePhase::CONNECT).record(std::chrono::microseconds(100));
+    });
+    std::thread slow([] { Metrics::local().phase(HandshakePhase::CONNECT).record(std::chrono::milliseconds(50)); });
+    fast.join();
+    slow.join();
+
+    Histogram delta = Metrics::collect().phase(HandshakePhase::CONNECT);
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i)
+        delta.counts[i] -= before.counts[i];
+    auto latency = LatencySummary::of(delta);
+    EXPECT_EQ(latency.count, 501u);
+    EXPECT_GE(latency.p50.count(), 100);
+    EXPECT_LE(latency.p50.count(), 112);
+    EXPECT_LE(latency.p99.count(), 112);
+    EXPECT_GE(latency.p999.count(), 50000);
+    EXPECT_LE(latency.p999.count(), 50000 + 50000 / 8);
+}
+
+TEST(MetricsTest, RendersPrometheusText) {
+    MetricsSnapshot snapshot;
+    snapshot.sessions_accepted = 5;
+    snapshot.sessions_closed = 3;
+    snapshot.failed(static_cast<uint8_t>(Reply::HOST_UNREACHABLE)) = 2;
+    snapshot.forwarded(Direction::DOWNSTREAM) = 7;
+    snapshot.resolver_misses = 1;
+
+    auto text = render_prometheus(snapshot);
+    EXPECT_NE(text.find("# TYPE socks5_sessions_accepted_total counter\nsocks5_sessions_accepted_total 5\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("socks5_sessions_active 2\n"), std::string::npos);
+    EXPECT_NE(text.find("socks5_sessions_failed_total{reply=\"host_unreachable\"} 2\n"), std::string::npos);
+    EXPECT_EQ(text.find("reply=\"succeeded\""), std::string::npos);
+    EXPECT_NE(text.find("socks5_udp_datagrams_forwarded_total{direction=\"downstream\"} 7\n"), std::string::npos);
+    EXPECT_NE(text.find("socks5_resolver_cache_misses_total 1\n"), std::string::npos);
+    EXPECT_NE(text.find("socks5_handshake_phase_seconds_count{phase=\"connect\"} 0\n"), std::string::npos);
+}
+
+TEST(MetricsTest, ServedOverHttp) {
+    asio::io_context server_io;
+    Server server(server_io, 0, "127.0.0.1", {.metrics_port = 0});
+    server.start();
+    std::thread server_thread([&] {
+        auto work_guard = asio::make_work_guard(server_io);
+        server_io.run();
+    });
+    ASSERT_NE(server.metrics_port(), 0);
+
+    auto get = [&](const std::string& path) {
+        asio::io_context io;
+        asio::ip::tcp::socket socket(io);
+        socket.connect({asio::ip::make_address("127.0.0.1"), server.metrics_port()});
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        asio::write(socket, asio::buffer(request));
+        std::string response;
+        asio::error_code ec;
+        asio::read(socket, asio::dynamic_buffer(response), ec);
+        return response;
+    };
+
+    auto metrics = get("/metrics");
+    EXPECT_TRUE(metrics.starts_with("HTTP/1.1 200 OK\r\n"));
+    EXPECT_NE(metrics.find("socks5_relay_bytes_total{direction=\"upstream\"}"), std::string::npos);
+    EXPECT_TRUE(get("/other").starts_with("HTTP/1.1 404 Not Found\r\n"));
+
+    server_io.stop();
+    server_thread.join();
+}
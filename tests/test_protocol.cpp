@@ -0,0 +1,125 @@
+#include "asio_config.hpp"
+#include "socks5/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+using namespace socks5;
+
+namespace {
+
+const std::vector<uint8_t> DOMAIN_REQUEST = {0x05, 0x01, 0x00, 0x03, 11,  'e', 'x', 'a', 'm',
+                                             'p',  'l',  'e',  '.',  'c', 'o', 'm', 0x01, 0xBB};
+
+} // namespace
+
+TEST(ProtocolTest, DecodesRequestOnlyOnceComplete) {
+    for (size_t n = 0; n < DOMAIN_REQUEST.size(); ++n) {
+        auto partial = decode_request({DOMAIN_REQUEST.data(), n});
+        ASSERT_TRUE(partial.has_value());
+        EXPECT_EQ(partial->size, 0u);
+    }
+
+    // Bytes pipelined behind the request are not part of it
+    auto pipelined = DOMAIN_REQUEST;
+    pipelined.insert(pipelined.end(), {'G', 'E', 'T'});
+    auto request = decode_request(pipelined);
+    ASSERT_TRUE(request.has_value());
+    EXPECT_EQ(request->size, DOMAIN_REQUEST.size());
+    EXPECT_EQ(request->command, Command::CONNECT);
+    EXPECT_EQ(request->address.type(), AddressType::DOMAIN_NAME);
+    EXPECT_EQ(request->address.domain(), "example.com");
+    EXPECT_EQ(request->address.port(), 443);
+}
+
+TEST(ProtocolTest, RejectsBadVersionAndAddressType) {
+    std::vector<uint8_t> version = {0x04, 0x01, 0x00, 0x01};
+    EXPECT_EQ(decode_request(version).error(), Error::INVALID_VERSION);
+    std::vector<uint8_t> atyp = {0x05, 0x01, 0x00, 0x05};
+    EXPECT_EQ(decode_request(atyp).error(), Error::UNSUPPORTED_ADDRESS_TYPE);
+}
+
+TEST(ProtocolTest, EncodedRequestsDecodeToTheSameAddress) {
+    std::array<uint8_t, MAX_MESSAGE_SIZE> out;
+    for (std::string host : {"example.com", "192.0.2.7", "2001:db8::1"}) {
+        auto address = Address::of(host, 8080);
+        ASSERT_TRUE(address.has_value());
+        size_t size = encode(Request{Command::UDP_ASSOCIATE, *address}, out);
+        ASSERT_GT(size, 0u);
+
+        auto request = decode_request({out.data(), size});
+        ASSERT_TRUE(request.has_value());
+        EXPECT_EQ(request->size, size);
+        EXPECT_EQ(request->command, Command::UDP_ASSOCIATE);
+        EXPECT_EQ(request->address.type(), address->type);
+        EXPECT_EQ(request->address.port(), 8080);
+        if (address->type == AddressType::DOMAIN_NAME)
+            EXPECT_EQ(request->address.domain(), host);
+        else
+            EXPECT_EQ(request->address.ip(), asio::ip::make_address(host));
+    }
+
+    size_t size = encode(Request{Command::CONNECT, *Address::of(std::string("example.com"), 443)}, out);
+    EXPECT_EQ(std::vector<uint8_t>(out.begin(), out.begin() + size), DOMAIN_REQUEST);
+}
+
+TEST(ProtocolTest, EncodingNeedsRoomAndShortNames) {
+    std::array<uint8_t, 9> small;
+    auto address = Address::of(asio::ip::make_address("192.0.2.7"), 80);
+    EXPECT_EQ(encode(Response{Reply::SUCCEEDED, address}, small), 0u);
+    std::array<uint8_t, 10> exact;
+    EXPECT_EQ(encode(Response{Reply::SUCCEEDED, address}, exact), 10u);
+
+    EXPECT_TRUE(Address::of(std::string(255, 'a'), 80).has_value());
+    EXPECT_EQ(Address::of(std::string(256, 'a'), 80).error(), Error::INVALID_FORMAT);
+}
+
+TEST(ProtocolTest, FixedRepliesAreConstant) {
+    constexpr auto refused = failure_reply(Reply::CONNECTION_REFUSED);
+    static_assert(refused == std::array<uint8_t, 10>{0x05, 0x05, 0x00, 0x01, 0, 0, 0, 0, 0, 0});
+    constexpr auto selected = method_selection(AuthMethod::NO_AUTH);
+    static_assert(selected == std::array<uint8_t, 2>{0x05, 0x00});
+
+    auto reply = decode_reply(refused);
+    ASSERT_TRUE(reply.has_value());
+    EXPECT_EQ(reply->reply, Reply::CONNECTION_REFUSED);
+    EXPECT_EQ(reply->size, refused.size());
+}
+
+TEST(ProtocolTest, SuccessRepliesMatchEncodedResponses) {
+    for (const char* host : {"192.0.2.7", "2001:db8::1"}) {
+        auto ip = asio::ip::make_address(host);
+        std::array<uint8_t, MAX_MESSAGE_SIZE> expected;
+        size_t expected_size = encode(Response{Reply::SUCCEEDED, Address::of(ip, 1080)}, expected);
+        std::array<uint8_t, 3 + MAX_IP_ADDRESS_SIZE> out;
+        size_t size = encode_success_reply(ip, 1080, out);
+        ASSERT_EQ(size, expected_size);
+        EXPECT_TRUE(std::equal(out.begin(), out.begin() + size, expected.begin()));
+    }
+
+    std::array<uint8_t, 9> small;
+    EXPECT_EQ(encode_success_reply(asio::ip::make_address("192.0.2.7"), 80, small), 0u);
+}
+
+TEST(ProtocolTest, UdpHeadersRoundTrip) {
+    asio::ip::udp::endpoint sender(asio::ip::make_address("2001:db8::53"), 53);
+    std::vector<uint8_t> datagram(3 + MAX_IP_ADDRESS_SIZE);
+    ASSERT_EQ(encode_udp_header(sender, datagram), datagram.size());
+    datagram.insert(datagram.end(), {'d', 'n', 's'});
+
+    auto header = decode_udp_header(datagram);
+    ASSERT_TRUE(header.has_value());
+    EXPECT_EQ(header->fragment, 0);
+    EXPECT_EQ(header->size, 3 + MAX_IP_ADDRESS_SIZE);
+    EXPECT_EQ(header->address.ip(), sender.address());
+    EXPECT_EQ(header->address.port(), 53);
+
+    // A datagram is whole: one cut short is malformed, not incomplete
+    datagram.resize(10);
+    EXPECT_EQ(decode_udp_header(datagram).error(), Error::INVALID_FORMAT);
+    datagram[0] = 0x01;
+    EXPECT_FALSE(decode_udp_header(datagram).has_value());
+}
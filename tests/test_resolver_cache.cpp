@@ -0,0 +1,217 @@
+#include "asio_config.hpp"
+#include "socks5/resolver_cache.hpp"
+
+#include <chrono>
+#include <future>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace socks5;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Answers from a fixed table. Lookups stay pending until release() unless `immediate` is set.
+class StubResolver : public ResolverBackend {
+  public:
+    void lookup(const std::string& host, Callback done) override {
+        ++lookups[host];
+        if (immediate)
+            done(answer_for(host));
+        else
+            pending.emplace_back(host, std::move(done));
+    }
+
+    void release() {
+        auto queries = std::move(pending);
+        pending.clear();
+        for (auto& [host, done] : queries)
+            done(answer_for(host));
+    }
+
+    ResolveAnswer answer_for(const std::string& host) const {
+        auto it = table.find(host);
+        if (it == table.end())
+            return {asio::error::host_not_found, {}, {}};
+        return it->second;
+    }
+
+    bool immediate = false;
+    std::map<std::string, ResolveAnswer> table;
+    std::map<std::string, int> lookups;
+    std::vector<std::pair<std::string, Callback>> pending;
+};
+
+struct Result {
+    bool done = false;
+    std::error_code ec;
+    ResolverCache::Addresses addresses;
+};
+
+auto record(Result& result) {
+    return [&result](std::error_code ec, ResolverCache::Addresses addresses) {
+        result.done = true;
+        result.ec = ec;
+        result.addresses = std::move(addresses);
+    };
+}
+
+} // namespace
+
+TEST(ResolverCacheTest, ConcurrentLookupsShareOneQuery) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->table["example.test"] = {{}, {asio::ip::make_address("192.0.2.1")}, 30s};
+    auto cache = std::make_shared<ResolverCache>(stub);
+
+    std::vector<Result> results(3);
+    for (auto& result : results)
+        cache->async_resolve("example.test", asio::bind_executor(io, record(result)));
+
+    EXPECT_EQ(stub->lookups["example.test"], 1);
+    stub->release();
+    io.run();
+
+    for (auto& result : results) {
+        ASSERT_TRUE(result.done);
+        EXPECT_FALSE(result.ec);
+        ASSERT_TRUE(result.addresses);
+        EXPECT_EQ(result.addresses->front(), asio::ip::make_address("192.0.2.1"));
+    }
+    EXPECT_EQ(results[0].addresses, results[2].addresses); // One shared answer
+
+    auto stats = cache->stats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.coalesced, 2u);
+}
+
+TEST(ResolverCacheTest, AnswersAreServedUntilTheirTtlExpires) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->immediate = true;
+    stub->table["short.test"] = {{}, {asio::ip::make_address("192.0.2.2")}, 1s};
+    auto cache = std::make_shared<ResolverCache>(stub);
+
+    Result first;
+    cache->async_resolve("short.test", asio::bind_executor(io, record(first)));
+    io.run();
+    ASSERT_TRUE(first.done);
+
+    auto cached = cache->try_get("short.test");
+    ASSERT_TRUE(cached.has_value());
+    ASSERT_TRUE(cached->has_value());
+    EXPECT_EQ((**cached)->front(), asio::ip::make_address("192.0.2.2"));
+    EXPECT_EQ(stub->lookups["short.test"], 1);
+
+    std::this_thread::sleep_for(1100ms);
+    EXPECT_FALSE(cache->try_get("short.test").has_value());
+
+    Result second;
+    cache->async_resolve("short.test", asio::bind_executor(io, record(second)));
+    io.restart();
+    io.run();
+    EXPECT_TRUE(second.done);
+    EXPECT_EQ(stub->lookups["short.test"], 2);
+}
+
+TEST(ResolverCacheTest, NxdomainIsCachedBriefly) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->immediate = true;
+    auto cache = std::make_shared<ResolverCache>(stub, ResolverCacheOptions{.negative_ttl = 1s});
+
+    Result first;
+    cache->async_resolve("missing.test", asio::bind_executor(io, record(first)));
+    io.run();
+    ASSERT_TRUE(first.done);
+    EXPECT_EQ(first.ec, asio::error::host_not_found);
+
+    auto cached = cache->try_get("missing.test");
+    ASSERT_TRUE(cached.has_value());
+    EXPECT_FALSE(cached->has_value());
+    EXPECT_EQ(cached->error(), asio::error::host_not_found);
+    EXPECT_EQ(stub->lookups["missing.test"], 1);
+    EXPECT_EQ(cache->stats().negative_hits, 1u);
+
+    std::this_thread::sleep_for(1100ms);
+    EXPECT_FALSE(cache->try_get("missing.test").has_value());
+}
+
+TEST(ResolverCacheTest, TransientFailuresAreNotCached) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->immediate = true;
+    stub->table["flaky.test"] = {asio::error::host_not_found_try_again, {}, {}};
+    auto cache = std::make_shared<ResolverCache>(stub);
+
+    Result first;
+    cache->async_resolve("flaky.test", asio::bind_executor(io, record(first)));
+    io.run();
+    EXPECT_EQ(first.ec, asio::error::host_not_found_try_again);
+    EXPECT_FALSE(cache->try_get("flaky.test").has_value());
+}
+
+TEST(ResolverCacheTest, CancelledWaiterLeavesQueryRunning) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->table["slow.test"] = {{}, {asio::ip::make_address("192.0.2.3")}, 30s};
+    auto cache = std::make_shared<ResolverCache>(stub);
+
+    asio::cancellation_signal signal;
+    Result cancelled;
+    Result patient;
+    cache->async_resolve("slow.test",
+                         asio::bind_cancellation_slot(signal.slot(), asio::bind_executor(io, record(cancelled))));
+    cache->async_resolve("slow.test", asio::bind_executor(io, record(patient)));
+
+    signal.emit(asio::cancellation_type::terminal);
+    io.run();
+    ASSERT_TRUE(cancelled.done);
+    EXPECT_EQ(cancelled.ec, asio::error::operation_aborted);
+    EXPECT_FALSE(patient.done);
+
+    stub->release();
+    io.restart();
+    io.run();
+    ASSERT_TRUE(patient.done);
+    EXPECT_FALSE(patient.ec);
+    EXPECT_TRUE(cache->try_get("slow.test").has_value());
+}
+
+TEST(ResolverCacheTest, FullCacheEvictsTheAnswerClosestToExpiry) {
+    asio::io_context io;
+    auto stub = std::make_shared<StubResolver>();
+    stub->immediate = true;
+    stub->table["long.test"] = {{}, {asio::ip::make_address("192.0.2.4")}, 300s};
+    stub->table["short.test"] = {{}, {asio::ip::make_address("192.0.2.5")}, 10s};
+    stub->table["new.test"] = {{}, {asio::ip::make_address("192.0.2.6")}, 300s};
+    auto cache = std::make_shared<ResolverCache>(stub, ResolverCacheOptions{.max_entries = 2});
+
+    for (const char* host : {"long.test", "short.test", "new.test"}) {
+        Result result;
+        cache->async_resolve(host, asio::bind_executor(io, record(result)));
+        io.restart();
+        io.run();
+        ASSERT_TRUE(result.done);
+    }
+    EXPECT_TRUE(cache->try_get("long.test").has_value());
+    EXPECT_FALSE(cache->try_get("short.test").has_value());
+    EXPECT_TRUE(cache->try_get("new.test").has_value());
+}
+
+TEST(SystemResolverTest, AnswersEveryConcurrentLookup) {
+    SystemResolver resolver(4);
+    std::vector<std::promise<ResolveAnswer>> answers(16);
+    for (auto& answer : answers)
+        resolver.lookup("localhost", [&answer](ResolveAnswer result) { answer.set_value(std::move(result)); });
+    for (auto& answer : answers) {
+        auto future = answer.get_future();
+        ASSERT_EQ(future.wait_for(10s), std::future_status::ready);
+        auto result = future.get();
+        EXPECT_FALSE(result.error) << result.error.message();
+        EXPECT_FALSE(result.addresses.empty());
+    }
+}
@@ -0,0 +1,78 @@
+#include "asio_config.hpp"
+#include "socks5/timing_wheel.hpp"
+
+#include <chrono>
+#include <gtest/gtest.h>
+
+using namespace socks5;
+using namespace std::chrono_literals;
+
+namespace {
+
+void count_expiry(void* context) {
+    ++*static_cast<int*>(context);
+}
+
+} // namespace
+
+TEST(TimingWheelTest, FiresAfterTimeout) {
+    asio::io_context io;
+    TimingWheel wheel(io.get_executor());
+
+    int fired = 0;
+    Deadline deadline;
+    auto armed_at = std::chrono::steady_clock::now();
+    deadline.arm(wheel, 300ms, &count_expiry, &fired);
+
+    io.run_for(200ms);
+    EXPECT_EQ(fired, 0);
+
+    io.restart();
+    io.run_for(400ms);
+    EXPECT_EQ(fired, 1);
+    EXPECT_TRUE(deadline.expired());
+    EXPECT_FALSE(deadline.armed());
+    EXPECT_GE(std::chrono::steady_clock::now() - armed_at, 300ms);
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimingWheelTest, TouchPostponesExpiry) {
+    asio::io_context io;
+    TimingWheel wheel(io.get_executor());
+
+    int fired = 0;
+    Deadline deadline;
+    deadline.arm(wheel, 300ms, &count_expiry, &fired);
+
+    // Keep the deadline busy well past its original expiry
+    for (int i = 0; i < 5; ++i) {
+        io.restart();
+        io.run_for(150ms);
+        deadline.touch();
+    }
+    EXPECT_EQ(fired, 0);
+
+    io.restart();
+    io.run_for(600ms);
+    EXPECT_EQ(fired, 1);
+}
+
+TEST(TimingWheelTest, CancelledDeadlineNeverFires) {
+    asio::io_context io;
+    TimingWheel wheel(io.get_executor());
+
+    int fired = 0;
+    {
+        // Destruction unlinks the deadline
+        Deadline deadline;
+        deadline.arm(wheel, 100ms, &count_expiry, &fired);
+    }
+    Deadline deadline;
+    deadline.arm(wheel, 100ms, &count_expiry, &fired);
+    deadline.cancel();
+    EXPECT_FALSE(deadline.armed());
+
+    io.run_for(300ms);
+    EXPECT_EQ(fired, 0);
+    EXPECT_EQ(wheel.size(), 0u);
+}
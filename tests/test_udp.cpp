@@ -1,10 +1,21 @@
 #include "asio_config.hpp"
+#include "socks5/buffer_pool.hpp"
 #include "socks5/protocol.hpp"
+#include "socks5/resolver_cache.hpp"
 #include "socks5/server.hpp"
+#include "socks5/udp_batch.hpp"
+#include "socks5/udp_nat.hpp"
+#include "socks5/udp_pending.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <future>
 #include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <utility>
+#include <vector>
 
 using namespace socks5;
 
@@ -123,3 +134,686 @@ TEST_F(UdpTest, UdpAssociateAndEcho) {
 
     target_thread.join();
 }
+
+// Larger than a receive slot without GRO: relayed whole both ways, not dropped as truncated
+TEST_F(UdpTest, RelaysDatagramsLargerThanASlot) {
+    asio::io_context io;
+    asio::ip::tcp::socket socket(io);
+    socket.connect({asio::ip::make_address("127.0.0.1"), server_port_});
+    uint8_t handshake[] = {0x05, 0x01, 0x00};
+    asio::write(socket, asio::buffer(handshake));
+    uint8_t method[2];
+    asio::read(socket, asio::buffer(method));
+    uint8_t request[] = {0x05, 0x03, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+    asio::write(socket, asio::buffer(request));
+    uint8_t resp[10];
+    asio::read(socket, asio::buffer(resp));
+    ASSERT_EQ(resp[1], 0x00);
+    uint16_t relay_port = static_cast<uint16_t>((resp[8] << 8) | resp[9]);
+    asio::ip::udp::endpoint relay_ep(asio::ip::make_address("127.0.0.1"), relay_port);
+
+    asio::ip::udp::socket target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    std::thread target_thread([&] {
+        std::vector<uint8_t> buf(64 * 1024);
+        asio::ip::udp::endpoint sender;
+        size_t n = target.receive_from(asio::buffer(buf), sender);
+        target.send_to(asio::buffer(buf.data(), n), sender);
+    });
+
+    std::vector<uint8_t> payload(20000);
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] = static_cast<uint8_t>(i * 7);
+    std::vector<uint8_t> packet = {0x00, 0x00, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(target_port >> 8),
+                                   static_cast<uint8_t>(target_port & 0xFF)};
+    packet.insert(packet.end(), payload.begin(), payload.end());
+    asio::ip::udp::socket client(io, {asio::ip::make_address("127.0.0.1"), 0});
+    client.send_to(asio::buffer(packet), relay_ep);
+
+    std::vector<uint8_t> reply(64 * 1024);
+    asio::ip::udp::endpoint sender;
+    size_t n = client.receive_from(asio::buffer(reply), sender);
+    ASSERT_EQ(n, 10 + payload.size());
+    EXPECT_TRUE(std::equal(payload.begin(), payload.end(), reply.begin() + 10));
+    target_thread.join();
+}
+
+TEST(UdpBatchTest, ReceivesAndSendsInBatches) {
+    asio::io_context io;
+    asio::ip::udp::socket relay(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket peer(io, {asio::ip::make_address("127.0.0.1"), 0});
+
+    constexpr size_t COUNT = 5;
+    for (size_t i = 0; i < COUNT; ++i) {
+        std::string msg = "datagram " + std::to_string(i);
+        peer.send_to(asio::buffer(msg), relay.local_endpoint());
+    }
+    relay.wait(asio::socket_base::wait_read);
+
+    UdpBatch batch(relay, false);
+    size_t received = 0;
+    for (int attempt = 0; attempt < 10 && received < COUNT; ++attempt) {
+        auto result = batch.receive(relay);
+        ASSERT_TRUE(result.has_value()) << result.error().message();
+        // Echo each one back with a one-byte header
+        for (size_t i = 0; i < *result; ++i) {
+            EXPECT_EQ(batch.sender(i), peer.local_endpoint());
+            EXPECT_FALSE(batch.truncated(i));
+            uint8_t header[] = {'>'};
+            batch.queue(header, batch.data(i), batch.sender(i));
+        }
+        while (batch.has_queued())
+            ASSERT_TRUE(batch.send(relay).has_value());
+        received += *result;
+        if (received < COUNT)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(received, COUNT);
+
+    for (size_t i = 0; i < COUNT; ++i) {
+        char reply[64];
+        asio::ip::udp::endpoint sender;
+        size_t n = peer.receive_from(asio::buffer(reply), sender);
+        EXPECT_EQ(std::string(reply, n), ">datagram " + std::to_string(i));
+        EXPECT_EQ(sender, relay.local_endpoint());
+    }
+}
+
+TEST(UdpBatchTest, SameDestinationRunSurvivesOffload) {
+    asio::io_context io;
+    asio::ip::udp::socket relay(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket peer(io, {asio::ip::make_address("127.0.0.1"), 0});
+
+    // Equal-sized datagrams to one destination plus a short tail: a single UDP_SEGMENT send where supported
+    UdpBatch batch(relay, true);
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 8; ++i)
+        payloads.push_back(std::string(1000, static_cast<char>('a' + i)));
+    payloads.push_back("tail");
+    for (const auto& payload : payloads) {
+        uint8_t header[] = {'#', '#'};
+        batch.queue(header, {reinterpret_cast<const uint8_t*>(payload.data()), payload.size()},
+                    peer.local_endpoint());
+    }
+    while (batch.has_queued())
+        ASSERT_TRUE(batch.send(relay).has_value());
+
+    // Whatever the kernel did on the way, the peer sees the original datagrams in order
+    for (const auto& payload : payloads) {
+        char reply[2048];
+        asio::ip::udp::endpoint sender;
+        size_t n = peer.receive_from(asio::buffer(reply), sender);
+        EXPECT_EQ(std::string(reply, n), "##" + payload);
+    }
+}
+
+TEST(UdpBatchTest, LargeDatagramsSwitchToLargeSlots) {
+    asio::io_context io;
+    asio::ip::udp::socket relay(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket peer(io, {asio::ip::make_address("127.0.0.1"), 0});
+    relay.set_option(asio::socket_base::receive_buffer_size(1024 * 1024));
+    UdpBatch batch(relay, false);
+
+    auto receive_all = [&](size_t count) {
+        std::vector<std::pair<size_t, bool>> got;
+        for (int attempt = 0; attempt < 50 && got.size() < count; ++attempt) {
+            relay.wait(asio::socket_base::wait_read);
+            auto result = batch.receive(relay);
+            EXPECT_TRUE(result.has_value());
+            for (size_t i = 0; result && i < *result; ++i)
+                got.emplace_back(batch.data(i).size(), batch.truncated(i));
+        }
+        return got;
+    };
+
+    // The first slot takes any datagram, even while the rest are small
+    std::vector<uint8_t> large(20000, 'L');
+    peer.send_to(asio::buffer(large), relay.local_endpoint());
+    auto first = receive_all(1);
+    ASSERT_EQ(first.size(), 1u);
+    EXPECT_EQ(first[0], std::pair(large.size(), false));
+
+    // Having seen one, every slot is large
+    for (int i = 0; i < 3; ++i)
+        peer.send_to(asio::buffer(large), relay.local_endpoint());
+    auto burst = receive_all(3);
+    ASSERT_EQ(burst.size(), 3u);
+    for (const auto& datagram : burst)
+        EXPECT_EQ(datagram, std::pair(large.size(), false));
+}
+
+TEST(UdpBatchTest, HoldsPooledBuffersOnlyWhileBusy) {
+    asio::io_context io;
+    asio::ip::udp::socket relay(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket peer(io, {asio::ip::make_address("127.0.0.1"), 0});
+
+    // A fresh thread has an empty pool, so its free lists show exactly what the batch handed back
+    std::thread([&] {
+        auto& pool = BufferPool::local();
+        auto idle = [&] {
+            size_t total = 0;
+            for (size_t c = 0; c < BUFFER_SIZE_CLASSES; ++c)
+                total += pool.idle(c);
+            return total;
+        };
+        constexpr size_t SLOTS = BUFFER_SIZE_CLASSES - 1;
+
+        UdpBatch batch(relay, false);
+        for (int round = 0; round < 2; ++round) {
+            peer.send_to(asio::buffer(std::string("ping")), relay.local_endpoint());
+            relay.wait(asio::socket_base::wait_read);
+            auto received = batch.receive(relay);
+            ASSERT_TRUE(received.has_value());
+            ASSERT_EQ(*received, 1u);
+            // The second round takes the slots the first one returned
+            EXPECT_EQ(pool.idle(SLOTS), 0u);
+
+            ASSERT_TRUE(batch.queue({}, batch.data(0), batch.sender(0)));
+            size_t before_send = idle();
+            while (batch.has_queued())
+                ASSERT_TRUE(batch.send(relay).has_value());
+            // An empty queue has given its storage back
+            EXPECT_GT(idle(), before_send);
+
+            batch.release();
+            EXPECT_EQ(pool.idle(SLOTS), 1u);
+        }
+    }).join();
+
+    for (int round = 0; round < 2; ++round) {
+        char reply[16];
+        asio::ip::udp::endpoint sender;
+        size_t n = peer.receive_from(asio::buffer(reply), sender);
+        EXPECT_EQ(std::string(reply, n), "ping");
+    }
+}
+
+TEST(UdpBatchTest, QueueStopsAtCapacityAndKeepsEveryHeader) {
+    asio::io_context io;
+    asio::ip::udp::socket relay(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket peer(io, {asio::ip::make_address("127.0.0.1"), 0});
+    peer.set_option(asio::socket_base::receive_buffer_size(4 * 1024 * 1024));
+
+    // Several receive loops queueing onto one batch: past capacity it refuses rather than grow under the pieces
+    // already pointing into it
+    UdpBatch batch(relay, true);
+    const std::string payload(100, 'x');
+    size_t accepted = 0;
+    for (size_t i = 0; i < UdpBatch::MAX_QUEUED + 10; ++i) {
+        uint8_t header[] = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xFF)};
+        if (batch.queue(header, {reinterpret_cast<const uint8_t*>(payload.data()), payload.size()},
+                        peer.local_endpoint()))
+            ++accepted;
+    }
+    EXPECT_EQ(accepted, UdpBatch::MAX_QUEUED);
+    EXPECT_TRUE(batch.full());
+    while (batch.has_queued())
+        ASSERT_TRUE(batch.send(relay).has_value());
+    EXPECT_FALSE(batch.full());
+
+    for (size_t i = 0; i < accepted; ++i) {
+        uint8_t reply[256];
+        asio::ip::udp::endpoint sender;
+        size_t n = peer.receive_from(asio::buffer(reply), sender);
+        ASSERT_EQ(n, 2 + payload.size());
+        EXPECT_EQ(static_cast<size_t>((reply[0] << 8) | reply[1]), i);
+    }
+}
+
+namespace {
+
+std::vector<uint8_t> ipv4_key(uint8_t last_octet, uint16_t port) {
+    return {0x01, 10, 0, 0, last_octet, static_cast<uint8_t>(port >> 8), static_cast<uint8_t>(port & 0xFF)};
+}
+
+} // namespace
+
+TEST(UdpNatTableTest, FindsEntriesByRawHeaderBytes) {
+    UdpNatTable nat;
+    auto now = UdpNatTable::clock::now();
+
+    std::vector<uint8_t> domain_key = {0x03, 8, 'd', 'n', 's', '.', 't', 'e', 's', 't', 0x00, 0x35};
+    asio::ip::udp::endpoint resolved(asio::ip::make_address("192.0.2.53"), 53);
+    nat.insert(domain_key, resolved, now);
+
+    auto* entry = nat.find(domain_key, now);
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->target, resolved);
+
+    // The reply header names the address datagrams come back from
+    std::vector<uint8_t> expected_reply = {0x00, 0x00, 0x00, 0x01, 192, 0, 2, 53, 0x00, 0x35};
+    EXPECT_EQ(std::vector<uint8_t>(entry->reply().begin(), entry->reply().end()), expected_reply);
+
+    std::array<uint8_t, UdpNatTable::MAX_IP_KEY> key;
+    size_t key_len = UdpNatTable::encode(resolved, key);
+    EXPECT_EQ(std::vector<uint8_t>(key.begin(), key.begin() + key_len),
+              std::vector<uint8_t>(expected_reply.begin() + 3, expected_reply.end()));
+    EXPECT_EQ(nat.find({key.data(), key_len}, now), nullptr);
+}
+
+TEST(UdpNatTableTest, IdleEntriesExpire) {
+    UdpNatTable nat;
+    auto now = UdpNatTable::clock::now();
+    auto key = ipv4_key(1, 53);
+    nat.insert(key, {asio::ip::make_address("10.0.0.1"), 53}, now);
+
+    EXPECT_NE(nat.find(key, now + UdpNatTable::IDLE_TIMEOUT / 2), nullptr);
+    // The lookup above counted as use
+    EXPECT_NE(nat.find(key, now + UdpNatTable::IDLE_TIMEOUT), nullptr);
+    EXPECT_EQ(nat.find(key, now + 3 * UdpNatTable::IDLE_TIMEOUT), nullptr);
+    EXPECT_EQ(nat.size(), 0u);
+}
+
+TEST(UdpNatTableTest, StaysBoundedAndEvictsLeastRecentlyUsed) {
+    UdpNatTable nat;
+    auto now = UdpNatTable::clock::now();
+
+    for (uint8_t i = 0; i < UdpNatTable::MAX_ENTRIES; ++i)
+        nat.insert(ipv4_key(i, 1000 + i), {asio::ip::make_address("10.0.0.1"), 1000}, now + std::chrono::seconds(i));
+    EXPECT_EQ(nat.size(), UdpNatTable::MAX_ENTRIES);
+
+    // Touch the oldest so the second oldest becomes the victim
+    auto later = now + std::chrono::seconds(UdpNatTable::MAX_ENTRIES);
+    ASSERT_NE(nat.find(ipv4_key(0, 1000), later), nullptr);
+    nat.insert(ipv4_key(200, 53), {asio::ip::make_address("10.0.0.200"), 53}, later);
+
+    EXPECT_EQ(nat.size(), UdpNatTable::MAX_ENTRIES);
+    EXPECT_EQ(nat.find(ipv4_key(1, 1001), later), nullptr);
+    // Every other entry is still reachable after the deletion reshuffled probe chains
+    for (uint8_t i = 2; i < UdpNatTable::MAX_ENTRIES; ++i)
+        EXPECT_NE(nat.find(ipv4_key(i, 1000 + i), later), nullptr) << int(i);
+    EXPECT_NE(nat.find(ipv4_key(0, 1000), later), nullptr);
+    EXPECT_NE(nat.find(ipv4_key(200, 53), later), nullptr);
+}
+
+TEST(PendingDatagramsTest, StartsOneResolutionPerDestinationWithinBounds) {
+    PendingDatagrams<DestinationKey, DestinationKeyHash> pending(2, 2, 8);
+    auto& dropped = Metrics::local().dropped(UdpDrop::PENDING_FULL);
+    uint64_t dropped_before = dropped.value();
+    DestinationKey first(ipv4_key(1, 53));
+    DestinationKey second(ipv4_key(2, 53));
+    std::vector<uint8_t> payload = {1, 2, 3, 4};
+
+    EXPECT_TRUE(pending.hold(first, payload));
+    EXPECT_FALSE(pending.hold(first, payload));
+    // Past the per-destination bounds: held datagrams stay, the new one is dropped
+    EXPECT_FALSE(pending.hold(first, payload));
+    EXPECT_TRUE(pending.hold(second, payload));
+    // Past the destination bound: dropped, and no resolution starts
+    EXPECT_FALSE(pending.hold(DestinationKey(ipv4_key(3, 53)), payload));
+    EXPECT_EQ(dropped.value() - dropped_before, 2u);
+
+    auto held = pending.take(first);
+    ASSERT_TRUE(held.has_value());
+    EXPECT_EQ(held->size(), 2u);
+    EXPECT_EQ(held->front(), payload);
+    EXPECT_FALSE(pending.take(first).has_value());
+
+    pending.forget_if([&](const DestinationKey& key) { return key == second; });
+    EXPECT_EQ(pending.size(), 0u);
+}
+
+namespace {
+
+// Resolves every name to 127.0.0.1, but only once release() is called
+class HeldResolver : public ResolverBackend {
+  public:
+    void lookup(const std::string&, Callback done) override {
+        std::lock_guard lock(mutex_);
+        held_.push_back(std::move(done));
+    }
+
+    void release() {
+        std::vector<Callback> held;
+        {
+            std::lock_guard lock(mutex_);
+            held.swap(held_);
+        }
+        for (auto& done : held)
+            done({{}, {asio::ip::make_address("127.0.0.1")}, std::chrono::seconds(30)});
+    }
+
+  private:
+    std::mutex mutex_;
+    std::vector<Callback> held_;
+};
+
+} // namespace
+
+TEST(UdpResolutionTest, SlowDomainDoesNotStallOtherDestinations) {
+    auto backend = std::make_shared<HeldResolver>();
+    asio::io_context server_io;
+    Server server(server_io, 0, "127.0.0.1", {.resolver = std::make_shared<ResolverCache>(backend)});
+    server.start();
+    std::thread server_thread([&] {
+        auto work_guard = asio::make_work_guard(server_io);
+        server_io.run();
+    });
+
+    asio::io_context io;
+    asio::ip::tcp::socket control(io);
+    control.connect({asio::ip::make_address("127.0.0.1"), server.port()});
+    uint8_t greeting[] = {0x05, 0x01, 0x00};
+    asio::write(control, asio::buffer(greeting));
+    uint8_t method[2];
+    asio::read(control, asio::buffer(method));
+    uint8_t associate[] = {0x05, 0x03, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+    asio::write(control, asio::buffer(associate));
+    uint8_t reply[10];
+    asio::read(control, asio::buffer(reply));
+    ASSERT_EQ(reply[1], 0x00);
+    asio::ip::udp::endpoint relay_ep(asio::ip::make_address("127.0.0.1"), (reply[8] << 8) | reply[9]);
+
+    asio::ip::udp::socket target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    asio::ip::udp::socket client(io, {asio::ip::make_address("127.0.0.1"), 0});
+
+    auto send = [&](std::vector<uint8_t> header, const std::string& msg) {
+        header.push_back(static_cast<uint8_t>(target_port >> 8));
+        header.push_back(static_cast<uint8_t>(target_port & 0xFF));
+        header.insert(header.end(), msg.begin(), msg.end());
+        client.send_to(asio::buffer(header), relay_ep);
+    };
+    auto receive_at_target = [&] {
+        char buf[256];
+        asio::ip::udp::endpoint sender;
+        size_t n = target.receive_from(asio::buffer(buf), sender);
+        return std::string(buf, n);
+    };
+
+    // The first datagram waits on DNS; the second, to a literal address, must not wait behind it
+    send({0x00, 0x00, 0x00, 0x03, 9, 's', 'l', 'o', 'w', '.', 't', 'e', 's', 't'}, "by name");
+    send({0x00, 0x00, 0x00, 0x01, 127, 0, 0, 1}, "by address");
+    EXPECT_EQ(receive_at_target(), "by address");
+
+    // Once the name resolves, the held datagram follows
+    backend->release();
+    EXPECT_EQ(receive_at_target(), "by name");
+
+    control.close();
+    server_io.stop();
+    server_thread.join();
+}
+
+TEST(SharedUdpRelayTest, AssociationsShareThePortButGetTheirOwnReplies) {
+    asio::io_context server_io;
+    Server server(server_io, 0, "127.0.0.1", {.udp_relay = UdpRelayMode::SHARED});
+    server.start();
+    std::thread server_thread([&] {
+        auto work_guard = asio::make_work_guard(server_io);
+        server_io.run();
+    });
+
+    asio::io_context io;
+    asio::ip::udp::socket client_a(io, {asio::ip::make_address("127.0.0.1"), 0});
+    asio::ip::udp::socket client_b(io, {asio::ip::make_address("127.0.0.1"), 0});
+
+    // A leaves its port to be learned; B names it in DST.ADDR/PORT
+    auto associate = [&](asio::ip::tcp::socket& control, uint16_t from_port) {
+        control.connect({asio::ip::make_address("127.0.0.1"), server.port()});
+        uint8_t greeting[] = {0x05, 0x01, 0x00};
+        asio::write(control, asio::buffer(greeting));
+        uint8_t method[2];
+        asio::read(control, asio::buffer(method));
+        uint8_t request[] = {0x05, 0x03, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(from_port >> 8),
+                             static_cast<uint8_t>(from_port & 0xFF)};
+        asio::write(control, asio::buffer(request));
+        uint8_t reply[10];
+        asio::read(control, asio::buffer(reply));
+        EXPECT_EQ(reply[1], 0x00);
+        return static_cast<uint16_t>((reply[8] << 8) | reply[9]);
+    };
+    asio::ip::tcp::socket control_a(io);
+    asio::ip::tcp::socket control_b(io);
+    uint16_t port_a = associate(control_a, 0);
+    uint16_t port_b = associate(control_b, client_b.local_endpoint().port());
+    ASSERT_EQ(port_a, port_b);
+    asio::ip::udp::endpoint relay_ep(asio::ip::make_address("127.0.0.1"), port_a);
+
+    // One target, reached by both clients: each must be mapped to its own relay port
+    asio::ip::udp::socket target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    std::vector<asio::ip::udp::endpoint> seen;
+    std::thread target_thread([&] {
+        for (int i = 0; i < 2; ++i) {
+            char buf[256];
+            asio::ip::udp::endpoint sender;
+            size_t n = target.receive_from(asio::buffer(buf), sender);
+            seen.push_back(sender);
+            target.send_to(asio::buffer(buf, n), sender);
+        }
+    });
+
+    auto send = [&](asio::ip::udp::socket& client, const std::string& msg) {
+        std::vector<uint8_t> packet = {0x00, 0x00, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(target_port >> 8),
+                                       static_cast<uint8_t>(target_port & 0xFF)};
+        packet.insert(packet.end(), msg.begin(), msg.end());
+        client.send_to(asio::buffer(packet), relay_ep);
+    };
+    auto receive = [](asio::ip::udp::socket& client) {
+        uint8_t buf[256];
+        asio::ip::udp::endpoint sender;
+        size_t n = client.receive_from(asio::buffer(buf), sender);
+        EXPECT_EQ(buf[3], 0x01);
+        return std::string(reinterpret_cast<char*>(&buf[10]), n - 10);
+    };
+
+    send(client_a, "from a");
+    EXPECT_EQ(receive(client_a), "from a");
+    send(client_b, "from b");
+    EXPECT_EQ(receive(client_b), "from b");
+
+    target_thread.join();
+    ASSERT_EQ(seen.size(), 2u);
+    EXPECT_NE(seen[0], seen[1]);
+
+    control_a.close();
+    control_b.close();
+    server_io.stop();
+    server_thread.join();
+}
+
+TEST(SharedUdpRelayTest, RepliesFromEveryPortShareTheClientPort) {
+    asio::io_context server_io;
+    Server server(server_io, 0, "127.0.0.1", {.udp_relay = UdpRelayMode::SHARED});
+    server.start();
+    std::thread server_thread([&] {
+        auto work_guard = asio::make_work_guard(server_io);
+        server_io.run();
+    });
+
+    // One client per relay port: flows to the same target land on different ports, and every reply funnels back
+    // through port 0. Bursts from all of them at once keep port 0's queue busy while the other loops receive.
+    constexpr size_t CLIENTS = 4;
+    constexpr size_t BURST = 2000;
+    asio::io_context io;
+    asio::ip::udp::socket target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    std::vector<std::unique_ptr<asio::ip::udp::socket>> clients;
+    std::vector<std::unique_ptr<asio::ip::tcp::socket>> controls;
+    asio::ip::udp::endpoint relay_ep;
+    for (size_t c = 0; c < CLIENTS; ++c) {
+        asio::ip::udp::endpoint any_port(asio::ip::make_address("127.0.0.1"), 0);
+        auto& client = *clients.emplace_back(std::make_unique<asio::ip::udp::socket>(io, any_port));
+        client.set_option(asio::socket_base::receive_buffer_size(4 * 1024 * 1024));
+        auto& control = *controls.emplace_back(std::make_unique<asio::ip::tcp::socket>(io));
+        control.connect({asio::ip::make_address("127.0.0.1"), server.port()});
+        uint8_t greeting[] = {0x05, 0x01, 0x00};
+        asio::write(control, asio::buffer(greeting));
+        uint8_t method[2];
+        asio::read(control, asio::buffer(method));
+        uint16_t from = client.local_endpoint().port();
+        uint8_t request[] = {0x05, 0x03, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(from >> 8),
+                             static_cast<uint8_t>(from & 0xFF)};
+        asio::write(control, asio::buffer(request));
+        uint8_t reply[10];
+        asio::read(control, asio::buffer(reply));
+        ASSERT_EQ(reply[1], 0x00);
+        relay_ep = {asio::ip::make_address("127.0.0.1"), static_cast<uint16_t>((reply[8] << 8) | reply[9])};
+    }
+
+    auto send = [&](asio::ip::udp::socket& client, const std::string& msg) {
+        std::vector<uint8_t> packet = {0x00, 0x00, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(target_port >> 8),
+                                       static_cast<uint8_t>(target_port & 0xFF)};
+        packet.insert(packet.end(), msg.begin(), msg.end());
+        client.send_to(asio::buffer(packet), relay_ep);
+    };
+
+    // Learn each client's relay port, then answer all of them in one interleaved burst
+    std::vector<asio::ip::udp::endpoint> mapped(CLIENTS);
+    for (size_t c = 0; c < CLIENTS; ++c) {
+        send(*clients[c], std::to_string(c));
+        char buf[64];
+        asio::ip::udp::endpoint sender;
+        size_t n = target.receive_from(asio::buffer(buf), sender);
+        mapped[std::stoul(std::string(buf, n))] = sender;
+    }
+    std::string reply(512, 'r');
+    for (size_t i = 0; i < BURST; ++i) {
+        for (const auto& relay_port : mapped)
+            target.send_to(asio::buffer(reply), relay_port);
+    }
+
+    // Whatever got through arrived whole, from the target, to the right client
+    for (auto& client : clients) {
+        client.non_blocking(true);
+        size_t received = 0;
+        auto quiet_since = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - quiet_since < std::chrono::milliseconds(300)) {
+            uint8_t buf[1024];
+            asio::ip::udp::endpoint sender;
+            asio::error_code ec;
+            size_t n = client->receive_from(asio::buffer(buf), sender, 0, ec);
+            if (ec == asio::error::would_block) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            ASSERT_FALSE(ec) << ec.message();
+            ASSERT_EQ(n, 10 + reply.size());
+            EXPECT_EQ((buf[8] << 8) | buf[9], target_port);
+            ++received;
+            quiet_since = std::chrono::steady_clock::now();
+        }
+        EXPECT_GT(received, 0u);
+        client->non_blocking(false);
+    }
+
+    // And the relay is still relaying
+    send(*clients[0], "again");
+    char buf[64];
+    asio::ip::udp::endpoint sender;
+    size_t n = target.receive_from(asio::buffer(buf), sender);
+    EXPECT_EQ(std::string(buf, n), "again");
+
+    for (auto& control : controls)
+        control->close();
+    server_io.stop();
+    server_thread.join();
+}
+
+namespace {
+
+// UDP ASSOCIATE from 127.0.0.1:from_port over `control`; returns the relay port
+uint16_t associate(asio::ip::tcp::socket& control, uint16_t server_port, uint16_t from_port) {
+    control.connect({asio::ip::make_address("127.0.0.1"), server_port});
+    uint8_t greeting[] = {0x05, 0x01, 0x00};
+    asio::write(control, asio::buffer(greeting));
+    uint8_t method[2];
+    asio::read(control, asio::buffer(method));
+    uint8_t request[] = {0x05, 0x03, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(from_port >> 8),
+                         static_cast<uint8_t>(from_port & 0xFF)};
+    asio::write(control, asio::buffer(request));
+    uint8_t reply[10];
+    asio::read(control, asio::buffer(reply));
+    EXPECT_EQ(reply[1], 0x00);
+    return static_cast<uint16_t>((reply[8] << 8) | reply[9]);
+}
+
+// `clients` associations through a shared relay with the given ports all send to one target, which echoes whatever
+// arrives. Returns how many distinct relay ports the target saw; each client that got through must get its own echo.
+size_t relay_to_one_target(SharedUdpRelayOptions ports, size_t clients) {
+    asio::io_context server_io;
+    Server server(server_io, 0, "127.0.0.1", {.udp_relay = UdpRelayMode::SHARED, .shared_udp = ports});
+    server.start();
+    std::thread server_thread([&] {
+        auto work_guard = asio::make_work_guard(server_io);
+        server_io.run();
+    });
+
+    asio::io_context io;
+    asio::ip::udp::socket target(io, {asio::ip::make_address("127.0.0.1"), 0});
+    uint16_t target_port = target.local_endpoint().port();
+    std::vector<std::unique_ptr<asio::ip::udp::socket>> sockets;
+    std::vector<std::unique_ptr<asio::ip::tcp::socket>> controls;
+    asio::ip::udp::endpoint relay_ep;
+    for (size_t c = 0; c < clients; ++c) {
+        asio::ip::udp::endpoint any_port(asio::ip::make_address("127.0.0.1"), 0);
+        auto& client = *sockets.emplace_back(std::make_unique<asio::ip::udp::socket>(io, any_port));
+        auto& control = *controls.emplace_back(std::make_unique<asio::ip::tcp::socket>(io));
+        relay_ep = {asio::ip::make_address("127.0.0.1"),
+                    associate(control, server.port(), client.local_endpoint().port())};
+
+        std::string msg = std::to_string(c);
+        std::vector<uint8_t> packet = {0x00, 0x00, 0x00, 0x01, 127, 0, 0, 1, static_cast<uint8_t>(target_port >> 8),
+                                       static_cast<uint8_t>(target_port & 0xFF)};
+        packet.insert(packet.end(), msg.begin(), msg.end());
+        client.send_to(asio::buffer(packet), relay_ep);
+    }
+
+    // Echo until the relay goes quiet
+    std::vector<asio::ip::udp::endpoint> senders;
+    target.non_blocking(true);
+    auto quiet_since = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - quiet_since < std::chrono::milliseconds(300)) {
+        char buf[64];
+        asio::ip::udp::endpoint sender;
+        asio::error_code ec;
+        size_t n = target.receive_from(asio::buffer(buf), sender, 0, ec);
+        if (ec == asio::error::would_block) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        EXPECT_FALSE(ec) << ec.message();
+        EXPECT_EQ(std::ranges::find(senders, sender), senders.end());
+        senders.push_back(sender);
+        target.send_to(asio::buffer(buf, n), sender);
+        quiet_since = std::chrono::steady_clock::now();
+    }
+
+    size_t echoed = 0;
+    for (size_t c = 0; c < clients; ++c) {
+        auto& client = *sockets[c];
+        client.non_blocking(true);
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            uint8_t buf[64];
+            asio::ip::udp::endpoint sender;
+            asio::error_code ec;
+            size_t n = client.receive_from(asio::buffer(buf), sender, 0, ec);
+            if (ec == asio::error::would_block) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            EXPECT_EQ(std::string(reinterpret_cast<char*>(&buf[10]), n - 10), std::to_string(c));
+            ++echoed;
+            break;
+        }
+    }
+    EXPECT_EQ(echoed, senders.size());
+
+    for (auto& control : controls)
+        control->close();
+    server_io.stop();
+    server_thread.join();
+    return senders.size();
+}
+
+} // namespace
+
+TEST(SharedUdpRelayTest, MoreAssociationsThanPortsReachOneTarget) {
+    // Beyond the fixed ports, each association gets a port of its own, so the target's replies still find it
+    EXPECT_EQ(relay_to_one_target({.ports = 2}, 6), 6u);
+}
+
+TEST(SharedUdpRelayTest, AssociationsPastMaxPortsAreDropped) {
+    EXPECT_EQ(relay_to_one_target({.ports = 2, .max_ports = 4}, 6), 4u);
+}